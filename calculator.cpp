@@ -1,9 +1,54 @@
 #include <iostream>
-#include <stack>
 #include <sstream>  // for std::stringstream
 //#include <format>   // for std::format, but it's c++ std 20. Only gcc 13.1 or above supports it !!
 #include <iomanip>  // for std::fixed, std::setprecision, ... to control cout's output for int/float/double
 #include <cmath>    // for floor, ceil, pow
+#include <vector>
+#include <algorithm>  // for std::reverse
+#include <cstdint>    // for uint32_t, uint64_t
+#include <map>
+#include <limits>   // for std::numeric_limits<T>::quiet_NaN()
+#include <type_traits>  // for std::is_same
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>  // for SSE/AVX intrinsics, ex. _mm256_add_pd
+#endif
+#include <chrono>   // for std::chrono::steady_clock, to time the tests
+#include <cstring>  // for memcmp
+#include <cstdlib>  // for atoi, strtod
+#include <deque>
+#include <functional>  // for std::function
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <list>
+#include <unordered_map>
+#include <string_view>
+#include <charconv>  // for std::from_chars
+#include <system_error>  // for std::errc
+#include <cstdio>   // for fread/fwrite, used by the batch mode
+#include <memory>   // for std::unique_ptr
+#include <utility>  // for std::index_sequence
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>   // for mmap
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#define Have_Posix_Mmap
+#define Have_Posix_Io   // read/write on file descriptors, used by the pipe mode.
+#endif
+#if defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <csignal>
+#define Have_Epoll_Server
+#endif
+#if defined(_WIN32) && (defined(__x86_64__) || defined(_M_X64))
+#define NOMINMAX   // keep std::min/std::max usable
+#include <windows.h>    // for VirtualAlloc, used by the JIT
+#endif
 
 
 // notice we use the following statement to tell compiler to try search symbols with leading "std::" as well.
@@ -23,517 +68,7121 @@ using namespace std;
 //
 //#define Also_Run_Precision_Test
 
-// T can be double or float.
+// Whether to enable the part testing Compile()/Execute() against Calculate(), and timing them.
+//
+//#define Also_Run_Compile_Test
+
+// Whether to enable the part testing ExecuteBatch() over columns of variables, for float and double.
+//
+//#define Also_Run_Batch_Test
+
+// Whether to enable the part testing the SIMD block kernels against the scalar one, and timing them.
+//
+//#define Also_Run_Simd_Test
+
+// Whether to enable the part testing CalculateInParallel()/ExecuteBatchInParallel() with different
+// number of threads.
+//
+//#define Also_Run_Parallel_Test
+
+// How much Calculator traces how an expression is tokenized and calculated, decided at compile time :
+//   0 (kTraceOff)    : nothing. the trace code is not even compiled in, so it costs nothing.
+//   1 (kTraceTokens) : every operand, variable and operator the tokenizer finds.
+//   2 (kTraceStack)  : also every operator calculated on the operand stack.
+// It only applies to the calculator of the console mode in main(), the batch mode and the tests
+// always use kTraceOff. Release builds (with -DNDEBUG) have no trace unless set explicitly.
+//
+//#define Calculator_Trace_Level 2
+#ifndef Calculator_Trace_Level
+#ifdef NDEBUG
+#define Calculator_Trace_Level 0
+#else
+#define Calculator_Trace_Level 1
+#endif
+#endif
+
+// Whether to enable the part testing the cost of Calculate() at each trace level.
+//
+//#define Also_Run_Trace_Test
+
+// Whether to enable the part counting heap allocations of Calculate()/Execute()/ExecuteBatch() once
+// warmed up, which should be none. It replaces the global operator new to count them.
+//
+//#define Also_Run_Allocation_Test
+
+// Whether to enable the part testing Optimize() on a corpus of expressions : instructions before and
+// after, results against the plans not optimized, and timing them.
+//
+//#define Also_Run_Optimize_Test
+
+// Whether to enable the part testing ResultCache on repeated expressions : hits/misses, the byte
+// budget, and the time per Calculate() with and without it, on one and on many threads.
+//
+//#define Also_Run_Cache_Test
+
+// Whether to enable the part testing FormatBestPrecision() against the way results used to be
+// formatted (the pow/floor loop and cout << fixed << setprecision), and timing them.
+//
+//#define Also_Run_Format_Test
+
+// Whether to enable the part testing Calculator<Decimal> : exact results, values spilling over 128
+// bits, and its speed against Calculator<double>.
+//
+//#define Also_Run_Decimal_Test
+
+// Whether to enable the part testing ParseNumber() against strtod(), and timing it against the
+// stringstream way of reading numbers.
+//
+//#define Also_Run_Lexer_Test
+
+// Whether to enable the part testing the JIT (JitFunction, TieredExpression) bit for bit against
+// Execute()/ExecuteBatch() on random expressions, and timing them.
+//
+//#define Also_Run_Jit_Test
+
+// Whether to enable the part testing calc::compile() : static_assert()s on constant formulas, and
+// the compile-time expressions against Calculate()/Execute() at run time, and timing them.
+//
+//#define Also_Run_Constexpr_Test
+
+// Whether to run the benchmark : corpora of generated expressions (short, long, deeply nested, big
+// literals, operator mixes, variables) through Calculate() once each, Execute() repeatedly (also
+// with the JIT) and ExecuteBatch(), for float and double. It reports expressions/s, ns per token
+// and heap allocations per evaluation, to compare before/after a change on the same machine.
+//
+//#define Also_Run_Benchmark
+
+// Whether to enable the part testing the instrumentation counters, histograms and snapshots. It
+// turns the instrumentation on.
+//
+//#define Also_Run_Instrumentation_Test
+
+// Whether to enable the part testing the server mode : the frames of the protocol, and a server on a
+// temporary Unix domain socket against the load generator, with and without pipelining.
+//
+//#define Also_Run_Server_Test
+
+// Whether to enable the part testing ExpressionGraph : literals and variables changed in formulas
+// sharing sub-expressions, against Execute() of the whole formulas, and timing them.
+//
+//#define Also_Run_Incremental_Test
+
+// Whether to enable the part testing the operators and functions of kOperators : their results
+// through every path, math::Exp()/Log() against the C library, the SIMD levels and the JIT on them,
+// and the parse time of long formulas.
+//
+//#define Also_Run_Operators_Test
+
+// Whether to enable the part testing the checks of malformed expressions : the error and its
+// position for each kind, randomly broken expressions against Compile() and Execute(), and the
+// speed of a batch with bad lines in it.
+//
+//#define Also_Run_Validation_Test
+
+// Whether to enable the part testing MixedCalculator : the precision chosen for each kind of
+// expression, the fallbacks to double, the error of float against its bound, and the speed against
+// Calculator<double> on integer and mixed expressions.
+//
+//#define Also_Run_Mixed_Test
+
+// Whether Calculator counts tokens, reductions, stack depth and allocations, and times every
+// phase into latency histograms, see Instrumentation. 0 : the hooks are not even compiled in.
+//
+#ifndef Calculator_Instrumentation
+#ifdef Also_Run_Instrumentation_Test
+#define Calculator_Instrumentation 1
+#else
+#define Calculator_Instrumentation 0
+#endif
+#endif
+
+// Instruction set of a compiled expression.
+//
+// Compile() turns the infix expression into Reverse Polish Notation (RPN), ie. operands come
+// first and the operator follows them, so no parentheses or priorities are needed any more :
+//
+//   1+2*(3+4)   =>   1 2 3 4 + * +
+//
+// Executing RPN only needs one stack : push operands, and for each operator pop its operands (2, or
+// 1 for a negation or sqrt()) and push the result back. The last value left on the stack is the result.
+enum class OpCode : unsigned char {
+  kPushConst,   // push "value" onto the stack.
+  kPushVar,     // push the value of variable No. "index" onto the stack.
+  kAdd,         // pop operand2, operand1, push operand1 + operand2.
+  kSub,
+  kMul,
+  kDiv,
+  kMod,         // the remainder of operand1 / operand2 truncated toward 0, like fmod(), ex. -7%3 = -1.
+  kPow,         // operand1 ^ operand2.
+  kNeg,         // pop operand1, push -operand1.
+  kSqrt,        // the functions : pop their arguments, push the result.
+  kAbs,
+  kExp,
+  kLog,         // natural logarithm.
+  kMin,
+  kMax,
+  kCount,       // not an instruction, the number of them.
+};
+
 template <typename T>
-class Calculator {
-private:
-  stack<T> operands_;
-  stack<char> operators_;
-  T result_ = 0;
-  int result_precision_ = 0;
+struct Instruction {
+  OpCode code;
+  int index;    // only used by kPushVar.
+  T value;      // only used by kPushConst.
+};
 
-  int GetPriority(char op) {
-    switch (op) {
-      case '+':
-      case '-':
-        return 1;
-      case '*':
-      case '/':
-        return 2;
-      default:
-        return 0;
-    }
+// How an instruction is written in an expression.
+enum class Notation : unsigned char {
+  kOperand,    // the push instructions.
+  kInfix,      // "a op b".
+  kPrefix,     // "op a", ex. the negation "-a".
+  kFunction,   // "name(a)" or "name(a,b)".
+};
+
+// Everything the parsers and the executors need to know about an instruction. Adding an operator
+// or a function is one line in kOperators and one case in ApplyOperator(), both parsers take it
+// from there. Without a SIMD form in the block kernels it's calculated value by value, and without
+// a native form the JIT leaves the plan to the interpreter.
+struct OperatorInfo {
+  OpCode code;
+  const char* symbol;       // the character of an operator, or the name of a function.
+  Notation notation;
+  int priority;             // higher binds tighter.
+  bool right_associative;   // ex. 2^3^2 is 2^(3^2), but 8/4/2 is (8/4)/2.
+  int arity;                // operands taken off the stack.
+  bool pure;                // the result only depends on the operands : Optimize() may calculate
+                            // it once when they are constants.
+  bool compile_time;        // ApplyOperator() can calculate it in a constant expression, so
+                            // calc::compile() folds it. The <cmath> functions can't (until C++26).
+};
+
+// In the order of OpCode. The negation binds looser than ^ and tighter than * /, so -2^2 is -4 as
+// in math, and -2*3 is (-2)*3.
+constexpr OperatorInfo kOperators[] = {
+  // code              symbol   notation             priority right arity pure  compile_time
+  {OpCode::kPushConst, "",      Notation::kOperand,  0,       false, 0,   true, true},
+  {OpCode::kPushVar,   "",      Notation::kOperand,  0,       false, 0,   true, true},
+  {OpCode::kAdd,       "+",     Notation::kInfix,    1,       false, 2,   true, true},
+  {OpCode::kSub,       "-",     Notation::kInfix,    1,       false, 2,   true, true},
+  {OpCode::kMul,       "*",     Notation::kInfix,    2,       false, 2,   true, true},
+  {OpCode::kDiv,       "/",     Notation::kInfix,    2,       false, 2,   true, true},
+  {OpCode::kMod,       "%",     Notation::kInfix,    2,       false, 2,   true, false},
+  {OpCode::kPow,       "^",     Notation::kInfix,    4,       true,  2,   true, false},
+  {OpCode::kNeg,       "-",     Notation::kPrefix,   3,       true,  1,   true, true},
+  {OpCode::kSqrt,      "sqrt",  Notation::kFunction, 0,       false, 1,   true, false},
+  {OpCode::kAbs,       "abs",   Notation::kFunction, 0,       false, 1,   true, false},
+  {OpCode::kExp,       "exp",   Notation::kFunction, 0,       false, 1,   true, false},
+  {OpCode::kLog,       "log",   Notation::kFunction, 0,       false, 1,   true, false},
+  {OpCode::kMin,       "min",   Notation::kFunction, 0,       false, 2,   true, true},
+  {OpCode::kMax,       "max",   Notation::kFunction, 0,       false, 2,   true, true},
+};
+
+constexpr bool OperatorsInOrder(void) {
+  for (size_t i = 0; i < sizeof(kOperators) / sizeof(kOperators[0]); i++)
+    if ((size_t)kOperators[i].code != i) return false;
+  return sizeof(kOperators) / sizeof(kOperators[0]) == (size_t)OpCode::kCount;
+}
+static_assert(OperatorsInOrder(), "kOperators must have one entry per OpCode, in the same order");
+
+constexpr const OperatorInfo& Info(OpCode code) { return kOperators[(int)code]; }
+constexpr int Arity(OpCode code) { return kOperators[(int)code].arity; }
+// values an instruction adds to the stack : 1 for a push, 0 for a negation, -1 for a + b.
+constexpr int StackEffect(OpCode code) { return 1 - kOperators[(int)code].arity; }
+
+// '(' on the stack of operators of the parsers. kPushConst is never an operator, so it can't be
+// taken for one.
+constexpr OpCode kOpenParenthesis = OpCode::kPushConst;
+
+// The infix operators by their character, so the parsers find one in a single load.
+struct InfixTable {
+  OpCode by_char[128] = {};   // kCount for the characters which are not an infix operator.
+
+  constexpr InfixTable() {
+    for (OpCode& code : by_char) code = OpCode::kCount;
+    for (const OperatorInfo& info : kOperators)
+      if (info.notation == Notation::kInfix) by_char[(unsigned char)info.symbol[0]] = info.code;
   }
+};
+constexpr InfixTable kInfixTable;
+
+// The infix operator written "ch", or kCount.
+constexpr OpCode InfixOperator(char ch) {
+  return (unsigned char)ch < 128? kInfixTable.by_char[(unsigned char)ch] : OpCode::kCount;
+}
+
+// The prefix operator written "ch", or kCount. A '+' before an operand changes nothing, the
+// parsers skip it.
+constexpr OpCode PrefixOperator(char ch) {
+  for (const OperatorInfo& info : kOperators)
+    if (info.notation == Notation::kPrefix && info.symbol[0] == ch) return info.code;
+  return OpCode::kCount;
+}
+
+// The function called "name", or kCount.
+constexpr OpCode FunctionOperator(string_view name) {
+  for (const OperatorInfo& info : kOperators)
+    if (info.notation == Notation::kFunction && name == info.symbol) return info.code;
+  return OpCode::kCount;
+}
+
+// Whether operator "top", waiting on the stack of operators, must be calculated before "op" which
+// comes after it : it binds tighter, or as tight and "op" is left-associative, ex. 1-2-3 is
+// (1-2)-3, but 2^3^2 is 2^(3^2) and --3 is -(-3).
+constexpr bool CalculatedBefore(OpCode top, OpCode op) {
+  return Info(top).priority > Info(op).priority ||
+         (Info(top).priority == Info(op).priority && !Info(op).right_associative);
+}
+
+// exp() and log() of double, written so that the SIMD versions of the block kernels (SseExp(),
+// SseLog()) do the same IEEE-754 operations in the same order on every lane, which gives the same
+// results bit for bit : no branch but selects, no table, and the exponent handled through the bits.
+// They are the fdlibm algorithms (Cody-Waite reduction and a minimax polynomial), under 1 ULP from
+// the exact result, like the libm functions but not always the same last bit.
+// float goes through double, which rounds to the nearest float (nearly always the exact one).
+// (as long as we don't compile with -ffast-math, or with FMA and -ffp-contract=fast, which would
+// fuse a*b+c differently in the scalar and SIMD code.)
+namespace math {
+
+constexpr double kShifter = 6755399441055744.0;   // 1.5 * 2^52 : x + kShifter - kShifter rounds x to an integer.
+constexpr double kLn2Hi = 6.93147180369123816490e-01;   // ln(2) in 2 parts, kLn2Hi * k is exact.
+constexpr double kLn2Lo = 1.90821492927058770002e-10;
+constexpr double kLog2e = 1.44269504088896338700e+00;
+constexpr double kExpP[] = {1.66666666666666019037e-01, -2.77777777770155933842e-03, 6.61375632143793436117e-05,
+                            -1.65339022054652515390e-06, 4.13813679705723846039e-08};
+constexpr double kLogLg[] = {6.666666666666735130e-01, 3.999999999940941908e-01, 2.857142874366239149e-01,
+                             2.222219843214978396e-01, 1.818357216161805012e-01, 1.531383769920937332e-01,
+                             1.479819860511658591e-01};
+constexpr double kSqrt2 = 1.41421356237309504880;
+constexpr double kMinNormal = 2.2250738585072014e-308;
+constexpr double kTwo54 = 18014398509481984.0;
+
+inline uint64_t Bits(double value) {
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  return bits;
+}
+inline double FromBits(uint64_t bits) {
+  double value;
+  memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+// 2^k for an integer k in [-1022, 1023], from the bits : k + 1023 ends in the low bits of
+// k + 1023 + kShifter, and shifting them to the exponent field drops the rest.
+inline double Pow2(double k) {
+  return FromBits(Bits(k + (1023 + kShifter)) << 52);
+}
+
+inline double Exp(double x) {
+  double clamped = x < 710.0? x : 710.0;   // beyond, the result is inf or 0 anyway.
+  clamped = clamped > -746.0? clamped : -746.0;
+  // x = k*ln(2) + r, |r| <= ln(2)/2, and exp(x) = 2^k * exp(r).
+  double k = (clamped * kLog2e + kShifter) - kShifter;
+  double hi = clamped - k * kLn2Hi;
+  double lo = k * kLn2Lo;
+  double r = hi - lo;
+  double r2 = r * r;
+  double c = r - r2 * (kExpP[0] + r2 * (kExpP[1] + r2 * (kExpP[2] + r2 * (kExpP[3] + r2 * kExpP[4]))));
+  double y = 1 - ((lo - (r * c) / (2 - c)) - hi);
+  // 2^k in 2 steps, so k up to 1024 (overflow) and down to -1076 (subnormal) is right.
+  double k1 = (k * 0.5 + kShifter) - kShifter;
+  double result = y * Pow2(k1) * Pow2(k - k1);
+  return x != x? x : result;
+}
+
+inline double Log(double x) {
+  // x = 2^e * m, m in [sqrt(2)/2, sqrt(2)). A subnormal x is made normal first.
+  bool subnormal = x < kMinNormal;
+  double scaled = subnormal? x * kTwo54 : x;
+  double bias = subnormal? 1023 + 54 : 1023;
+  uint64_t bits = Bits(scaled);
+  double e = (FromBits(((bits >> 52) & 0x7FF) | Bits(4503599627370496.0)) - 4503599627370496.0) - bias;
+  double m = FromBits((bits & 0x000FFFFFFFFFFFFFull) | Bits(1.0));
+  bool big = m > kSqrt2;
+  m = big? m * 0.5 : m;
+  e = big? e + 1 : e;
+  // log(m) = log(1+f) = f - f^2/2 + s*(f^2/2 + R(s^2)), s = f/(2+f).
+  double f = m - 1;
+  double hfsq = 0.5 * f * f;
+  double s = f / (2 + f);
+  double z = s * s;
+  double w = z * z;
+  double t1 = w * (kLogLg[1] + w * (kLogLg[3] + w * kLogLg[5]));
+  double t2 = z * (kLogLg[0] + w * (kLogLg[2] + w * (kLogLg[4] + w * kLogLg[6])));
+  double r = t2 + t1;
+  double result = e * kLn2Hi - ((hfsq - (s * (hfsq + r) + e * kLn2Lo)) - f);
+  result = x == 0? -numeric_limits<double>::infinity() : result;
+  result = x < 0? numeric_limits<double>::quiet_NaN() : result;
+  result = x == numeric_limits<double>::infinity()? x : result;
+  return x != x? x : result;
+}
+
+}  // namespace math
 
-  T calc_round(T value, int decimal_digits) {
-    return floor(value * pow(10, decimal_digits) + 0.5) / pow(10, decimal_digits);
+// exp() and log() of T : the ones above for float and double, the type's own (found by ADL) for the
+// others, ex. Decimal.
+template <typename T>
+T Exp(T x) {
+  if constexpr (is_same<T, double>::value) return math::Exp(x);
+  else if constexpr (is_same<T, float>::value) return (float)math::Exp((double)x);
+  else return exp(x);
+}
+
+template <typename T>
+T Log(T x) {
+  if constexpr (is_same<T, double>::value) return math::Log(x);
+  else if constexpr (is_same<T, float>::value) return (float)math::Log((double)x);
+  else return log(x);
+}
+
+// What is wrong with a malformed expression. Calculator finds it in the same single pass as it
+// parses, see TryCalculate().
+enum class ParseError : unsigned char {
+  kNone,
+  kEmpty,                 // nothing but spaces.
+  kUnexpectedCharacter,   // not in a number, a name, an operator, a parenthesis or ',', or a '.' without digits.
+  kMissingOperand,        // ex. "1+", "1+*2", "()", "max(1,)".
+  kMissingOperator,       // 2 operands in a row, ex. "2 3", "2a", "(1)(2)".
+  kUnbalancedClose,       // a ')' without its '(', ex. ")", "1+2)".
+  kUnbalancedOpen,        // a '(' without its ')', ex. "(2*3". Found at the end of the expression.
+  kUnknownFunction,       // a name followed by '(' which is not a function of kOperators, ex. "foo(2)".
+  kWrongArgumentCount,    // ex. "max(1)", "sqrt(1,2)".
+  kMisplacedComma,        // a ',' outside of the arguments of a function, ex. "1,2", "(1,2)".
+  kCount,
+};
+const char* const kParseErrorNames[] = {"ok", "empty expression", "unexpected character", "missing operand",
+                                        "missing operator", "unbalanced ')'", "unbalanced '('", "unknown function",
+                                        "wrong number of arguments", "',' outside of the arguments of a function"};
+static_assert(sizeof(kParseErrorNames) / sizeof(kParseErrorNames[0]) == (size_t)ParseError::kCount,
+              "a name for every ParseError");
+
+// The error and where it was found. 8 bytes, returned in a register : checking an expression costs
+// no allocation and no exception, whether it's good or not.
+struct ParseStatus {
+  ParseError error = ParseError::kNone;
+  uint32_t position = 0;   // the offset in the expression of the char where the error was found.
+
+  bool Ok(void) const { return error == ParseError::kNone; }
+  const char* Message(void) const { return kParseErrorNames[(int)error]; }
+};
+
+// Write "error : <message> at <position>" into "text", return its length, or 0 if it's too short.
+inline size_t FormatError(const ParseStatus& status, char* text, size_t size) {
+  int length = snprintf(text, size, "error : %s at %u", status.Message(), (unsigned)status.position);
+  return (length > 0 && (size_t)length < size)? (size_t)length : 0;
+}
+
+// The result of Calculator::TryCalculate(), like std::expected of C++23 : the value if Ok(),
+// otherwise the status says what's wrong, and the value is NaN.
+template <typename T>
+struct CalcResult {
+  T value;
+  ParseStatus status;
+
+  bool Ok(void) const { return status.Ok(); }
+};
+
+// What is wrong with the columns given to Calculator::ExecuteBatch() by the variable names.
+enum class BindError : unsigned char {
+  kNone,
+  kUnboundVariable,   // a variable of the plan has no column.
+  kColumnLength,      // a column has not as many rows as the others.
+  kCount,
+};
+const char* const kBindErrorNames[] = {"ok", "variable not bound to any column", "column of another length"};
+static_assert(sizeof(kBindErrorNames) / sizeof(kBindErrorNames[0]) == (size_t)BindError::kCount,
+              "a name for every BindError");
+
+// The error and the variable or column it is about, a view of the name in the plan or the columns.
+struct BindStatus {
+  BindError error = BindError::kNone;
+  string_view name;
+
+  bool Ok(void) const { return error == BindError::kNone; }
+  const char* Message(void) const { return kBindErrorNames[(int)error]; }
+};
+
+// Write "error : <message> \"<name>\"" into "text", return its length, or 0 if it's too short.
+inline size_t FormatError(const BindStatus& status, char* text, size_t size) {
+  int length = snprintf(text, size, "error : %s \"%.*s\"", status.Message(), (int)status.name.size(),
+                        status.name.data());
+  return (length > 0 && (size_t)length < size)? (size_t)length : 0;
+}
+
+// The compiled plan : an immutable flat array of RPN instructions.
+// Once compiled, a plan can be executed as many times as we want without touching the string again.
+template <typename T>
+struct CompiledExpression {
+  vector<Instruction<T>> code;
+  int max_depth = 0;  // max number of values on the stack at the same time, decided by Compile().
+  vector<string> variables;  // names of the variables, in the order of their first appearance.
+  // what Compile() found wrong in the expression. A malformed plan is the single constant NaN, so
+  // Execute(), ExecuteBatch() and the JIT need no check for it.
+  ParseStatus status;
+
+  // return the index of variable "name", or -1 if the expression doesn't use it.
+  int VariableIndex(string_view name) const {
+    for (size_t i = 0; i < variables.size(); i++)
+      if (variables[i] == name) return (int)i;
+    return -1;
   }
+};
 
-  void modify_result_to_best_precision(void){
-    int idxDigit = 0;
-    T result_after_round;
-    T difference;
-    
-    while(1) {
-      result_after_round = calc_round(result_, idxDigit);
-      difference = result_ - result_after_round;
-      // NOTICE : 
-      // We cannot use the expression (x-y == 0) to tell whether 2 floating point values are equivalent.
-      //   if (difference == 0) break;
-      //
-      // this is because arithmatic operations of floating point values will cause precision loss.
-      // ex. x = 0.3;
-      //     y = 0.3;
-      //     return (x == y);       // true
-      //     return ((x - y) == 0); // true
-      //     x = 0.1 + 0.2;         // the "+" operation cause precision loss. (if it is not optimised by pre-processor)
-      //     y = 0.3
-      //     return (x == y);       // false
-      //     return ((x - y) == 0); // false
-      //
-      // The correct way to tell the equivalence is by :
-      //     if (std::abs(x - y) * 2 / (x + y)) < threshold)  // say, threshold = 1e-6.
-      //        return equal.
-      if (difference < 0) difference = 0 - difference;
-      if ((difference * 2 / (result_ + result_after_round)) < 1e-6) break;
-      idxDigit++;
-    }
-    result_ = result_after_round;
-    result_precision_ = idxDigit;
+// The operators other than + - * /, see ApplyOperator(). Never inlined : its big switch and the
+// calls to fmod()/pow()/Exp()... would otherwise be inlined in every interpreter loop, where they
+// cost registers and code size to the 4 operators doing nearly all the work.
+template <typename T>
+__attribute__((noinline)) constexpr T ApplyOtherOperator(OpCode op, T operand1, T operand2) {
+  switch (op) {
+    case OpCode::kMod:
+      return fmod(operand1, operand2);
+    case OpCode::kPow:
+      return pow(operand1, operand2);
+    case OpCode::kNeg:
+      return -operand1;
+    case OpCode::kSqrt:
+      return sqrt(operand1);
+    case OpCode::kAbs:
+      return fabs(operand1);
+    case OpCode::kExp:
+      return Exp(operand1);
+    case OpCode::kLog:
+      return Log(operand1);
+    case OpCode::kMin:
+      return operand1 < operand2? operand1 : operand2;
+    case OpCode::kMax:
+      return operand1 > operand2? operand1 : operand2;
+    default:
+      return 0;
   }
+}
 
-  void show_result(void){
-    cout << fixed << setprecision(result_precision_);
-    cout << result_;
-    // set cout control back to default
-    cout << setprecision(6);  
-    cout.unsetf(ios::fixed);
+// The only place doing the real math, shared by Evaluate(), Execute(), the block kernels below and
+// the compile-time expressions of calc::compile(). An operator of 1 operand ignores operand2.
+// min() and max() give operand2 when the operands are not ordered (a NaN) or equal (0 and -0), the
+// same as the SSE/AVX min/max instructions.
+template <typename T>
+constexpr T ApplyOperator(OpCode op, T operand1, T operand2) {
+  switch (op) {
+    case OpCode::kAdd:
+      return operand1 + operand2;
+    case OpCode::kSub:
+      return operand1 - operand2;
+    case OpCode::kMul:
+      return operand1 * operand2;
+    case OpCode::kDiv:
+      return operand1 / operand2;
+    default:
+      return ApplyOtherOperator(op, operand1, operand2);
   }
-  
-public:
-  void Evaluate(const string& expression) {
-    // use stringstream (a stream with source/destination as a string),
-    // just like fstream is a stream using file as source/destination, cin/cout is a stream using 
-    // console device as the source/destination.
-    // Here we let "expression" act the source/destination of "ss". 
-    stringstream ss;
-
-    // "for (type x : container)" : 
-    // a new looping syntax in c++, meaning to use "iterator of container" to get one element each time.
-    for (char ch : expression) {  
-      if (isdigit(ch) || (ch == '.')) {
-        // operands_.push(ch - '0');
-        // 將數字添加到stringstream中
-        ss << ch;
-
-        // (DEBUG-1) : Whether the followed "ss.clear()" is necessary ? YES !! it's MUST !!
-        //
-        //   the following lines are to debug the issue observed that the stringstream fails to 
-        //   get "67890" when testing this program with input "12345+67890".
-        //
-        //   To reproduce the problem : comment out the line "ss.clear();" below and try with "12345+67890".
-        //
-        // refer to : https://cplusplus.com/reference/ios/ios/rdstate/
-        // ios::eofbit	: End-of-File reached on input operation. can be detected by eof().
-        // ios::badbit	: Read/writing error on i/o operation. can be checked by both fail() and bad().
-        // ios::failbit: Logical error on i/o operation. can be checked by fail().
-        //
-        cout << "pushed " << ch << " to ss. The multi-digit integer str so far is : \"" 
-          << ss.str() << "\"" << endl; // debug.
-        if (!ss.good()){
-          cout << "stringstream got eof, bad, or fail. (";
-          
-          // std::format() is c++ std 20 and is only supported in gcc 13.1 or above. don't use it.
-          //cout << format("state=0x{%x}", ss.rdstate()) << ", ";
-
-          // also notice the syntax CANNOT work :
-          //   cout "a" << (test)? "B" : "C" << "D"...
-          // the issue is ...................^^........ 
-          // the "<<" was interpreted as "operator <<"" of ["C"], but it should be operator << of [cout ..."C"]
-          // to make sure it is properly interpreted, we add the enclosing parentheses for it.
-          //   cout "a" << ((test)? "B" : "C") << "D" ...
-          if (ss.eof())
-            cout << "eof=" << ((ss.rdstate() & ios::eofbit)? "Y":"N") << " ";  // will be "Y" (2)
-          if (ss.bad())
-            cout << "bad=" << (ss.rdstate() & ios::badbit)? "Y ":"N ";         // will be "N" (0)
-          if (ss.fail())
-            cout << "fail=" << (ss.rdstate() & ios::failbit)? "Y ":"N ";       // will be "Y" (4)
-          cout << ")" << endl;
-        }
+}
+
+// Optimize the RPN instructions of "plan" in place, so Execute()/ExecuteBatch() only do the work
+// that really depends on the variables :
+//   - a pure operator (see kOperators) with constant operands is calculated once here,
+//     ex. "(3+4*(5+6*7+1))" => 195, "-2" => the constant -2, "sqrt(16)" => 4.
+//   - identities are dropped : x*1, 1*x, x/1, x+0, 0+x, x-0.
+// The parentheses are already gone in RPN, so there is nothing to remove for them.
+//
+// The folded operators are the same IEEE-754 operations in the same order as Execute() would do,
+// so the results are bit-for-bit the same, except x+0 and 0+x give -0 instead of +0 when x is -0
+// (both print as 0 anyway). Operands are never re-ordered, since (a+1)+2 and a+(1+2) can round
+// differently.
+// Return the number of instructions removed.
+template <typename T>
+size_t Optimize(CompiledExpression<T>& plan) {
+  // what we know about each value on the stack : the instructions computing it start at
+  // code[start], and if it's a constant, its value.
+  struct Operand {
+    size_t start;
+    bool constant;
+    T value;
+  };
+  vector<Instruction<T>> code;
+  vector<Operand> operands;
 
+  for (const Instruction<T>& ins : plan.code) {
+    if (ins.code == OpCode::kPushConst || ins.code == OpCode::kPushVar) {
+      operands.push_back({code.size(), ins.code == OpCode::kPushConst, ins.value});
+      code.push_back(ins);
+      continue;
+    }
+    int arity = Arity(ins.code);
+    if ((int)operands.size() < arity) return 0;   // a malformed plan, leave it as it is.
+    if (arity == 1) {
+      Operand& operand = operands.back();
+      if (operand.constant && Info(ins.code).pure) {
+        operand.value = ApplyOperator(ins.code, operand.value, operand.value);
+        code.back().value = operand.value;   // the constant is the last instruction.
       } else {
-        if (ss.str().length() > 0) {
-          // 如果不是運算數, 而且stringstream裡有東西的話, 
-          // 將其透過stringstream 的 >> operator 的 implicit convertion, 轉換為整數(=stoi/atoi), 並推入堆疊
-          // refer to : https://aprilyang.home.blog/2020/04/17/stringstream-to-read-int-from-a-string/
-          //            https://hackmd.io/@Maxlight/rJwlvj8ad
-          //            https://cplusplus.com/reference/sstream/stringstream/str/
-          T tmp_operand = 0;
-          ss >> tmp_operand;
-          operands_.push(tmp_operand);
-          ss.str(""); // make ss.str().length() = 0.
-          // NOTICE "ss.clear()" is MUST here !!
-          // after ss >> tmp_operand, ss will get its "eof" and "fail" state set, so any followed 
-          // "ss << xxx" won't take effect any more.
-          // ss.clear() is used to clear the "eof" and posisble "bad" or "fail" states.
-          //
-          // See (DEBUG-1) above also.
-          ss.clear(); 
-        }
-        // 如果是運算子
-        if (ch == '(') {
-          operators_.push(ch);
-        } else if (ch == ')') {
-          // point-1 to start calculation(^) - when getting ')'
-          // stop condition (s) - calculate until '(' met from stack top.
-          // (continue: '<', skip: '.', value : new operand1/2)
-          //
-          // 1+2*(3+4*(5+6*7+1))*(8+9)
-          //          s...47<<^         // Time2, got 48, pop one '('
-          //     s<<<<48.......^        // Time3, got 195, pop one '('
-          //                     s<<<^  // Time5, got 17, pop one '('
-          //     
-          while (operators_.top() != '(') {
-            // pop 2 operands from stack top, and pop one operator each time.
-            // push the result of "operand1 op operand2" back to stack as the new operand2.
-            T operand2 = operands_.top();
-            operands_.pop();
-            T operand1 = operands_.top();
-            operands_.pop();
-            char op = operators_.top();
-            operators_.pop();
-            T result;
-            switch (op) {
-              case '+':
-                result = operand1 + operand2;
-                break;
-              case '-':
-                result = operand1 - operand2;
-                break;
-              case '*':
-                result = operand1 * operand2;
-                break;
-              case '/':
-                result = operand1 / operand2;
-                break;
-            }
-            operands_.push(result);
-          }
-          operators_.pop();
-        } else { // getting operator.
-          // point-2 to start calculation (^)- when getting operator after operand2 with priority 
-          // lower than or equivalent to the previous one (the one on stack top, should not be '(').
-          // stop condition - calculate until 
-          //    a) no more operator available, 
-          //    b) '(' met from stack top.
-          //    c) current operator has higher priority (* or /) than the one on stack top
-          // 
-          // 1+2*(3+4*(5+6*7+1)*(8+9)
-          //          b<<<<<^           // Time1, got 47.
-          //  c<<195...........^        // Time4, got 390.
-          //
-          while (!operators_.empty() && operators_.top() != '(' &&
-                GetPriority(operators_.top()) >= GetPriority(ch)) {
-            T operand2 = operands_.top();
-            operands_.pop();
-            T operand1 = operands_.top();
-            operands_.pop();
-            char op = operators_.top();
-            operators_.pop();
-            T result;
-            switch (op) {
-              case '+':
-                result = operand1 + operand2;
-                break;
-              case '-':
-                result = operand1 - operand2;
-                break;
-              case '*':
-                result = operand1 * operand2;
-                break;
-              case '/':
-                result = operand1 / operand2;
-                break;
-            }
-            operands_.push(result);
-          }
-          operators_.push(ch);
-        }
+        code.push_back(ins);
+        operand.constant = false;
       }
+      continue;
     }
+    Operand operand2 = operands.back();
+    operands.pop_back();
+    Operand& operand1 = operands.back();
 
-    cout << "final round : The multi-digit integer str so far is : \"" 
-      << ss.str() << "\"" << endl; // debug.
-    // point-3 to start calculation - last part, after all the "()" and "operations with high-then-low priority" 
-    // done. All the left parts are of operations with low-then-high priority.
-    // stop condition - no more operator available.
-    // 
-    // 1+2*(3+4*(5+6*7+1)*(8+9)
-    // s<390.............<17...^   // Time7 : got the final result.
-    // 
-
-    // Gemini's proposal missed this par - the last operand might not be pushed to operands_ yet.
-    if (ss.str().length() > 0) {
-      // 如果不是運算數, 而且stringstream裡有東西的話, 
-      // 將其透過stringstream 的 >> operator 的 implicit convertion, 轉換為整數(=stoi/atoi), 並推入堆疊
-      // refer to : https://aprilyang.home.blog/2020/04/17/stringstream-to-read-int-from-a-string/
-      //            https://hackmd.io/@Maxlight/rJwlvj8ad
-      //            https://cplusplus.com/reference/sstream/stringstream/str/
-      T tmp_operand = 0;
-      ss >> tmp_operand;
-      operands_.push(tmp_operand);
-      ss.str(""); // make ss.str().length() = 0.
-      // ss.clear() here is MUST !! to clear the eof and fail state after "ss >> xx;" and "ss.str("");"
-      // See "(DEBUG-1)" above.
-      ss.clear(); 
-    }
-
-    while (!operators_.empty()) {
-      T operand2 = operands_.top();
-      operands_.pop();
-      T operand1 = operands_.top();
-      operands_.pop();
-      char op = operators_.top();
-      operators_.pop();
-      T result;
-      switch (op) {
-        case '+':
-          result = operand1 + operand2;
-          break;
-        case '-':
-          result = operand1 - operand2;
-          break;
-        case '*':
-          result = operand1 * operand2;
-          break;
-        case '/':
-          result = operand1 / operand2;
-          break;
-      }
-      operands_.push(result);
+    if (operand1.constant && operand2.constant && Info(ins.code).pure) {
+      operand1.value = ApplyOperator(ins.code, operand1.value, operand2.value);
+      code.resize(operand1.start);
+      code.push_back({OpCode::kPushConst, 0, operand1.value});
+    } else if (operand2.constant &&
+               ((operand2.value == 1 && (ins.code == OpCode::kMul || ins.code == OpCode::kDiv)) ||
+                (operand2.value == 0 && (ins.code == OpCode::kAdd || ins.code == OpCode::kSub)))) {
+      code.resize(operand2.start);   // x*1, x/1, x+0, x-0 => x.
+    } else if (operand1.constant &&
+               ((operand1.value == 1 && ins.code == OpCode::kMul) ||
+                (operand1.value == 0 && ins.code == OpCode::kAdd))) {
+      code.erase(code.begin() + operand1.start);   // 1*x, 0+x => x, which now starts where 1 or 0 was.
+      operand1.constant = false;
+    } else {
+      code.push_back(ins);
+      operand1.constant = false;
     }
-    // print fraction part of result with proper decimal digits.
-    // TBD : to determine the best number of decimal digits to display.
-    result_ = operands_.top();
-    cout << "result=";
-    modify_result_to_best_precision();
-    show_result();
-    cout << endl;
   }
 
-  // In most cases, the reason we have a friend function is to make it able to access private members
-  // of a class, so we will have a friend function with a parameter of "reference to the targeted class",
-  //
-  // notice the function tp o be friend of a class should be defined before the class definition, 
-  // or have a prototype there before the class definition.
-  // ex.
-  //    void ext_func(X &x, ...){   // definition before the class, or place a prototype declaration here.
-  //      x.priv_data=...;
-  //    }
-  //    class X {
-  //      private:
-  //        priv_data;
-  //      public:
-  //        friend void ext_func(X &x, ...);
-  //    }
-  //
-  // To have a template function as a friend, the containing class must have the same template parameter.
-  // ex.
-  //    template <typename T>             // have the same template param
-  //    void ext_func(X<T> &x, ...){      // use class of template param in func parameter
-  //      x.priv_data=...;
-  //    }
-  //    template <typename T>             // have the same template param
-  //    class X {
-  //      private:
-  //        priv_data;
-  //      public:
-  //        friend void ext_func<T> (X<T> &x, ...);   // use template param in both func name and parameter
-  //    }
-  // 
-  // The following doesn't work.
-  //    class Calculator {   // the containing class doesn't have the same template parameters.
-  //      ...
-  //      friend template <class T>
-  //      int round_to_best_precision(T orig, T &result);
-  //    }
-  //
-  // Correct way is :
-  //    template <class T>
-  //    int round_to_best_precision(T orig, T &result){
-  //      ...
-  //    }
-  //    template <typename T>
-  //    class Calculator {
-  //      ...
-  //      friend int round_to_best_precision<T>(T orig, T &result);
-  //    }
-};
+  // the stack may need fewer entries now.
+  int depth = 0;
+  plan.max_depth = 0;
+  for (const Instruction<T>& ins : code) {
+    depth += StackEffect(ins.code);
+    plan.max_depth = max(plan.max_depth, depth);
+  }
+  size_t removed = plan.code.size() - code.size();
+  plan.code = move(code);
+  return removed;
+}
 
-#ifdef Also_Run_Console_Out_Test
-void cout_control_test(void);   // this test requires #include <iomanip>.
-#endif
+// Parse the number literal starting at text[pos], ex. "12", "12.", ".5", "12.5", "1.5e-3", and move
+// "pos" to the first character after it. A "." without digits is not a number : "pos" is left on
+// it and the value is 0, so the caller can tell and report it.
+//
+// std::from_chars() reads the literal right from the text : no stream, no locale, no allocation,
+// and the result is correctly rounded to the nearest T (to the last ULP), as strtod() would give.
+template <typename T>
+T ParseNumber(string_view text, size_t& pos) {
+  const char* first = text.data() + pos;
+  T value = 0;
+  from_chars_result parsed = from_chars(first, text.data() + text.size(), value);
+  if (parsed.ec == errc::invalid_argument) return 0;   // ex. a "." alone.
+  if (parsed.ec == errc::result_out_of_range) {
+    // ex. "1e999" or "1e-999", from_chars() leaves value untouched. let strtod() pick inf, 0 or
+    // the denormal for it, it's rare so the copy doesn't matter.
+    if constexpr (is_floating_point<T>::value) {
+      string literal(first, parsed.ptr);
+      value = is_same<T, float>::value? strtof(literal.c_str(), nullptr) : strtod(literal.c_str(), nullptr);
+    }
+  }
+  pos = parsed.ptr - text.data();
+  return value;
+}
 
-#ifdef Also_Run_Precision_Test
-void precision_test(void);   // this test requires #include <cmath>.
-#endif
+// Compile-time expressions, for the formulas fixed at build time :
+//
+//   constexpr auto total = calc::compile("12+34*(56+78*2)");
+//   static_assert(total() == 7220);
+//
+//   constexpr auto price = calc::compile("base*(1+rate/100)+fee");   // variables : base, rate, fee
+//   double value = price(120.0, 8.5, 2.0);    // values in the order the variables first appear
+//
+// compile() is ShuntingYard()/PlanEmitter done by the compiler on a string literal. The RPN lands
+// in a fixed array inside the returned object, and operators with 2 constant operands are
+// folded right there, so nothing is parsed at run time and a constant formula is one value.
+// The grammar is the same as Calculator<T> (the operators and functions of kOperators), with spaces
+// allowed between tokens. What Calculator<T> silently takes as 0 or NaN is refused here : in a
+// constexpr context, a malformed expression (ex. "(1+2", "1+", "2a", "1+*2", "max(1)", "foo(2)")
+// calls MalformedExpression() which is not constexpr, so the build fails and the compiler points at
+// the reason. At run time it does nothing, the Expression is not Valid(), Error() gives the reason
+// and the expression gives NaN, so library code never writes to stdout.
+// Only the operators marked compile_time are folded. The others (ex. sqrt, ^) are left to run
+// time, so a formula using them can be compiled, and evaluated at run time, but not in a
+// static_assert().
+//
+// Number literals are exact (same as from_chars()) when they have at most 19 significant digits and
+// fit Clinger's fast path (mantissa below 2^53, power of 10 up to 1e22), which covers the usual
+// formulas. Other literals may be 1 ULP away. A literal out of the range of T is malformed.
+namespace calc {
 
-int main() {
-  cout << "Calculator Test. Please enter teh expression to evaluate :" << endl; 
-  string expression;
-  // use the following string for testing, and debug step-by-step to understand how this program runs : 
-  // 
-  // 1+2*(3+4*(5+6*7+1))*(8+9) = 6631
-  // 12345+67890           = 80235
-  // 12+34*(56+78*2)*(1+2) = 21636
-  // 12.+13.45*(23.56+47.8*2) = 1614.702
-  //
-  cin >> expression;
+// Not constexpr, only its call matters : see above.
+inline void MalformedExpression(const char*) {}
 
-  // Calculator<float> calculator;   // calculator with float type variables.
-  Calculator<double> calculator;    // calculator with double type variables.
-  calculator.Evaluate(expression);
+constexpr bool IsDigit(char ch) { return ch >= '0' && ch <= '9'; }
+constexpr bool IsAlpha(char ch) { return (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z'); }
+constexpr bool IsSpace(char ch) { return ch == ' ' || ch == '\t' || ch == '\r' || ch == '\n'; }
 
-#ifdef Also_Run_Console_Out_Test
-  cout << endl << "--- Console out control test ---" << endl; 
-  cout_control_test();
-#endif
-#ifdef Also_Run_Precision_Test
-  cout << endl << "--- Float/Double presision and round to best position test ---" << endl; 
-  precision_test();
-#endif
+// True while the compiler evaluates a constant expression, the C++20 std::is_constant_evaluated().
+constexpr bool ConstantEvaluated(void) { return __builtin_is_constant_evaluated(); }
 
-  return 0;
+// 10^n, exact up to 1e22.
+constexpr double Pow10(int n) {
+  double value = 1;
+  for (int i = 0; i < n; i++) value *= 10;
+  return value;
+}
+
+// The constexpr twin of CompiledExpression<T>, at most N instructions and N variables.
+template <typename T, size_t N>
+class Expression {
+ public:
+  using Value = T;
+
+  constexpr bool Valid(void) const { return valid_; }
+  // why the expression is not Valid(), nullptr if it is.
+  constexpr const char* Error(void) const { return error_; }
+  constexpr size_t Size(void) const { return size_; }
+  constexpr const Instruction<T>& At(size_t i) const { return code_[i]; }
+  // number of values on the stack before instruction i runs.
+  constexpr int DepthBefore(size_t i) const {
+    int depth = 0;
+    for (size_t j = 0; j < i; j++) depth += StackEffect(code_[j].code);
+    return depth;
+  }
+  constexpr int MaxDepth(void) const { return max_depth_; }
+  constexpr size_t Variables(void) const { return variable_count_; }
+  constexpr string_view Variable(size_t i) const {
+    return string_view(text_ + variables_[i].begin, variables_[i].length);
+  }
+
+  // Run the RPN with "values" for the variables, same as Calculator<T>::Execute().
+  constexpr T Execute(const T* values) const {
+    if (!valid_) return numeric_limits<T>::quiet_NaN();
+    if (ConstantEvaluated()) {
+      T stack[N] = {};
+      return Run(stack, values);
+    }
+    return RunUninitialized(values);
+  }
+
+  // One value per variable, in order.
+  template <typename... Values>
+  constexpr T operator()(Values... values) const {
+    if (sizeof...(Values) != variable_count_) {
+      MalformedExpression("the number of values is not the number of variables");
+      return numeric_limits<T>::quiet_NaN();
+    }
+    const T bound[] = {(T)values..., T()};
+    return Execute(bound);
+  }
+
+  // The same plan for Calculator<T>::Execute()/ExecuteBatch(), TieredExpression, ...
+  CompiledExpression<T> ToPlan(void) const {
+    CompiledExpression<T> plan;
+    plan.code.assign(code_, code_ + size_);
+    plan.max_depth = max_depth_;
+    for (size_t i = 0; i < variable_count_; i++) plan.variables.push_back(string(Variable(i)));
+    if (!valid_) plan.code.clear();
+    return plan;
+  }
+
+  constexpr void Parse(const char (&text)[N]) {
+    for (size_t i = 0; i < N; i++) text_[i] = text[i];
+    OpCode operators[N] = {};
+    int arguments[N] = {};        // for each '(' on "operators", the arguments seen so far.
+    size_t operator_count = 0;
+    bool expect_operand = true;   // false right after an operand or ')'.
+    size_t length = N - 1;        // without the ending '\0'.
+
+    size_t pos = 0;
+    while (pos < length) {
+      char ch = text[pos];
+      if (IsSpace(ch)) {
+        pos++;
+      } else if (IsAlpha(ch) || ch == '_' || IsDigit(ch) || ch == '.') {
+        if (!expect_operand) return Fail("an operand right after another operand or ')'");
+        if (IsDigit(ch) || ch == '.') {
+          if (!ParseNumber(text, pos)) return;
+          expect_operand = false;
+          continue;
+        }
+        size_t start = pos;
+        while (pos < length && (IsAlpha(text[pos]) || IsDigit(text[pos]) || text[pos] == '_')) pos++;
+        size_t next = pos;
+        while (next < length && IsSpace(text[next])) next++;
+        if (next < length && text[next] == '(') {
+          OpCode function = FunctionOperator(string_view(text + start, pos - start));
+          if (function == OpCode::kCount) return Fail("an unknown function");
+          operators[operator_count++] = function;   // it waits under its '(' until the ')'.
+        } else {
+          PushVariable(start, pos - start);
+          expect_operand = false;
+        }
+      } else if (ch == '(') {
+        if (!expect_operand) return Fail("'(' right after an operand or ')'");
+        arguments[operator_count] = 1;
+        operators[operator_count++] = kOpenParenthesis;
+        pos++;
+      } else if (ch == ')' || ch == ',') {
+        if (expect_operand) return Fail("')' or ',' where an operand is expected");
+        while (operator_count > 0 && operators[operator_count - 1] != kOpenParenthesis)
+          Operator(operators[--operator_count]);
+        if (operator_count == 0) return Fail("')' or ',' without '('");
+        bool call = operator_count >= 2 && Info(operators[operator_count - 2]).notation == Notation::kFunction;
+        if (ch == ',') {
+          if (!call) return Fail("',' outside of the arguments of a function");
+          arguments[operator_count - 1]++;
+          expect_operand = true;
+        } else {
+          operator_count--;
+          if (call) {
+            OpCode function = operators[--operator_count];
+            if (arguments[operator_count + 1] != Arity(function)) return Fail("a wrong number of arguments");
+            Operator(function);
+          }
+        }
+        pos++;
+      } else if (expect_operand) {
+        // a sign before an operand, ex. "-x", "2*-3". It has no left operand, so it takes no
+        // operator off the stack. A '+' changes nothing.
+        OpCode op = PrefixOperator(ch);
+        if (op != OpCode::kCount) {
+          operators[operator_count++] = op;
+        } else if (ch != '+') {
+          return Fail("an operator where an operand is expected");
+        }
+        pos++;
+      } else {
+        OpCode op = InfixOperator(ch);
+        if (op == OpCode::kCount) return Fail("unexpected character");
+        while (operator_count > 0 && operators[operator_count - 1] != kOpenParenthesis &&
+               CalculatedBefore(operators[operator_count - 1], op)) {
+          Operator(operators[--operator_count]);
+        }
+        operators[operator_count++] = op;
+        expect_operand = true;
+        pos++;
+      }
+    }
+    if (expect_operand) return Fail("the expression ends where an operand is expected");
+    while (operator_count > 0) {
+      if (operators[operator_count - 1] == kOpenParenthesis) return Fail("'(' without ')'");
+      Operator(operators[--operator_count]);
+    }
+  }
+
+ private:
+  struct Name {
+    size_t begin;
+    size_t length;
+  };
+
+  // The stack is only written before it's read : a constant evaluation needs it initialized, a
+  // run doesn't and would pay N stores per call.
+  T RunUninitialized(const T* values) const {
+    T stack[N];
+    return Run(stack, values);
+  }
+
+  constexpr T Run(T* stack, const T* values) const {
+    int sp = 0;
+    for (size_t i = 0; i < size_; i++) {
+      const Instruction<T>& ins = code_[i];
+      if (ins.code == OpCode::kPushConst) {
+        stack[sp++] = ins.value;
+      } else if (ins.code == OpCode::kPushVar) {
+        stack[sp++] = values[ins.index];
+      } else {
+        int arity = Arity(ins.code);
+        sp -= arity - 1;
+        stack[sp - 1] = ApplyOperator(ins.code, stack[sp - 1], stack[sp + arity - 2]);
+      }
+    }
+    return stack[0];
+  }
+
+  constexpr void Fail(const char* reason) {
+    valid_ = false;
+    error_ = reason;
+    size_ = 0;
+    MalformedExpression(reason);
+  }
+
+  constexpr void Push(const Instruction<T>& ins) {
+    code_[size_++] = ins;
+    if (++depth_ > max_depth_) max_depth_ = depth_;
+  }
+
+  constexpr void PushVariable(size_t begin, size_t length) {
+    size_t index = 0;
+    while (index < variable_count_ && Variable(index) != string_view(text_ + begin, length)) index++;
+    if (index == variable_count_) variables_[variable_count_++] = {begin, length};
+    Push({OpCode::kPushVar, (int)index, T()});
+  }
+
+  // Fold the operator when its operands are constants and it can be calculated at compile time,
+  // as Optimize() does. Folds of + - * / that would overflow or divide by 0 are left to run time :
+  // they're not constant expressions.
+  constexpr void Operator(OpCode code) {
+    int arity = Arity(code);
+    depth_ -= arity - 1;
+    bool constants = Info(code).compile_time && size_ >= (size_t)arity;
+    for (int i = 1; i <= arity && constants; i++) constants = code_[size_ - i].code == OpCode::kPushConst;
+    if (constants) {
+      T operand1 = code_[size_ - arity].value, operand2 = code_[size_ - 1].value;
+      T limit = (T)Pow10(numeric_limits<T>::max_exponent10 / 2);
+      T magnitude1 = operand1 < 0? -operand1 : operand1;
+      T magnitude2 = operand2 < 0? -operand2 : operand2;
+      bool safe = code == OpCode::kDiv? (magnitude1 < limit && magnitude2 > 1 / limit && magnitude2 < limit) :
+                  (code == OpCode::kNeg || code == OpCode::kMin || code == OpCode::kMax)? true :
+                                        (magnitude1 < limit && magnitude2 < limit);
+      if (safe) {
+        code_[size_ - arity].value = ApplyOperator(code, operand1, operand2);
+        size_ -= arity - 1;
+        return;
+      }
+    }
+    code_[size_++] = {code, 0, T()};
+  }
+
+  // Parse the literal at text[pos] like from_chars() : digits, an optional '.' and digits, and an
+  // optional exponent which is only taken if it has digits.
+  constexpr bool ParseNumber(const char (&text)[N], size_t& pos) {
+    uint64_t mantissa = 0;
+    int digits = 0, exponent = 0;
+    bool any_digit = false, dot = false;
+    for (; pos < N - 1 && (IsDigit(text[pos]) || (text[pos] == '.' && !dot)); pos++) {
+      if (text[pos] == '.') {
+        dot = true;
+        continue;
+      }
+      any_digit = true;
+      if (mantissa == 0 && text[pos] == '0') {
+        if (dot) exponent--;   // leading zeros don't count as significant digits.
+      } else if (digits < 19) {
+        mantissa = mantissa * 10 + (uint64_t)(text[pos] - '0');
+        digits++;
+        if (dot) exponent--;
+      } else if (!dot) {
+        exponent++;   // dropped digits of the integer part.
+      }
+    }
+    if (!any_digit) {
+      Fail("a number without digits");
+      return false;
+    }
+    if (pos < N - 1 && (text[pos] == 'e' || text[pos] == 'E')) {
+      size_t at = pos + 1;
+      bool negative = false;
+      if (at < N - 1 && (text[at] == '+' || text[at] == '-')) negative = text[at++] == '-';
+      if (at < N - 1 && IsDigit(text[at])) {
+        int value = 0;
+        for (; at < N - 1 && IsDigit(text[at]); at++) value = min(value * 10 + (text[at] - '0'), 100000);
+        exponent += negative? -value : value;
+        pos = at;
+      }
+    }
+
+    double result = (double)mantissa;
+    if (mantissa != 0) {
+      if (exponent + digits - 1 > numeric_limits<T>::max_exponent10) {
+        Fail("a number out of range");
+        return false;
+      }
+      if (exponent + digits - 1 < numeric_limits<double>::min_exponent10 - 20) {
+        result = 0;
+      } else if (exponent >= 0) {
+        // beyond 1e22 (out of the fast path), in steps that can be checked for overflow before.
+        for (; exponent > 22; exponent -= 22) {
+          if (result > numeric_limits<double>::max() / Pow10(22)) break;
+          result *= Pow10(22);
+        }
+        if (result > numeric_limits<double>::max() / Pow10(exponent)) {
+          Fail("a number out of range");
+          return false;
+        }
+        result *= Pow10(exponent);
+      } else {
+        for (; exponent < -22; exponent += 22) result /= Pow10(22);
+        result /= Pow10(-exponent);
+      }
+      if (result > (double)numeric_limits<T>::max()) {
+        Fail("a number out of range");
+        return false;
+      }
+    }
+    Push({OpCode::kPushConst, 0, (T)result});
+    return true;
+  }
+
+  char text_[N] = {};
+  Instruction<T> code_[N] = {};
+  Name variables_[N] = {};
+  size_t size_ = 0;
+  size_t variable_count_ = 0;
+  int depth_ = 0;
+  int max_depth_ = 0;
+  bool valid_ = true;
+  const char* error_ = nullptr;
+};
+
+// Compile "text" at compile time when used in a constexpr context, see above.
+template <typename T = double, size_t N>
+constexpr Expression<T, N> compile(const char (&text)[N]) {
+  Expression<T, N> expression;
+  expression.Parse(text);
+  return expression;
+}
+
+template <const auto& E, size_t I, typename T>
+constexpr void Step(T* stack, const T* values) {
+  constexpr Instruction<T> ins = E.At(I);
+  constexpr int sp = E.DepthBefore(I);
+  if constexpr (ins.code == OpCode::kPushConst) {
+    stack[sp] = ins.value;
+  } else if constexpr (ins.code == OpCode::kPushVar) {
+    stack[sp] = values[ins.index];
+  } else {
+    constexpr int arity = Arity(ins.code);
+    stack[sp - arity] = ApplyOperator(ins.code, stack[sp - arity], stack[sp - 1]);
+  }
+}
+
+template <const auto& E, typename T, size_t... I>
+T UnrolledUninitialized(const T* values, index_sequence<I...>) {
+  T stack[E.MaxDepth() > 0? E.MaxDepth() : 1];
+  (Step<E, I>(stack, values), ...);
+  return stack[0];
+}
+
+// Every slot is written by its Step() before it's read, so only a constant evaluation has to
+// initialize the stack.
+template <const auto& E, typename T, size_t... I>
+constexpr T Unrolled(const T* values, index_sequence<I...> sequence) {
+  if (!ConstantEvaluated()) return UnrolledUninitialized<E>(values, sequence);
+  T stack[E.MaxDepth() > 0? E.MaxDepth() : 1] = {};
+  (Step<E, I>(stack, values), ...);
+  return stack[0];
+}
+
+// Evaluate expression "E", a constexpr calc::compile() result with static storage, fully
+// specialized : every instruction is unrolled with its stack slot known at compile time, so the
+// compiler keeps the stack in registers and there is no loop or dispatch left, ex.
+//
+//   static constexpr auto price = calc::compile("base*(1+rate/100)+fee");
+//   double value = calc::evaluate<price>(120.0, 8.5, 2.0);
+//
+// The number of values is checked at compile time too.
+template <const auto& E, typename... Values>
+constexpr auto evaluate(Values... values) {
+  using T = typename remove_reference_t<decltype(E)>::Value;
+  static_assert(sizeof...(Values) == E.Variables(), "one value per variable of the expression");
+  const T bound[] = {(T)values..., T()};
+  return Unrolled<E>(bound, make_index_sequence<E.Size()>());
+}
+
+}  // namespace calc
+
+// Instrumentation of the hot paths, decided at compile time by Calculator_Instrumentation :
+//   - counters : expressions, tokens, reductions (operators taken off operators_), the max depth of
+//     the operand stack, and allocations (the times a stack of the calculator grew, which are the
+//     only allocations of Calculate/Execute/ExecuteBatch once warmed up).
+//   - one latency histogram per phase : calculate, compile, execute, execute_batch, format.
+// Every thread counts in its own thread_local counters, so there is no lock or shared cache line on
+// the hot paths. Instrumentation::Snapshot() sums them with those of the threads already gone, and
+// the snapshot prints as text or JSON.
+// With Calculator_Instrumentation 0 (the default) every hook is an empty inline function or an
+// empty object, so it costs nothing. With 1, a phase costs 2 steady_clock reads (about 20-40 ns).
+constexpr bool kInstrumentation = Calculator_Instrumentation != 0;
+
+enum class Phase { kCalculate, kCompile, kExecute, kExecuteBatch, kFormat, kCount };
+const char* const kPhaseNames[] = {"calculate", "compile", "execute", "execute_batch", "format"};
+
+// A counter written by its own thread only, and read by any thread for a snapshot. Relaxed atomic
+// loads/stores are plain moves on x86, it's only there so reading it from another thread is not a
+// data race.
+class RelaxedCounter {
+ public:
+  RelaxedCounter() = default;
+  RelaxedCounter(const RelaxedCounter& other) : value_(other.Get()) {}
+  RelaxedCounter& operator=(const RelaxedCounter& other) {
+    value_.store(other.Get(), memory_order_relaxed);
+    return *this;
+  }
+  uint64_t Get(void) const { return value_.load(memory_order_relaxed); }
+  void Add(uint64_t n) { value_.store(Get() + n, memory_order_relaxed); }
+  void Max(uint64_t n) {
+    if (n > Get()) value_.store(n, memory_order_relaxed);
+  }
+
+ private:
+  atomic<uint64_t> value_{0};
+};
+
+// Latencies in ns, HDR histogram style : exact below 16 ns, then 16 buckets per power of 2, so
+// any value is known within 1/16 (6%) with a fixed 608 buckets from 1 ns to 2^41 ns (36 minutes).
+class LatencyHistogram {
+ public:
+  void Record(uint64_t ns) {
+    counts_[Bucket(ns)].Add(1);
+    count_.Add(1);
+    total_.Add(ns);
+    max_.Max(ns);
+  }
+
+  void Merge(const LatencyHistogram& other) {
+    for (int i = 0; i < kBuckets; i++) counts_[i].Add(other.counts_[i].Get());
+    count_.Add(other.count_.Get());
+    total_.Add(other.total_.Get());
+    max_.Max(other.max_.Get());
+  }
+
+  uint64_t Count(void) const { return count_.Get(); }
+  uint64_t Max(void) const { return max_.Get(); }
+  uint64_t Mean(void) const { return count_.Get() > 0? total_.Get() / count_.Get() : 0; }
+
+  // the value "percent" % of the latencies are below or equal to, rounded up to its bucket.
+  uint64_t Percentile(double percent) const {
+    uint64_t count = count_.Get();
+    if (count == 0) return 0;
+    uint64_t rank = max<uint64_t>(1, (uint64_t)ceil(percent / 100 * count));
+    uint64_t seen = 0;
+    for (int i = 0; i < kBuckets; i++) {
+      seen += counts_[i].Get();
+      if (seen >= rank) return min(BucketTop(i), max_.Get());
+    }
+    return max_.Get();
+  }
+
+ private:
+  static constexpr int kSubBits = 4;
+  static constexpr int kMaxExponent = 40;
+  static constexpr int kBuckets = (kMaxExponent - kSubBits + 2) << kSubBits;
+
+  static int Bucket(uint64_t ns) {
+    if (ns < (1u << kSubBits)) return (int)ns;
+    int exponent = 63 - __builtin_clzll(ns);
+    if (exponent > kMaxExponent) return kBuckets - 1;
+    return ((exponent - kSubBits + 1) << kSubBits) + (int)((ns >> (exponent - kSubBits)) & ((1u << kSubBits) - 1));
+  }
+  // the biggest value going into "bucket".
+  static uint64_t BucketTop(int bucket) {
+    if (bucket < (1 << kSubBits)) return (uint64_t)bucket;
+    int exponent = (bucket >> kSubBits) + kSubBits - 1;
+    uint64_t sub = (uint64_t)(bucket & ((1 << kSubBits) - 1));
+    return (((1u << kSubBits) + sub + 1) << (exponent - kSubBits)) - 1;
+  }
+
+  RelaxedCounter counts_[kBuckets];
+  RelaxedCounter count_, total_, max_;
+};
+
+struct InstrumentationCounters {
+  RelaxedCounter expressions, tokens, reductions, max_stack_depth, allocations, malformed;
+  LatencyHistogram phases[(int)Phase::kCount];
+
+  void Merge(const InstrumentationCounters& other) {
+    expressions.Add(other.expressions.Get());
+    tokens.Add(other.tokens.Get());
+    reductions.Add(other.reductions.Get());
+    max_stack_depth.Max(other.max_stack_depth.Get());
+    allocations.Add(other.allocations.Get());
+    malformed.Add(other.malformed.Get());
+    for (int i = 0; i < (int)Phase::kCount; i++) phases[i].Merge(other.phases[i]);
+  }
+
+  string ToText(void) const {
+    ostringstream os;
+    os << "expressions " << expressions.Get() << "\ntokens " << tokens.Get() << "\nreductions " << reductions.Get()
+       << "\nmax_stack_depth " << max_stack_depth.Get() << "\nallocations " << allocations.Get() << "\nmalformed "
+       << malformed.Get() << "\n"
+       << "phase count mean_ns p50_ns p90_ns p99_ns p999_ns max_ns\n";
+    for (int i = 0; i < (int)Phase::kCount; i++) {
+      const LatencyHistogram& h = phases[i];
+      os << kPhaseNames[i] << " " << h.Count() << " " << h.Mean() << " " << h.Percentile(50) << " "
+         << h.Percentile(90) << " " << h.Percentile(99) << " " << h.Percentile(99.9) << " " << h.Max() << "\n";
+    }
+    return os.str();
+  }
+
+  string ToJson(void) const {
+    ostringstream os;
+    os << "{\"expressions\":" << expressions.Get() << ",\"tokens\":" << tokens.Get() << ",\"reductions\":"
+       << reductions.Get() << ",\"max_stack_depth\":" << max_stack_depth.Get() << ",\"allocations\":"
+       << allocations.Get() << ",\"malformed\":" << malformed.Get() << ",\"phases\":{";
+    for (int i = 0; i < (int)Phase::kCount; i++) {
+      const LatencyHistogram& h = phases[i];
+      os << (i > 0? "," : "") << "\"" << kPhaseNames[i] << "\":{\"count\":" << h.Count() << ",\"mean_ns\":"
+         << h.Mean() << ",\"p50_ns\":" << h.Percentile(50) << ",\"p90_ns\":" << h.Percentile(90) << ",\"p99_ns\":"
+         << h.Percentile(99) << ",\"p999_ns\":" << h.Percentile(99.9) << ",\"max_ns\":" << h.Max() << "}";
+    }
+    os << "}}";
+    return os.str();
+  }
+};
+
+// The hooks called from the hot paths, and the snapshot of all the threads.
+class Instrumentation {
+ public:
+  static void Expressions(uint64_t n) {
+    if constexpr (kInstrumentation) Local().expressions.Add(n);
+  }
+  static void Tokens(uint64_t n) {
+    if constexpr (kInstrumentation) Local().tokens.Add(n);
+  }
+  static void Reductions(uint64_t n) {
+    if constexpr (kInstrumentation) Local().reductions.Add(n);
+  }
+  static void StackDepth(uint64_t depth) {
+    if constexpr (kInstrumentation) Local().max_stack_depth.Max(depth);
+  }
+  static void Allocations(uint64_t n) {
+    if constexpr (kInstrumentation) Local().allocations.Add(n);
+  }
+  static void Malformed(uint64_t n) {
+    if constexpr (kInstrumentation) Local().malformed.Add(n);
+  }
+  static void Latency(Phase phase, uint64_t ns) {
+    if constexpr (kInstrumentation) Local().phases[(int)phase].Record(ns);
+  }
+
+  // The counters of every thread since the start of the program, alive or not.
+  static InstrumentationCounters Snapshot(void) {
+    Registry& registry = GetRegistry();
+    lock_guard<mutex> lock(registry.lock);
+    InstrumentationCounters total = registry.retired;
+    for (const InstrumentationCounters* counters : registry.live) total.Merge(*counters);
+    return total;
+  }
+
+ private:
+  struct Registry {
+    mutex lock;
+    InstrumentationCounters retired;   // of the threads which are gone.
+    vector<const InstrumentationCounters*> live;
+  };
+  // the counters of a thread, known by the registry from the first hook of the thread until it ends.
+  struct Registration {
+    InstrumentationCounters counters;
+    Registration() {
+      Registry& registry = GetRegistry();
+      lock_guard<mutex> lock(registry.lock);
+      registry.live.push_back(&counters);
+    }
+    ~Registration() {
+      Registry& registry = GetRegistry();
+      lock_guard<mutex> lock(registry.lock);
+      registry.retired.Merge(counters);
+      registry.live.erase(find(registry.live.begin(), registry.live.end(), &counters));
+    }
+  };
+
+  static Registry& GetRegistry(void) {
+    static Registry registry;
+    return registry;
+  }
+  static InstrumentationCounters& Local(void) {
+    thread_local Registration registration;
+    return registration.counters;
+  }
+};
+
+// Record the time from its construction to its destruction as the latency of "phase".
+class PhaseTimer {
+ public:
+  explicit PhaseTimer(Phase phase) {
+    if constexpr (kInstrumentation) {
+      phase_ = phase;
+      start_ = chrono::steady_clock::now();
+    }
+  }
+  ~PhaseTimer() {
+    if constexpr (kInstrumentation) {
+      auto ns = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start_).count();
+      Instrumentation::Latency(phase_, (uint64_t)ns);
+    }
+  }
+  PhaseTimer(const PhaseTimer&) = delete;
+  PhaseTimer& operator=(const PhaseTimer&) = delete;
+
+ private:
+  Phase phase_ = Phase::kCalculate;
+  chrono::steady_clock::time_point start_;
+};
+
+// Powers of 10 up to 1e22 are exact in a double, so the table gives the same values as pow(10, n)
+// without calling it.
+const double kPowersOf10[] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+inline double PowerOf10(int n) {
+  return (n < (int)(sizeof(kPowersOf10) / sizeof(kPowersOf10[0])))? kPowersOf10[n] : pow(10, n);
+}
+
+// Find the fewest decimal digits "value" can be rounded to without changing it by more than 1e-6
+// relatively, ex. 1614.70200000001 => 3 digits, 1614.702. Put the rounded value in "rounded" and
+// return the number of digits.
+//
+// Round to n decimal digits = multiply by 10^n, add 0.5 to it, drop the fraction part, then divide
+// by 10^n. We try n = 0, 1, 2 ... until the rounded value is close enough.
+template <typename T>
+int BestPrecision(T value, T& rounded) {
+  // the relative difference below is NaN for 0, NaN (ex. an unbound variable) and inf, which
+  // never gets smaller than the threshold. nothing to round for them anyway.
+  if (value == 0 || !isfinite(value)) {
+    rounded = value;
+    return 0;
+  }
+
+  // past 10^308 the power of 10 is inf, and the rounded value NaN. no double needs more digits.
+  const int kMaxDigits = numeric_limits<double>::max_exponent10;
+  for (int digits = 0; digits < kMaxDigits; digits++) {
+    double power = PowerOf10(digits);
+    rounded = floor(value * power + 0.5) / power;
+    // NOTICE :
+    // We cannot use the expression (x-y == 0) to tell whether 2 floating point values are equivalent.
+    //   if (difference == 0) break;
+    //
+    // this is because arithmatic operations of floating point values will cause precision loss.
+    // ex. x = 0.3;
+    //     y = 0.3;
+    //     return (x == y);       // true
+    //     return ((x - y) == 0); // true
+    //     x = 0.1 + 0.2;         // the "+" operation cause precision loss. (if it is not optimised by pre-processor)
+    //     y = 0.3
+    //     return (x == y);       // false
+    //     return ((x - y) == 0); // false
+    //
+    // The correct way to tell the equivalence is by :
+    //     if (std::abs(x - y) * 2 / std::abs(x + y)) < threshold)  // say, threshold = 1e-6.
+    //        return equal.
+    // (the abs() of x + y is needed for negative values, or the left side is always negative.)
+    T difference = value - rounded;
+    if (difference < 0) difference = 0 - difference;
+    T sum = value + rounded;
+    if (sum < 0) sum = 0 - sum;
+    if ((difference * 2 / sum) < 1e-6) return digits;
+  }
+  rounded = value;
+  return kMaxDigits;
+}
+
+// Format "value" with its best number of decimal digits (see BestPrecision() above) into
+// buffer[0..size-1], the same text as cout << fixed << setprecision(digits) << rounded, but
+// without a stream or any stream state to set and reset. Return the length of the text, or 0 if
+// it doesn't fit in "size" chars (kMaxFormattedLength is always enough).
+const size_t kMaxFormattedLength = 640;   // "-", 309 digits, ".", 308 digits, with some to spare.
+
+template <typename T>
+size_t FormatBestPrecision(T value, char* buffer, size_t size) {
+  PhaseTimer timer(Phase::kFormat);
+  T rounded;
+  int digits = BestPrecision(value, rounded);
+  to_chars_result formatted = to_chars(buffer, buffer + size, rounded, chars_format::fixed, digits);
+  if (formatted.ec != errc()) return 0;
+  return formatted.ptr - buffer;
+}
+
+// An exact decimal number for Calculator<Decimal>, ex. for money, where 0.1+0.2 must be 0.3 and not
+// 0.30000000000000004 as with double.
+//
+// The value is coefficient / 10^scale, ex. 12.50 is 1250 with scale 2. + - * are exact, / keeps
+// kDivisionScale decimal digits (rounded half away from zero), since ex. 1/3 has no end.
+//
+// The coefficient is kept in a 128-bit integer (up to 38 digits), which covers nearly all the
+// values we see, with no allocation. When a result doesn't fit, it spills to an arbitrary-precision
+// integer on the heap (base 10^9 limbs), and comes back to the 128-bit integer when it fits again.
+//
+// Like double, it has NaN (ex. an unbound variable, 0/0) and +/-inf (ex. 1/0).
+class Decimal {
+public:
+  // digits kept after the decimal point by /, and the most kept by * (the rest is rounded).
+  static constexpr int kDivisionScale = 18;
+  static constexpr int kMaxScale = 36;
+
+  Decimal(long long value = 0) : negative_(value < 0) {
+    small_ = negative_? (Uint128)0 - (Uint128)value : (Uint128)value;
+  }
+
+  static Decimal NaN(void) { return Special(kNaN, false); }
+  static Decimal Infinity(bool negative) { return Special(kInfinity, negative); }
+
+  bool IsFinite(void) const { return kind_ == kFinite; }
+  bool IsZero(void) const { return kind_ == kFinite && big_.empty() && small_ == 0; }
+  bool IsBig(void) const { return !big_.empty(); }   // whether the coefficient spilled to the heap.
+  int Scale(void) const { return scale_; }
+
+  // the same value with the trailing zeros of the fraction dropped, ex. 12.500 => 12.5.
+  Decimal Normalized(void) const {
+    Decimal result = *this;
+    if (!IsFinite()) return result;
+    if (!result.IsBig()) {
+      while (result.scale_ >= 9 && result.small_ % 1000000000 == 0) {
+        result.small_ /= 1000000000;
+        result.scale_ -= 9;
+      }
+      while (result.scale_ > 0 && result.small_ % 10 == 0) {
+        result.small_ /= 10;
+        result.scale_--;
+      }
+    } else {
+      Limbs limbs = result.big_;
+      while (result.scale_ > 0 && DivModSmall(limbs, 10) == 0) {
+        result.scale_--;
+        result.SetLimbs(Limbs(limbs));
+      }
+    }
+    return result;
+  }
+
+  friend Decimal operator-(const Decimal& a) {
+    Decimal result = a;
+    if (!a.IsZero() && a.kind_ != kNaN) result.negative_ = !a.negative_;
+    return result;
+  }
+
+  friend Decimal operator+(const Decimal& a, const Decimal& b) {
+    if (!a.IsFinite() || !b.IsFinite()) return SpecialResult('+', a, b);
+    int scale = max(a.scale_, b.scale_);
+    Decimal result;
+    result.scale_ = scale;
+    Uint128 ca = a.small_, cb = b.small_;
+    if (!a.IsBig() && !b.IsBig() && ScaleUp(ca, scale - a.scale_) && ScaleUp(cb, scale - b.scale_)) {
+      if (a.negative_ == b.negative_) {
+        Uint128 sum = ca + cb;
+        if (sum >= ca) {   // no carry out of 128 bits.
+          result.small_ = sum;
+          result.negative_ = a.negative_;
+          return result.Fixed();
+        }
+      } else {
+        result.small_ = (ca >= cb)? ca - cb : cb - ca;
+        result.negative_ = (ca >= cb)? a.negative_ : b.negative_;
+        return result.Fixed();
+      }
+    }
+    // doesn't fit in 128 bits, do it with limbs.
+    Limbs la = a.ToLimbs(), lb = b.ToLimbs();
+    MulPow10(la, scale - a.scale_);
+    MulPow10(lb, scale - b.scale_);
+    if (a.negative_ == b.negative_) {
+      result.SetLimbs(AddLimbs(la, lb));
+      result.negative_ = a.negative_;
+    } else if (CompareLimbs(la, lb) >= 0) {
+      result.SetLimbs(SubLimbs(la, lb));
+      result.negative_ = a.negative_;
+    } else {
+      result.SetLimbs(SubLimbs(lb, la));
+      result.negative_ = b.negative_;
+    }
+    return result.Fixed();
+  }
+
+  friend Decimal operator-(const Decimal& a, const Decimal& b) {
+    if (!a.IsFinite() || !b.IsFinite()) return SpecialResult('-', a, b);
+    return a + (-b);
+  }
+
+  friend Decimal operator*(const Decimal& a, const Decimal& b) {
+    if (!a.IsFinite() || !b.IsFinite()) return SpecialResult('*', a, b);
+    Decimal result;
+    result.scale_ = a.scale_ + b.scale_;
+    result.negative_ = a.negative_ != b.negative_;
+    if (a.IsBig() || b.IsBig() || __builtin_mul_overflow(a.small_, b.small_, &result.small_))
+      result.SetLimbs(MulLimbs(a.ToLimbs(), b.ToLimbs()));
+    if (result.scale_ > kMaxScale) result = result.RoundToScale(kMaxScale);
+    return result.Fixed();
+  }
+
+  friend Decimal operator/(const Decimal& a, const Decimal& b) {
+    if (!a.IsFinite() || !b.IsFinite() || b.IsZero()) return SpecialResult('/', a, b);
+    // a / b with "scale" digits = a * 10^(scale + b.scale - a.scale) / b, as integers.
+    Decimal result;
+    result.scale_ = max(kDivisionScale, a.scale_);
+    result.negative_ = a.negative_ != b.negative_;
+    int exponent = result.scale_ + b.scale_ - a.scale_;
+    Uint128 numerator = a.small_;
+    if (!a.IsBig() && !b.IsBig() && ScaleUp(numerator, exponent)) {
+      Uint128 remainder = numerator % b.small_;
+      result.small_ = numerator / b.small_;
+      if (remainder >= b.small_ - remainder) result.small_++;   // round half away from zero.
+    } else {
+      Limbs numerator_limbs = a.ToLimbs(), remainder;
+      MulPow10(numerator_limbs, exponent);
+      Limbs divisor = b.ToLimbs();
+      Limbs quotient = DivModLimbs(numerator_limbs, divisor, remainder);
+      if (CompareLimbs(AddLimbs(remainder, remainder), divisor) >= 0) quotient = AddLimbs(quotient, Limbs{1});
+      result.SetLimbs(move(quotient));
+    }
+    // ex. 1/4 is 0.250000000000000000, keep it as 0.25, so the values don't grow with each division.
+    return result.Fixed().Normalized();
+  }
+
+  // -1, 0, 1 for a < b, a == b, a > b. Not for NaN, which is neither.
+  friend int Compare(const Decimal& a, const Decimal& b) {
+    if (a.kind_ == kInfinity || b.kind_ == kInfinity) {
+      int rank_a = (a.kind_ == kInfinity)? (a.negative_? -1 : 1) : 0;
+      int rank_b = (b.kind_ == kInfinity)? (b.negative_? -1 : 1) : 0;
+      return (rank_a > rank_b) - (rank_a < rank_b);
+    }
+    Decimal difference = a - b;
+    if (difference.IsZero()) return 0;
+    return difference.negative_? -1 : 1;
+  }
+
+  friend bool operator==(const Decimal& a, const Decimal& b) { return a.kind_ != kNaN && b.kind_ != kNaN && Compare(a, b) == 0; }
+  friend bool operator!=(const Decimal& a, const Decimal& b) { return !(a == b); }
+  friend bool operator<(const Decimal& a, const Decimal& b) { return a.kind_ != kNaN && b.kind_ != kNaN && Compare(a, b) < 0; }
+  friend bool operator>(const Decimal& a, const Decimal& b) { return b < a; }
+  friend bool operator<=(const Decimal& a, const Decimal& b) { return a.kind_ != kNaN && b.kind_ != kNaN && Compare(a, b) <= 0; }
+  friend bool operator>=(const Decimal& a, const Decimal& b) { return b <= a; }
+
+  // The functions of kOperators, found by ApplyOperator() through ADL. abs, % and the powers by an
+  // integer (up to kMaxExactPower) are exact. sqrt, exp, log and the other powers are calculated
+  // with double, so they have about 16 significant digits.
+  static constexpr int kMaxExactPower = 1024;
+
+  friend Decimal fabs(const Decimal& a) {
+    Decimal result = a;
+    if (a.kind_ != kNaN) result.negative_ = false;
+    return result;
+  }
+
+  // the remainder of a / b truncated toward 0, with the sign of a, like fmod().
+  friend Decimal fmod(const Decimal& a, const Decimal& b) {
+    if (a.kind_ != kFinite || b.kind_ == kNaN || b.IsZero()) return NaN();
+    if (b.kind_ == kInfinity) return a;
+    int scale = max(a.scale_, b.scale_);
+    Decimal result;
+    result.scale_ = scale;
+    result.negative_ = a.negative_;
+    Uint128 ca = a.small_, cb = b.small_;
+    if (!a.IsBig() && !b.IsBig() && ScaleUp(ca, scale - a.scale_) && ScaleUp(cb, scale - b.scale_)) {
+      result.small_ = ca % cb;
+    } else {
+      Limbs la = a.ToLimbs(), lb = b.ToLimbs(), remainder;
+      MulPow10(la, scale - a.scale_);
+      MulPow10(lb, scale - b.scale_);
+      DivModLimbs(la, lb, remainder);
+      result.SetLimbs(move(remainder));
+    }
+    return result.Fixed();
+  }
+
+  friend Decimal pow(const Decimal& a, const Decimal& b) {
+    Decimal exponent = b.Normalized();
+    if (exponent.IsFinite() && exponent.scale_ == 0 && !exponent.IsBig() && exponent.small_ <= kMaxExactPower) {
+      // by squaring, ex. a^13 = a * a^4 * a^8.
+      Decimal result = 1, power = a;
+      for (Uint128 n = exponent.small_; n > 0; n >>= 1) {
+        if (n & 1) result = result * power;
+        if (n > 1) power = power * power;
+      }
+      return exponent.negative_? Decimal(1) / result : result;
+    }
+    return FromDouble(std::pow(ToDouble(a), ToDouble(b)));
+  }
+
+  friend Decimal sqrt(const Decimal& a) { return FromDouble(std::sqrt(ToDouble(a))); }
+  friend Decimal exp(const Decimal& a) { return FromDouble(math::Exp(ToDouble(a))); }
+  friend Decimal log(const Decimal& a) { return FromDouble(math::Log(ToDouble(a))); }
+
+  // Parse "12", "12.50", ".5", "1.5e-3" like std::from_chars() does for double, but exactly.
+  // Exponents beyond kMaxExponent give inf or 0, as they would with double.
+  friend from_chars_result from_chars(const char* first, const char* last, Decimal& value) {
+    const int kMaxExponent = 4096;
+    const char* p = first;
+    Decimal result;
+    Limbs limbs;   // used once the digits don't fit in 128 bits.
+    bool any_digit = false, in_fraction = false;
+    for (; p < last && (isdigit((unsigned char)*p) || (*p == '.' && !in_fraction)); p++) {
+      if (*p == '.') {
+        in_fraction = true;
+        continue;
+      }
+      any_digit = true;
+      unsigned digit = *p - '0';
+      if (in_fraction) result.scale_++;
+      if (limbs.empty() && result.small_ <= (~(Uint128)0 - digit) / 10) {
+        result.small_ = result.small_ * 10 + digit;
+      } else {
+        if (limbs.empty()) limbs = result.ToLimbs();
+        MulSmall(limbs, 10);
+        limbs = AddLimbs(limbs, Limbs{digit});
+      }
+    }
+    if (!any_digit) return {first, errc::invalid_argument};
+    if (!limbs.empty()) result.SetLimbs(move(limbs));
+
+    // the exponent, only if there are digits after "e" and its sign, or the "e" isn't ours.
+    if (p < last && (*p == 'e' || *p == 'E')) {
+      const char* q = p + 1;
+      bool negative_exponent = (q < last && *q == '-');
+      if (q < last && (*q == '+' || *q == '-')) q++;
+      if (q < last && isdigit((unsigned char)*q)) {
+        long exponent = 0;
+        for (; q < last && isdigit((unsigned char)*q); q++) exponent = min(exponent * 10 + (*q - '0'), (long)kMaxExponent * 2);
+        p = q;
+        if (result.IsZero()) {
+          // 0e999 is still 0.
+        } else if (negative_exponent && result.scale_ + exponent > kMaxExponent) {
+          result = Decimal();
+        } else if (!negative_exponent && exponent - result.scale_ > kMaxExponent) {
+          result = Infinity(false);
+        } else if (negative_exponent) {
+          result.scale_ += exponent;
+        } else if (exponent <= result.scale_) {
+          result.scale_ -= exponent;
+        } else {
+          // ex. 5e3 = 5000, the scale can't be negative.
+          Limbs scaled = result.ToLimbs();
+          MulPow10(scaled, exponent - result.scale_);
+          result.scale_ = 0;
+          result.SetLimbs(move(scaled));
+        }
+      }
+    }
+    if (result.scale_ > kMaxScale) result = result.RoundToScale(kMaxScale);
+    value = result;
+    return {p, errc()};
+  }
+
+  // Write "value" with "precision" digits after the decimal point, same as to_chars() for double
+  // with chars_format::fixed (the only format supported), ex. 12.5 with precision 3 => "12.500".
+  friend to_chars_result to_chars(char* first, char* last, const Decimal& value, chars_format format, int precision) {
+    (void)format;
+    string text;
+    if (value.kind_ == kNaN) {
+      text = "nan";
+    } else if (value.kind_ == kInfinity) {
+      text = value.negative_? "-inf" : "inf";
+    } else {
+      Decimal rounded = (precision < value.scale_)? value.RoundToScale(precision) : value;
+      string digits = rounded.CoefficientDigits();
+      // at least one digit before the decimal point, ex. 0.05 is "5" with scale 2 => "005".
+      if ((int)digits.size() <= rounded.scale_) digits.insert(0, rounded.scale_ + 1 - digits.size(), '0');
+      if (rounded.negative_ && !rounded.IsZero()) text += '-';
+      text.append(digits, 0, digits.size() - rounded.scale_);
+      if (precision > 0) {
+        text += '.';
+        text.append(digits, digits.size() - rounded.scale_, string::npos);
+        text.append(precision - rounded.scale_, '0');
+      }
+    }
+    if ((size_t)(last - first) < text.size()) return {last, errc::value_too_large};
+    return {copy(text.begin(), text.end(), first), errc()};
+  }
+
+  // all the digits, ex. 12.5 => "12.5". Used by the trace.
+  friend ostream& operator<<(ostream& os, const Decimal& value) {
+    char text[kMaxFormattedLength];
+    to_chars_result formatted = to_chars(text, text + sizeof(text), value, chars_format::fixed, value.scale_);
+    if (formatted.ec != errc()) return os << "(" << value.CoefficientDigits() << "e-" << value.scale_ << ")";
+    return os.write(text, formatted.ptr - text);
+  }
+
+private:
+  using Uint128 = unsigned __int128;   // gcc and clang on 64-bit targets.
+  using Limbs = vector<uint32_t>;      // an integer in base 10^9, the lowest limb first.
+  static constexpr uint32_t kLimbBase = 1000000000;
+  enum Kind : unsigned char { kFinite, kNaN, kInfinity };
+
+  Kind kind_ = kFinite;
+  bool negative_ = false;
+  int scale_ = 0;
+  Uint128 small_ = 0;   // the coefficient, when big_ is empty.
+  Limbs big_;           // the coefficient, when it doesn't fit in small_.
+
+  static Decimal Special(Kind kind, bool negative) {
+    Decimal result;
+    result.kind_ = kind;
+    result.negative_ = negative;
+    return result;
+  }
+
+  // NaN and inf follow the IEEE-754 rules, ex. inf-inf is NaN, 1/inf is 0. Do the operation with
+  // doubles standing for the operands : only being 0, the sign, inf or NaN matter here.
+  static Decimal SpecialResult(char op, const Decimal& a, const Decimal& b) {
+    auto stand_in = [](const Decimal& x) {
+      double sign = x.negative_? -1 : 1;
+      if (x.kind_ == kNaN) return numeric_limits<double>::quiet_NaN();
+      if (x.kind_ == kInfinity) return sign * numeric_limits<double>::infinity();
+      return x.IsZero()? 0.0 : sign;
+    };
+    double x = stand_in(a), y = stand_in(b);
+    double result = (op == '+')? x + y : (op == '-')? x - y : (op == '*')? x * y : x / y;
+    if (isnan(result)) return NaN();
+    if (isinf(result)) return Infinity(result < 0);
+    return Decimal();   // ex. 1/inf.
+  }
+
+  // the nearest double, through the text of the value.
+  static double ToDouble(const Decimal& a) {
+    if (a.kind_ == kNaN) return numeric_limits<double>::quiet_NaN();
+    if (a.kind_ == kInfinity) return a.negative_? -numeric_limits<double>::infinity() : numeric_limits<double>::infinity();
+    string text = (a.negative_? "-" : "") + a.CoefficientDigits() + "e-" + to_string(a.scale_);
+    return strtod(text.c_str(), nullptr);
+  }
+
+  // the shortest decimal which reads back as "value", ex. 0.1 for the double nearest to 0.1.
+  static Decimal FromDouble(double value) {
+    if (isnan(value)) return NaN();
+    if (isinf(value)) return Infinity(value < 0);
+    char text[kMaxFormattedLength];
+    to_chars_result written = std::to_chars(text, text + sizeof(text), std::fabs(value));
+    Decimal result;
+    from_chars(text, written.ptr, result);
+    return value < 0? -result : result;
+  }
+
+  // no "-0".
+  Decimal& Fixed(void) {
+    if (IsZero()) negative_ = false;
+    return *this;
+  }
+
+  static const Uint128* PowersOf10(void) {
+    static Uint128 powers[39];
+    static bool ready = [] {
+      powers[0] = 1;
+      for (int i = 1; i < 39; i++) powers[i] = powers[i - 1] * 10;
+      return true;
+    }();
+    (void)ready;
+    return powers;
+  }
+
+  // value *= 10^n, return false if it doesn't fit in 128 bits.
+  static bool ScaleUp(Uint128& value, int n) {
+    if (n == 0 || value == 0) return true;
+    if (n > 38) return false;
+    return !__builtin_mul_overflow(value, PowersOf10()[n], &value);
+  }
+
+  // the same value with "scale" digits after the decimal point, rounded half away from zero.
+  Decimal RoundToScale(int scale) const {
+    Decimal result = *this;
+    int drop = scale_ - scale;
+    if (drop <= 0) return result;
+    result.scale_ = scale;
+    if (!IsBig() && drop <= 38) {
+      Uint128 divisor = PowersOf10()[drop];
+      Uint128 remainder = small_ % divisor;
+      result.small_ = small_ / divisor;
+      if (remainder >= divisor - remainder) result.small_++;
+    } else {
+      Limbs divisor{1}, remainder;
+      MulPow10(divisor, drop);
+      Limbs quotient = DivModLimbs(ToLimbs(), divisor, remainder);
+      if (CompareLimbs(AddLimbs(remainder, remainder), divisor) >= 0) quotient = AddLimbs(quotient, Limbs{1});
+      result.SetLimbs(move(quotient));
+    }
+    return result.Fixed();
+  }
+
+  // the decimal digits of the coefficient, ex. "1250" for 12.50.
+  string CoefficientDigits(void) const {
+    string digits;
+    if (!IsBig()) {
+      Uint128 value = small_;
+      do {
+        digits += (char)('0' + (int)(value % 10));
+        value /= 10;
+      } while (value > 0);
+      reverse(digits.begin(), digits.end());
+      return digits;
+    }
+    digits = to_string(big_.back());
+    for (size_t i = big_.size() - 1; i > 0; i--) {
+      string limb = to_string(big_[i - 1]);
+      digits.append(9 - limb.size(), '0');
+      digits += limb;
+    }
+    return digits;
+  }
+
+  Limbs ToLimbs(void) const {
+    if (IsBig()) return big_;
+    Limbs limbs;
+    Uint128 value = small_;
+    do {
+      limbs.push_back((uint32_t)(value % kLimbBase));
+      value /= kLimbBase;
+    } while (value > 0);
+    return limbs;
+  }
+
+  // take "limbs" as the coefficient, in small_ if it fits.
+  void SetLimbs(Limbs&& limbs) {
+    Trim(limbs);
+    Uint128 value = 0;
+    bool fits = true;
+    for (size_t i = limbs.size(); i > 0 && fits; i--)
+      fits = !__builtin_mul_overflow(value, (Uint128)kLimbBase, &value) &&
+             !__builtin_add_overflow(value, (Uint128)limbs[i - 1], &value);
+    if (fits) {
+      small_ = value;
+      big_.clear();
+    } else {
+      small_ = 0;
+      big_ = move(limbs);
+    }
+  }
+
+  // drop the zero limbs at the top, but keep one for 0.
+  static Limbs& Trim(Limbs& a) {
+    while (a.size() > 1 && a.back() == 0) a.pop_back();
+    return a;
+  }
+
+  static int CompareLimbs(const Limbs& a, const Limbs& b) {
+    size_t size_a = a.size(), size_b = b.size();
+    while (size_a > 1 && a[size_a - 1] == 0) size_a--;
+    while (size_b > 1 && b[size_b - 1] == 0) size_b--;
+    if (size_a != size_b) return (size_a < size_b)? -1 : 1;
+    for (size_t i = size_a; i > 0; i--)
+      if (a[i - 1] != b[i - 1]) return (a[i - 1] < b[i - 1])? -1 : 1;
+    return 0;
+  }
+
+  static Limbs AddLimbs(const Limbs& a, const Limbs& b) {
+    Limbs sum(max(a.size(), b.size()) + 1, 0);
+    uint32_t carry = 0;
+    for (size_t i = 0; i < sum.size(); i++) {
+      uint32_t digit = carry + ((i < a.size())? a[i] : 0) + ((i < b.size())? b[i] : 0);
+      carry = digit / kLimbBase;
+      sum[i] = digit % kLimbBase;
+    }
+    return Trim(sum);
+  }
+
+  // a - b, a must be >= b.
+  static Limbs SubLimbs(const Limbs& a, const Limbs& b) {
+    Limbs difference(a.size(), 0);
+    int64_t borrow = 0;
+    for (size_t i = 0; i < a.size(); i++) {
+      int64_t digit = (int64_t)a[i] - borrow - ((i < b.size())? b[i] : 0);
+      borrow = (digit < 0)? 1 : 0;
+      difference[i] = (uint32_t)(digit + borrow * kLimbBase);
+    }
+    return Trim(difference);
+  }
+
+  static void MulSmall(Limbs& a, uint32_t factor) {
+    uint64_t carry = 0;
+    for (uint32_t& limb : a) {
+      uint64_t digit = (uint64_t)limb * factor + carry;
+      limb = (uint32_t)(digit % kLimbBase);
+      carry = digit / kLimbBase;
+    }
+    if (carry > 0) a.push_back((uint32_t)carry);
+  }
+
+  static void MulPow10(Limbs& a, int n) {
+    if (n <= 0) return;
+    a.insert(a.begin(), n / 9, 0);
+    uint32_t factor = 1;
+    for (int i = 0; i < n % 9; i++) factor *= 10;
+    MulSmall(a, factor);
+  }
+
+  static Limbs MulLimbs(const Limbs& a, const Limbs& b) {
+    vector<uint64_t> product(a.size() + b.size() + 1, 0);
+    for (size_t i = 0; i < a.size(); i++) {
+      uint64_t carry = 0;
+      for (size_t j = 0; j < b.size(); j++) {
+        uint64_t digit = product[i + j] + (uint64_t)a[i] * b[j] + carry;
+        product[i + j] = digit % kLimbBase;
+        carry = digit / kLimbBase;
+      }
+      for (size_t k = i + b.size(); carry > 0; k++) {
+        uint64_t digit = product[k] + carry;
+        product[k] = digit % kLimbBase;
+        carry = digit / kLimbBase;
+      }
+    }
+    Limbs limbs(product.begin(), product.end());
+    return Trim(limbs);
+  }
+
+  // a /= divisor, return the remainder.
+  static uint32_t DivModSmall(Limbs& a, uint32_t divisor) {
+    uint64_t remainder = 0;
+    for (size_t i = a.size(); i > 0; i--) {
+      uint64_t digit = remainder * kLimbBase + a[i - 1];
+      a[i - 1] = (uint32_t)(digit / divisor);
+      remainder = digit % divisor;
+    }
+    return (uint32_t)remainder;
+  }
+
+  // return a / b, and a % b in "remainder". Schoolbook long division, one limb of the quotient at
+  // a time, found by binary search. Slow, but only used for values over 38 digits.
+  static Limbs DivModLimbs(const Limbs& a, const Limbs& b, Limbs& remainder) {
+    Limbs quotient(a.size(), 0);
+    remainder = Limbs{0};
+    for (size_t i = a.size(); i > 0; i--) {
+      remainder.insert(remainder.begin(), a[i - 1]);   // remainder = remainder * 10^9 + a[i-1].
+      uint32_t low = 0, high = kLimbBase - 1;
+      while (low < high) {
+        uint32_t middle = low + (high - low + 1) / 2;
+        Limbs trial = b;
+        MulSmall(trial, middle);
+        if (CompareLimbs(trial, remainder) <= 0) low = middle; else high = middle - 1;
+      }
+      Limbs trial = b;
+      MulSmall(trial, low);
+      remainder = SubLimbs(remainder, trial);
+      quotient[i - 1] = low;
+    }
+    return Trim(quotient);
+  }
+};
+
+namespace std {
+// so Calculator<Decimal> gets NaN for an unbound variable, as with double.
+template <>
+class numeric_limits<Decimal> {
+public:
+  static const bool is_specialized = true;
+  static Decimal quiet_NaN(void) { return Decimal::NaN(); }
+  static Decimal infinity(void) { return Decimal::Infinity(false); }
+};
+}
+
+// A decimal is exact, so its best precision is simply all its digits, without trailing zeros.
+// (no 1e-6 tolerance here : a total of 1234.5600001 must show as it is.)
+template <>
+inline int BestPrecision<Decimal>(Decimal value, Decimal& rounded) {
+  rounded = value.Normalized();
+  return rounded.IsFinite()? rounded.Scale() : 0;
+}
+
+// Block kernels used by ExecuteBatch() : operand1[i] = operand1[i] op operand2[i], for i in [0, n).
+// For an operator of 1 operand, it's operand1[i] = op operand1[i], and operand2 is not read.
+//
+// The scalar kernel works for any T. For float and double on x86 there are also SSE (4 floats or
+// 2 doubles at a time), AVX and AVX2 (8 floats or 4 doubles at a time) kernels, the best one
+// supported by the running CPU is picked at run time, so the same binary runs on old and new
+// machines. AVX2 only adds the 256-bit integer instructions, which exp and log need for the
+// exponent bits, so the AVX kernels do exp and log 2 doubles at a time and the AVX2 ones 4.
+// They have a SIMD form of + - * / negation sqrt abs min max exp log, and calculate ^ and % value
+// by value like the scalar kernel.
+//
+// The SIMD instructions do the same IEEE-754 add/sub/mul/div/sqrt as the scalar ones, each lane is
+// rounded the same way, exp and log are the same operations as math::Exp()/math::Log(), so all the
+// kernels give bit-for-bit the same results.
+// (as long as we don't compile with -ffast-math, which allows the compiler to re-arrange the math.)
+enum class SimdLevel { kScalar, kSSE, kAVX, kAVX2 };
+
+template <typename T>
+using BlockKernel = void (*)(OpCode op, T* operand1, const T* operand2, size_t n);
+
+template <typename T>
+void ScalarBlockKernel(OpCode op, T* operand1, const T* operand2, size_t n) {
+  // switch outside of the loops, so each loop is as simple as it can be.
+  switch (op) {
+    case OpCode::kAdd:
+      for (size_t i = 0; i < n; i++) operand1[i] = operand1[i] + operand2[i];
+      break;
+    case OpCode::kSub:
+      for (size_t i = 0; i < n; i++) operand1[i] = operand1[i] - operand2[i];
+      break;
+    case OpCode::kMul:
+      for (size_t i = 0; i < n; i++) operand1[i] = operand1[i] * operand2[i];
+      break;
+    case OpCode::kDiv:
+      for (size_t i = 0; i < n; i++) operand1[i] = operand1[i] / operand2[i];
+      break;
+    default:
+      // the switch of ApplyOperator() costs little next to a function.
+      for (size_t i = 0; i < n; i++) operand1[i] = ApplyOperator(op, operand1[i], operand2[i]);
+      break;
+  }
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define Have_X86_Simd_Kernels
+
+// math::Exp() and math::Log() on 2 doubles, with the same operations in the same order, the
+// selects made of and/andnot/or.
+__attribute__((target("sse2")))
+static inline __m128d SseSelect(__m128d mask, __m128d a, __m128d b) {
+  return _mm_or_pd(_mm_and_pd(mask, a), _mm_andnot_pd(mask, b));
+}
+
+__attribute__((target("sse2")))
+static inline __m128d SsePow2(__m128d k) {
+  __m128i bits = _mm_castpd_si128(_mm_add_pd(k, _mm_set1_pd(1023 + math::kShifter)));
+  return _mm_castsi128_pd(_mm_slli_epi64(bits, 52));
+}
+
+__attribute__((target("sse2")))
+static inline __m128d SseExp(__m128d x) {
+  using namespace math;
+  const __m128d shifter = _mm_set1_pd(kShifter);
+  __m128d clamped = _mm_max_pd(_mm_min_pd(x, _mm_set1_pd(710.0)), _mm_set1_pd(-746.0));
+  __m128d k = _mm_sub_pd(_mm_add_pd(_mm_mul_pd(clamped, _mm_set1_pd(kLog2e)), shifter), shifter);
+  __m128d hi = _mm_sub_pd(clamped, _mm_mul_pd(k, _mm_set1_pd(kLn2Hi)));
+  __m128d lo = _mm_mul_pd(k, _mm_set1_pd(kLn2Lo));
+  __m128d r = _mm_sub_pd(hi, lo);
+  __m128d r2 = _mm_mul_pd(r, r);
+  __m128d p = _mm_add_pd(_mm_set1_pd(kExpP[3]), _mm_mul_pd(r2, _mm_set1_pd(kExpP[4])));
+  p = _mm_add_pd(_mm_set1_pd(kExpP[2]), _mm_mul_pd(r2, p));
+  p = _mm_add_pd(_mm_set1_pd(kExpP[1]), _mm_mul_pd(r2, p));
+  p = _mm_add_pd(_mm_set1_pd(kExpP[0]), _mm_mul_pd(r2, p));
+  __m128d c = _mm_sub_pd(r, _mm_mul_pd(r2, p));
+  __m128d quotient = _mm_div_pd(_mm_mul_pd(r, c), _mm_sub_pd(_mm_set1_pd(2.0), c));
+  __m128d y = _mm_sub_pd(_mm_set1_pd(1.0), _mm_sub_pd(_mm_sub_pd(lo, quotient), hi));
+  __m128d k1 = _mm_sub_pd(_mm_add_pd(_mm_mul_pd(k, _mm_set1_pd(0.5)), shifter), shifter);
+  __m128d result = _mm_mul_pd(_mm_mul_pd(y, SsePow2(k1)), SsePow2(_mm_sub_pd(k, k1)));
+  return SseSelect(_mm_cmpunord_pd(x, x), x, result);
+}
+
+__attribute__((target("sse2")))
+static inline __m128d SseLog(__m128d x) {
+  using namespace math;
+  const __m128d one = _mm_set1_pd(1.0), two52 = _mm_set1_pd(4503599627370496.0);
+  __m128d subnormal = _mm_cmplt_pd(x, _mm_set1_pd(kMinNormal));
+  __m128d scaled = SseSelect(subnormal, _mm_mul_pd(x, _mm_set1_pd(kTwo54)), x);
+  __m128d bias = SseSelect(subnormal, _mm_set1_pd(1023 + 54), _mm_set1_pd(1023));
+  __m128i bits = _mm_castpd_si128(scaled);
+  __m128i exponent = _mm_and_si128(_mm_srli_epi64(bits, 52), _mm_set1_epi64x(0x7FF));
+  __m128d e = _mm_sub_pd(_mm_sub_pd(_mm_or_pd(_mm_castsi128_pd(exponent), two52), two52), bias);
+  __m128d m = _mm_or_pd(_mm_and_pd(scaled, _mm_castsi128_pd(_mm_set1_epi64x(0x000FFFFFFFFFFFFFll))), one);
+  __m128d big = _mm_cmpgt_pd(m, _mm_set1_pd(kSqrt2));
+  m = SseSelect(big, _mm_mul_pd(m, _mm_set1_pd(0.5)), m);
+  e = SseSelect(big, _mm_add_pd(e, one), e);
+  __m128d f = _mm_sub_pd(m, one);
+  __m128d hfsq = _mm_mul_pd(_mm_mul_pd(_mm_set1_pd(0.5), f), f);
+  __m128d s = _mm_div_pd(f, _mm_add_pd(_mm_set1_pd(2.0), f));
+  __m128d z = _mm_mul_pd(s, s);
+  __m128d w = _mm_mul_pd(z, z);
+  __m128d t1 = _mm_add_pd(_mm_set1_pd(kLogLg[3]), _mm_mul_pd(w, _mm_set1_pd(kLogLg[5])));
+  t1 = _mm_mul_pd(w, _mm_add_pd(_mm_set1_pd(kLogLg[1]), _mm_mul_pd(w, t1)));
+  __m128d t2 = _mm_add_pd(_mm_set1_pd(kLogLg[4]), _mm_mul_pd(w, _mm_set1_pd(kLogLg[6])));
+  t2 = _mm_add_pd(_mm_set1_pd(kLogLg[2]), _mm_mul_pd(w, t2));
+  t2 = _mm_mul_pd(z, _mm_add_pd(_mm_set1_pd(kLogLg[0]), _mm_mul_pd(w, t2)));
+  __m128d r = _mm_add_pd(t2, t1);
+  __m128d tail = _mm_add_pd(_mm_mul_pd(s, _mm_add_pd(hfsq, r)), _mm_mul_pd(e, _mm_set1_pd(kLn2Lo)));
+  __m128d result = _mm_sub_pd(_mm_mul_pd(e, _mm_set1_pd(kLn2Hi)), _mm_sub_pd(_mm_sub_pd(hfsq, tail), f));
+  result = SseSelect(_mm_cmpeq_pd(x, _mm_setzero_pd()), _mm_set1_pd(-numeric_limits<double>::infinity()), result);
+  result = SseSelect(_mm_cmplt_pd(x, _mm_setzero_pd()), _mm_set1_pd(numeric_limits<double>::quiet_NaN()), result);
+  result = SseSelect(_mm_cmpeq_pd(x, _mm_set1_pd(numeric_limits<double>::infinity())), x, result);
+  return SseSelect(_mm_cmpunord_pd(x, x), x, result);
+}
+
+// exp or log of "n" values in place, 2 doubles at a time. The AVX kernels use them too : AVX
+// without AVX2 has no 256-bit integer shifts for the exponent bits.
+__attribute__((target("sse2")))
+static void SseExpLogDouble(OpCode op, double* values, size_t n) {
+  size_t i = 0;
+  if (op == OpCode::kExp) {
+    for (; i + 2 <= n; i += 2) _mm_storeu_pd(values + i, SseExp(_mm_loadu_pd(values + i)));
+  } else {
+    for (; i + 2 <= n; i += 2) _mm_storeu_pd(values + i, SseLog(_mm_loadu_pd(values + i)));
+  }
+  for (; i < n; i++) values[i] = op == OpCode::kExp? Exp(values[i]) : Log(values[i]);
+}
+
+// 4 floats at a time, through double like Exp<float>() and Log<float>().
+__attribute__((target("sse2")))
+static void SseExpLogFloat(OpCode op, float* values, size_t n) {
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128 x = _mm_loadu_ps(values + i);
+    __m128d low = _mm_cvtps_pd(x), high = _mm_cvtps_pd(_mm_movehl_ps(x, x));
+    if (op == OpCode::kExp) {
+      low = SseExp(low);
+      high = SseExp(high);
+    } else {
+      low = SseLog(low);
+      high = SseLog(high);
+    }
+    _mm_storeu_ps(values + i, _mm_movelh_ps(_mm_cvtpd_ps(low), _mm_cvtpd_ps(high)));
+  }
+  for (; i < n; i++) values[i] = op == OpCode::kExp? Exp(values[i]) : Log(values[i]);
+}
+
+// SseExp() and SseLog() on 4 doubles, with the 256-bit integer shifts of AVX2. The compares are the
+// same predicates as the SSE ones.
+__attribute__((target("avx2")))
+static inline __m256d Avx2Select(__m256d mask, __m256d a, __m256d b) {
+  return _mm256_or_pd(_mm256_and_pd(mask, a), _mm256_andnot_pd(mask, b));
+}
+
+__attribute__((target("avx2")))
+static inline __m256d Avx2Pow2(__m256d k) {
+  __m256i bits = _mm256_castpd_si256(_mm256_add_pd(k, _mm256_set1_pd(1023 + math::kShifter)));
+  return _mm256_castsi256_pd(_mm256_slli_epi64(bits, 52));
+}
+
+__attribute__((target("avx2")))
+static inline __m256d Avx2Exp(__m256d x) {
+  using namespace math;
+  const __m256d shifter = _mm256_set1_pd(kShifter);
+  __m256d clamped = _mm256_max_pd(_mm256_min_pd(x, _mm256_set1_pd(710.0)), _mm256_set1_pd(-746.0));
+  __m256d k = _mm256_sub_pd(_mm256_add_pd(_mm256_mul_pd(clamped, _mm256_set1_pd(kLog2e)), shifter), shifter);
+  __m256d hi = _mm256_sub_pd(clamped, _mm256_mul_pd(k, _mm256_set1_pd(kLn2Hi)));
+  __m256d lo = _mm256_mul_pd(k, _mm256_set1_pd(kLn2Lo));
+  __m256d r = _mm256_sub_pd(hi, lo);
+  __m256d r2 = _mm256_mul_pd(r, r);
+  __m256d p = _mm256_add_pd(_mm256_set1_pd(kExpP[3]), _mm256_mul_pd(r2, _mm256_set1_pd(kExpP[4])));
+  p = _mm256_add_pd(_mm256_set1_pd(kExpP[2]), _mm256_mul_pd(r2, p));
+  p = _mm256_add_pd(_mm256_set1_pd(kExpP[1]), _mm256_mul_pd(r2, p));
+  p = _mm256_add_pd(_mm256_set1_pd(kExpP[0]), _mm256_mul_pd(r2, p));
+  __m256d c = _mm256_sub_pd(r, _mm256_mul_pd(r2, p));
+  __m256d quotient = _mm256_div_pd(_mm256_mul_pd(r, c), _mm256_sub_pd(_mm256_set1_pd(2.0), c));
+  __m256d y = _mm256_sub_pd(_mm256_set1_pd(1.0), _mm256_sub_pd(_mm256_sub_pd(lo, quotient), hi));
+  __m256d k1 = _mm256_sub_pd(_mm256_add_pd(_mm256_mul_pd(k, _mm256_set1_pd(0.5)), shifter), shifter);
+  __m256d result = _mm256_mul_pd(_mm256_mul_pd(y, Avx2Pow2(k1)), Avx2Pow2(_mm256_sub_pd(k, k1)));
+  return Avx2Select(_mm256_cmp_pd(x, x, _CMP_UNORD_Q), x, result);
+}
+
+__attribute__((target("avx2")))
+static inline __m256d Avx2Log(__m256d x) {
+  using namespace math;
+  const __m256d one = _mm256_set1_pd(1.0), two52 = _mm256_set1_pd(4503599627370496.0);
+  const __m256d zero = _mm256_setzero_pd(), infinity = _mm256_set1_pd(numeric_limits<double>::infinity());
+  __m256d subnormal = _mm256_cmp_pd(x, _mm256_set1_pd(kMinNormal), _CMP_LT_OS);
+  __m256d scaled = Avx2Select(subnormal, _mm256_mul_pd(x, _mm256_set1_pd(kTwo54)), x);
+  __m256d bias = Avx2Select(subnormal, _mm256_set1_pd(1023 + 54), _mm256_set1_pd(1023));
+  __m256i bits = _mm256_castpd_si256(scaled);
+  __m256i exponent = _mm256_and_si256(_mm256_srli_epi64(bits, 52), _mm256_set1_epi64x(0x7FF));
+  __m256d e = _mm256_sub_pd(_mm256_sub_pd(_mm256_or_pd(_mm256_castsi256_pd(exponent), two52), two52), bias);
+  __m256d m = _mm256_or_pd(_mm256_and_pd(scaled, _mm256_castsi256_pd(_mm256_set1_epi64x(0x000FFFFFFFFFFFFFll))), one);
+  __m256d big = _mm256_cmp_pd(m, _mm256_set1_pd(kSqrt2), _CMP_GT_OS);
+  m = Avx2Select(big, _mm256_mul_pd(m, _mm256_set1_pd(0.5)), m);
+  e = Avx2Select(big, _mm256_add_pd(e, one), e);
+  __m256d f = _mm256_sub_pd(m, one);
+  __m256d hfsq = _mm256_mul_pd(_mm256_mul_pd(_mm256_set1_pd(0.5), f), f);
+  __m256d s = _mm256_div_pd(f, _mm256_add_pd(_mm256_set1_pd(2.0), f));
+  __m256d z = _mm256_mul_pd(s, s);
+  __m256d w = _mm256_mul_pd(z, z);
+  __m256d t1 = _mm256_add_pd(_mm256_set1_pd(kLogLg[3]), _mm256_mul_pd(w, _mm256_set1_pd(kLogLg[5])));
+  t1 = _mm256_mul_pd(w, _mm256_add_pd(_mm256_set1_pd(kLogLg[1]), _mm256_mul_pd(w, t1)));
+  __m256d t2 = _mm256_add_pd(_mm256_set1_pd(kLogLg[4]), _mm256_mul_pd(w, _mm256_set1_pd(kLogLg[6])));
+  t2 = _mm256_add_pd(_mm256_set1_pd(kLogLg[2]), _mm256_mul_pd(w, t2));
+  t2 = _mm256_mul_pd(z, _mm256_add_pd(_mm256_set1_pd(kLogLg[0]), _mm256_mul_pd(w, t2)));
+  __m256d r = _mm256_add_pd(t2, t1);
+  __m256d tail = _mm256_add_pd(_mm256_mul_pd(s, _mm256_add_pd(hfsq, r)), _mm256_mul_pd(e, _mm256_set1_pd(kLn2Lo)));
+  __m256d result = _mm256_sub_pd(_mm256_mul_pd(e, _mm256_set1_pd(kLn2Hi)), _mm256_sub_pd(_mm256_sub_pd(hfsq, tail), f));
+  result = Avx2Select(_mm256_cmp_pd(x, zero, _CMP_EQ_OQ), _mm256_set1_pd(-numeric_limits<double>::infinity()), result);
+  result = Avx2Select(_mm256_cmp_pd(x, zero, _CMP_LT_OS), _mm256_set1_pd(numeric_limits<double>::quiet_NaN()), result);
+  result = Avx2Select(_mm256_cmp_pd(x, infinity, _CMP_EQ_OQ), x, result);
+  return Avx2Select(_mm256_cmp_pd(x, x, _CMP_UNORD_Q), x, result);
+}
+
+// exp or log of "n" values in place, 4 doubles at a time.
+__attribute__((target("avx2")))
+static void Avx2ExpLogDouble(OpCode op, double* values, size_t n) {
+  size_t i = 0;
+  if (op == OpCode::kExp) {
+    for (; i + 4 <= n; i += 4) _mm256_storeu_pd(values + i, Avx2Exp(_mm256_loadu_pd(values + i)));
+  } else {
+    for (; i + 4 <= n; i += 4) _mm256_storeu_pd(values + i, Avx2Log(_mm256_loadu_pd(values + i)));
+  }
+  for (; i < n; i++) values[i] = op == OpCode::kExp? Exp(values[i]) : Log(values[i]);
+}
+
+// 8 floats at a time, through double like Exp<float>() and Log<float>().
+__attribute__((target("avx2")))
+static void Avx2ExpLogFloat(OpCode op, float* values, size_t n) {
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256 x = _mm256_loadu_ps(values + i);
+    __m256d low = _mm256_cvtps_pd(_mm256_castps256_ps128(x)), high = _mm256_cvtps_pd(_mm256_extractf128_ps(x, 1));
+    if (op == OpCode::kExp) {
+      low = Avx2Exp(low);
+      high = Avx2Exp(high);
+    } else {
+      low = Avx2Log(low);
+      high = Avx2Log(high);
+    }
+    _mm256_storeu_ps(values + i, _mm256_insertf128_ps(_mm256_castps128_ps256(_mm256_cvtpd_ps(low)), _mm256_cvtpd_ps(high), 1));
+  }
+  for (; i < n; i++) values[i] = op == OpCode::kExp? Exp(values[i]) : Log(values[i]);
+}
+
+// __attribute__((target("avx"))) lets gcc use AVX instructions in this function only, so we don't
+// need to build the whole program with -mavx (which would crash on CPUs without AVX).
+// Each kernel handles "width" values per step with the intrinsics, and the left (less than
+// "width") values with the scalar kernel. The negation flips the sign bit and abs clears it, as
+// -x and fabs() do.
+#define SIMD_BLOCK_KERNEL(name, target_isa, T, width, vec_t, load, store, set1, add, sub, mul, div, \
+                          xor_, andnot, sqrt_, min_, max_, exp_log) \
+  __attribute__((target(target_isa))) \
+  static void name(OpCode op, T* operand1, const T* operand2, size_t n) { \
+    const vec_t sign = set1((T)-0.0); \
+    size_t i = 0; \
+    switch (op) { \
+      case OpCode::kAdd: \
+        for (; i + width <= n; i += width) store(operand1 + i, add(load(operand1 + i), load(operand2 + i))); \
+        break; \
+      case OpCode::kSub: \
+        for (; i + width <= n; i += width) store(operand1 + i, sub(load(operand1 + i), load(operand2 + i))); \
+        break; \
+      case OpCode::kMul: \
+        for (; i + width <= n; i += width) store(operand1 + i, mul(load(operand1 + i), load(operand2 + i))); \
+        break; \
+      case OpCode::kDiv: \
+        for (; i + width <= n; i += width) store(operand1 + i, div(load(operand1 + i), load(operand2 + i))); \
+        break; \
+      case OpCode::kNeg: \
+        for (; i + width <= n; i += width) store(operand1 + i, xor_(load(operand1 + i), sign)); \
+        break; \
+      case OpCode::kAbs: \
+        for (; i + width <= n; i += width) store(operand1 + i, andnot(sign, load(operand1 + i))); \
+        break; \
+      case OpCode::kSqrt: \
+        for (; i + width <= n; i += width) store(operand1 + i, sqrt_(load(operand1 + i))); \
+        break; \
+      case OpCode::kMin: \
+        for (; i + width <= n; i += width) store(operand1 + i, min_(load(operand1 + i), load(operand2 + i))); \
+        break; \
+      case OpCode::kMax: \
+        for (; i + width <= n; i += width) store(operand1 + i, max_(load(operand1 + i), load(operand2 + i))); \
+        break; \
+      case OpCode::kExp: \
+      case OpCode::kLog: \
+        exp_log(op, operand1, n); \
+        return; \
+      default: \
+        break; \
+    } \
+    ScalarBlockKernel<T>(op, operand1 + i, operand2 + i, n - i); \
+  }
+
+SIMD_BLOCK_KERNEL(SseBlockKernelFloat, "sse2", float, 4, __m128, _mm_loadu_ps, _mm_storeu_ps, _mm_set1_ps,
+                  _mm_add_ps, _mm_sub_ps, _mm_mul_ps, _mm_div_ps,
+                  _mm_xor_ps, _mm_andnot_ps, _mm_sqrt_ps, _mm_min_ps, _mm_max_ps, SseExpLogFloat)
+SIMD_BLOCK_KERNEL(SseBlockKernelDouble, "sse2", double, 2, __m128d, _mm_loadu_pd, _mm_storeu_pd, _mm_set1_pd,
+                  _mm_add_pd, _mm_sub_pd, _mm_mul_pd, _mm_div_pd,
+                  _mm_xor_pd, _mm_andnot_pd, _mm_sqrt_pd, _mm_min_pd, _mm_max_pd, SseExpLogDouble)
+SIMD_BLOCK_KERNEL(AvxBlockKernelFloat, "avx", float, 8, __m256, _mm256_loadu_ps, _mm256_storeu_ps, _mm256_set1_ps,
+                  _mm256_add_ps, _mm256_sub_ps, _mm256_mul_ps, _mm256_div_ps,
+                  _mm256_xor_ps, _mm256_andnot_ps, _mm256_sqrt_ps, _mm256_min_ps, _mm256_max_ps, SseExpLogFloat)
+SIMD_BLOCK_KERNEL(AvxBlockKernelDouble, "avx", double, 4, __m256d, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_set1_pd,
+                  _mm256_add_pd, _mm256_sub_pd, _mm256_mul_pd, _mm256_div_pd,
+                  _mm256_xor_pd, _mm256_andnot_pd, _mm256_sqrt_pd, _mm256_min_pd, _mm256_max_pd, SseExpLogDouble)
+SIMD_BLOCK_KERNEL(Avx2BlockKernelFloat, "avx2", float, 8, __m256, _mm256_loadu_ps, _mm256_storeu_ps, _mm256_set1_ps,
+                  _mm256_add_ps, _mm256_sub_ps, _mm256_mul_ps, _mm256_div_ps,
+                  _mm256_xor_ps, _mm256_andnot_ps, _mm256_sqrt_ps, _mm256_min_ps, _mm256_max_ps, Avx2ExpLogFloat)
+SIMD_BLOCK_KERNEL(Avx2BlockKernelDouble, "avx2", double, 4, __m256d, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_set1_pd,
+                  _mm256_add_pd, _mm256_sub_pd, _mm256_mul_pd, _mm256_div_pd,
+                  _mm256_xor_pd, _mm256_andnot_pd, _mm256_sqrt_pd, _mm256_min_pd, _mm256_max_pd, Avx2ExpLogDouble)
+
+#undef SIMD_BLOCK_KERNEL
+#endif
+
+// The best SIMD level the running CPU supports, detected once.
+inline SimdLevel DetectSimdLevel(void) {
+#ifdef Have_X86_Simd_Kernels
+  static const SimdLevel level = __builtin_cpu_supports("avx2")? SimdLevel::kAVX2 :
+                                 __builtin_cpu_supports("avx")? SimdLevel::kAVX :
+                                 __builtin_cpu_supports("sse2")? SimdLevel::kSSE : SimdLevel::kScalar;
+  return level;
+#else
+  return SimdLevel::kScalar;
+#endif
+}
+
+// Pick the kernel for T at "level". Types without SIMD kernels always get the scalar one.
+template <typename T>
+BlockKernel<T> SelectBlockKernel(SimdLevel level) {
+#ifdef Have_X86_Simd_Kernels
+  if constexpr (is_same<T, float>::value) {
+    if (level == SimdLevel::kAVX2) return Avx2BlockKernelFloat;
+    if (level == SimdLevel::kAVX) return AvxBlockKernelFloat;
+    if (level == SimdLevel::kSSE) return SseBlockKernelFloat;
+  } else if constexpr (is_same<T, double>::value) {
+    if (level == SimdLevel::kAVX2) return Avx2BlockKernelDouble;
+    if (level == SimdLevel::kAVX) return AvxBlockKernelDouble;
+    if (level == SimdLevel::kSSE) return SseBlockKernelDouble;
+  }
+#endif
+  return ScalarBlockKernel<T>;
+}
+
+// A tiny x86-64 JIT : CompiledExpression<float/double> to straight-line SSE2 code.
+//
+// The RPN stack is mapped onto the xmm registers, stack slot i is xmm<i>, so the generated code
+// has no stack memory at all : a constant is loaded from a pool after the code, a variable from
+// the values/columns, and an operator is one addsd/subsd/mulsd/divsd (or ss/pd/ps) between two
+// registers. The result ends in xmm0, where the calling convention wants it.
+// The negation and abs are an xor/and of the sign bit with a mask from the pool, sqrt/min/max are
+// one instruction too.
+// SSE does the same IEEE operations in the same order as Execute(), so the results are the same
+// bit for bit.
+//
+// Plans with ^ % exp log (they need a call to the math functions), plans deeper than the registers
+// we can use freely, other types, or no way to get executable memory : Compile() gives nullptr
+// and the interpreter keeps running them.
+#if (defined(__x86_64__) || defined(_M_X64)) && (defined(Have_Posix_Mmap) || defined(_WIN32))
+#define Have_X64_Jit
+
+// Bytes of x86-64 instructions, only the few forms the JIT needs.
+class X64Assembler {
+ public:
+  // general purpose registers, by their number in the encoding.
+  enum Register { kRax = 0, kRcx = 1, kRdx = 2, kRsi = 6, kRdi = 7, kR8 = 8, kR9 = 9, kR10 = 10 };
+  // the mandatory prefix choosing the packed/scalar float/double form of an SSE instruction.
+  enum SseForm : uint8_t { kPackedFloat = 0, kPackedDouble = 0x66, kScalarDouble = 0xF2, kScalarFloat = 0xF3 };
+  enum SseOpcode : uint8_t { kSseLoad = 0x10, kSseStore = 0x11, kSseSqrt = 0x51, kSseAnd = 0x54, kSseXor = 0x57,
+                             kSseAdd = 0x58, kSseMul = 0x59, kSseSub = 0x5C, kSseMin = 0x5D, kSseDiv = 0x5E,
+                             kSseMax = 0x5F };
+
+  vector<uint8_t> code;
+
+  size_t Size(void) const { return code.size(); }
+  void Byte(uint8_t byte) { code.push_back(byte); }
+  void Int32(int32_t value) { Patch32(code.size(), value); }
+  void Patch32(size_t pos, int32_t value) {
+    if (code.size() < pos + 4) code.resize(pos + 4);
+    memcpy(&code[pos], &value, 4);
+  }
+
+  // xmm<dst> = xmm<dst> op xmm<src>
+  void SseOp(SseForm form, SseOpcode op, int dst, int src) {
+    SsePrefix(form, dst, 0, src, op);
+    ModRM(3, dst, src);
+  }
+  // xmm<dst> = [rip + disp32], or xmm<dst> = xmm<dst> op [rip + disp32], return the position of
+  // disp32 to patch when the target is known.
+  size_t SseLoadRipRelative(SseForm form, int dst, SseOpcode op = kSseLoad) {
+    SsePrefix(form, dst, 0, 0, op);
+    ModRM(0, dst, 5);
+    size_t pos = Size();
+    Int32(0);
+    return pos;
+  }
+  // xmm<dst> = [base + disp32], base can't be rsp or r12.
+  void SseLoad(SseForm form, int dst, int base, int32_t disp) {
+    SsePrefix(form, dst, 0, base, kSseLoad);
+    ModRM(2, dst, base);
+    Int32(disp);
+  }
+  // xmm<reg> = [base + index * 2^scale] or the other way, base can't be rbp or r13.
+  void SseIndexed(SseForm form, SseOpcode op, int reg, int base, int index, int scale) {
+    SsePrefix(form, reg, index, base, op);
+    ModRM(0, reg, 4);
+    Byte((uint8_t)((scale << 6) | ((index & 7) << 3) | (base & 7)));
+  }
+  // dst = [base + disp32], 64 bits, base can't be rsp or r12.
+  void Load64(int dst, int base, int32_t disp) {
+    Rex(true, dst, 0, base);
+    Byte(0x8B);
+    ModRM(2, dst, base);
+    Int32(disp);
+  }
+  void Mov64(int dst, int src) {
+    Rex(true, src, 0, dst);
+    Byte(0x89);
+    ModRM(3, src, dst);
+  }
+  void AddImm8(int reg, int8_t value) {
+    Rex(true, 0, 0, reg);
+    Byte(0x83);
+    ModRM(3, 0, reg);
+    Byte((uint8_t)value);
+  }
+  // compare "reg1" with "reg2" (unsigned), for JumpIfBelow().
+  void Cmp64(int reg1, int reg2) {
+    Rex(true, reg2, 0, reg1);
+    Byte(0x39);
+    ModRM(3, reg2, reg1);
+  }
+  void JumpIfBelow(size_t target) {
+    Byte(0x0F);
+    Byte(0x82);
+    Int32((int32_t)(target - (Size() + 4)));
+  }
+  void Ret(void) { Byte(0xC3); }
+
+ private:
+  // the REX prefix carries the 4th bit of the registers, and W for 64-bit operands.
+  void Rex(bool wide, int reg, int index, int base) {
+    uint8_t rex = (uint8_t)(0x40 | (wide << 3) | ((reg >> 3) << 2) | ((index >> 3) << 1) | (base >> 3));
+    if (rex != 0x40) Byte(rex);
+  }
+  void ModRM(int mod, int reg, int rm) {
+    Byte((uint8_t)((mod << 6) | ((reg & 7) << 3) | (rm & 7)));
+  }
+  void SsePrefix(SseForm form, int reg, int index, int base, SseOpcode op) {
+    if (form != kPackedFloat) Byte(form);
+    Rex(false, reg, index, base);
+    Byte(0x0F);
+    Byte(op);
+  }
+};
+
+// Native code of one plan, made by JitFunction<T>::Compile().
+//   operator()(values) : same as Calculator::Execute(plan, values).
+//   Batch(columns, rows, out) : same as Calculator::ExecuteBatch(plan, columns, rows, out), with
+//                               2 doubles or 4 floats per instruction, and the left rows one by one.
+template <typename T>
+class JitFunction {
+ public:
+  static unique_ptr<JitFunction> Compile(const CompiledExpression<T>& plan) {
+    if constexpr (is_same<T, float>::value || is_same<T, double>::value) {
+      if (!Fits(plan)) return nullptr;
+
+      const X64Assembler::SseForm scalar = sizeof(T) == 8? X64Assembler::kScalarDouble : X64Assembler::kScalarFloat;
+      const X64Assembler::SseForm packed = sizeof(T) == 8? X64Assembler::kPackedDouble : X64Assembler::kPackedFloat;
+      X64Assembler as;
+      vector<pair<size_t, T>> constants;   // where each constant is loaded, and its value.
+
+      // T f(const T* values)
+      size_t scalar_entry = as.Size();
+      EmitBody(as, plan, scalar, constants, [&](int dst, int index) {
+        as.SseLoad(scalar, dst, kArg0, index * (int)sizeof(T));
+      });
+      as.Ret();
+
+      // void f(const T* const* columns, size_t begin, size_t end, T* out), once with the packed
+      // instructions and "end - begin" a multiple of kLanes, once with the scalar ones for the rest.
+      size_t entries[2];
+      for (int i = 0; i < 2; i++) {
+        X64Assembler::SseForm form = i == 0? packed : scalar;
+        entries[i] = as.Size();
+        as.Mov64(X64Assembler::kR10, kArg1);   // r10 : the row.
+        size_t loop = as.Size();
+        EmitBody(as, plan, form, constants, [&](int dst, int index) {
+          as.Load64(X64Assembler::kRax, kArg0, index * 8);
+          as.SseIndexed(form, X64Assembler::kSseLoad, dst, X64Assembler::kRax, X64Assembler::kR10, kScale);
+        });
+        as.SseIndexed(form, X64Assembler::kSseStore, 0, kArg3, X64Assembler::kR10, kScale);
+        as.AddImm8(X64Assembler::kR10, (int8_t)(i == 0? kLanes : 1));
+        as.Cmp64(X64Assembler::kR10, kArg2);
+        as.JumpIfBelow(loop);
+        as.Ret();
+      }
+
+      // the constant pool, 16 bytes per constant so the packed loads get it in every lane.
+      while (as.Size() % 16 != 0) as.Byte(0xCC);
+      for (const auto& constant : constants) {
+        as.Patch32(constant.first, (int32_t)(as.Size() - (constant.first + 4)));
+        for (size_t lane = 0; lane < kLanes; lane++) {
+          as.code.resize(as.Size() + sizeof(T));
+          memcpy(&as.code[as.Size() - sizeof(T)], &constant.second, sizeof(T));
+        }
+      }
+
+      size_t size = 0;
+      uint8_t* memory = AllocateExecutable(as.code, size);
+      if (memory == nullptr) return nullptr;
+      unique_ptr<JitFunction> function(new JitFunction(memory, size));
+      function->scalar_ = reinterpret_cast<ScalarFunction>(memory + scalar_entry);
+      function->packed_ = reinterpret_cast<BatchFunction>(memory + entries[0]);
+      function->left_ = reinterpret_cast<BatchFunction>(memory + entries[1]);
+      return function;
+    } else {
+      (void)plan;
+      return nullptr;
+    }
+  }
+
+  ~JitFunction() {
+#ifdef _WIN32
+    VirtualFree(memory_, 0, MEM_RELEASE);
+#else
+    munmap(memory_, size_);
+#endif
+  }
+  JitFunction(const JitFunction&) = delete;
+  JitFunction& operator=(const JitFunction&) = delete;
+
+  T operator()(const T* values) const {
+    return scalar_(values);
+  }
+
+  void Batch(const T* const* columns, size_t rows, T* out) const {
+    size_t packed_rows = rows - rows % kLanes;
+    if (packed_rows > 0) packed_(columns, 0, packed_rows, out);
+    if (packed_rows < rows) left_(columns, packed_rows, rows, out);
+  }
+
+ private:
+  using ScalarFunction = T (*)(const T* values);
+  using BatchFunction = void (*)(const T* const* columns, size_t begin, size_t end, T* out);
+
+  static constexpr size_t kLanes = 16 / sizeof(T);
+  static constexpr int kScale = sizeof(T) == 8? 3 : 2;   // log2(sizeof(T)), for [base + index * 2^scale]
+#ifdef _WIN32
+  // Microsoft x64 calling convention, xmm6 and up must be saved by the callee so we don't use them.
+  static constexpr int kArg0 = X64Assembler::kRcx, kArg1 = X64Assembler::kRdx,
+                       kArg2 = X64Assembler::kR8, kArg3 = X64Assembler::kR9;
+  static constexpr int kXmmRegisters = 6;
+#else
+  // System V AMD64 calling convention, all xmm registers are free to use.
+  static constexpr int kArg0 = X64Assembler::kRdi, kArg1 = X64Assembler::kRsi,
+                       kArg2 = X64Assembler::kRdx, kArg3 = X64Assembler::kRcx;
+  static constexpr int kXmmRegisters = 16;
+#endif
+
+  JitFunction(uint8_t* memory, size_t size) : memory_(memory), size_(size) {}
+
+  // Whether the RPN of "plan" is well formed, has a native form for all its operators, and its
+  // stack fits in the xmm registers.
+  static bool Fits(const CompiledExpression<T>& plan) {
+    int sp = 0;
+    for (const Instruction<T>& ins : plan.code) {
+      if (ins.code == OpCode::kMod || ins.code == OpCode::kPow || ins.code == OpCode::kExp ||
+          ins.code == OpCode::kLog) {
+        return false;
+      }
+      if (sp < Arity(ins.code)) return false;
+      sp += StackEffect(ins.code);
+      if (sp > kXmmRegisters) return false;
+    }
+    return sp == 1;
+  }
+
+  // T with the bits of "bits" (the low sizeof(T) bytes), for the masks of the sign bit.
+  static T Mask(uint64_t bits) {
+    T value;
+    if constexpr (sizeof(T) == 8) {
+      memcpy(&value, &bits, sizeof(T));
+    } else {
+      uint32_t low = (uint32_t)bits;
+      memcpy(&value, &low, sizeof(T));
+    }
+    return value;
+  }
+
+  template <typename LoadVariable>
+  static void EmitBody(X64Assembler& as, const CompiledExpression<T>& plan, X64Assembler::SseForm form,
+                       vector<pair<size_t, T>>& constants, LoadVariable load_variable) {
+    int sp = 0;
+    for (const Instruction<T>& ins : plan.code) {
+      if (ins.code == OpCode::kPushConst) {
+        constants.emplace_back(as.SseLoadRipRelative(form, sp++), ins.value);
+      } else if (ins.code == OpCode::kPushVar) {
+        load_variable(sp++, ins.index);
+      } else if (ins.code == OpCode::kNeg || ins.code == OpCode::kAbs) {
+        // xorps/xorpd, andps/andpd : no scalar form, the packed one does the same on the low lane.
+        X64Assembler::SseForm bitwise = sizeof(T) == 8? X64Assembler::kPackedDouble : X64Assembler::kPackedFloat;
+        bool negate = ins.code == OpCode::kNeg;
+        size_t pos = as.SseLoadRipRelative(bitwise, sp - 1, negate? X64Assembler::kSseXor : X64Assembler::kSseAnd);
+        uint64_t sign = sizeof(T) == 8? 0x8000000000000000ull : 0x80000000ull;
+        constants.emplace_back(pos, Mask(negate? sign : sign - 1));
+      } else if (ins.code == OpCode::kSqrt) {
+        as.SseOp(form, X64Assembler::kSseSqrt, sp - 1, sp - 1);
+      } else {
+        sp--;
+        X64Assembler::SseOpcode op = ins.code == OpCode::kAdd? X64Assembler::kSseAdd :
+                                     ins.code == OpCode::kSub? X64Assembler::kSseSub :
+                                     ins.code == OpCode::kMul? X64Assembler::kSseMul :
+                                     ins.code == OpCode::kMin? X64Assembler::kSseMin :
+                                     ins.code == OpCode::kMax? X64Assembler::kSseMax : X64Assembler::kSseDiv;
+        as.SseOp(form, op, sp - 1, sp);
+      }
+    }
+  }
+
+  // Copy "code" to new pages, and make them executable but not writable any more.
+  // nullptr if the system refuses.
+  static uint8_t* AllocateExecutable(const vector<uint8_t>& code, size_t& size) {
+#ifdef _WIN32
+    size = code.size();
+    void* memory = VirtualAlloc(nullptr, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    if (memory == nullptr) return nullptr;
+    memcpy(memory, code.data(), code.size());
+    DWORD old_protect;
+    if (!VirtualProtect(memory, size, PAGE_EXECUTE_READ, &old_protect)) {
+      VirtualFree(memory, 0, MEM_RELEASE);
+      return nullptr;
+    }
+    FlushInstructionCache(GetCurrentProcess(), memory, size);
+#else
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size = (code.size() + page - 1) / page * page;
+    void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) return nullptr;
+    memcpy(memory, code.data(), code.size());
+    if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0) {
+      munmap(memory, size);
+      return nullptr;
+    }
+#endif
+    return (uint8_t*)memory;
+  }
+
+  uint8_t* memory_;
+  size_t size_;
+  ScalarFunction scalar_ = nullptr;
+  BatchFunction packed_ = nullptr;
+  BatchFunction left_ = nullptr;
+};
+
+#else
+
+// No JIT on this platform : Compile() always gives nullptr, so the interpreter is always used.
+template <typename T>
+class JitFunction {
+ public:
+  static unique_ptr<JitFunction> Compile(const CompiledExpression<T>&) { return nullptr; }
+  T operator()(const T*) const { return T(); }
+  void Batch(const T* const*, size_t, T*) const {}
+};
+
+#endif
+
+// A compiled expression with automatic tiering, for Calculator::Execute()/ExecuteBatch() :
+// it's run by the interpreter first, and once it has been executed "threshold" times (every row of
+// ExecuteBatch() counts) it's compiled to native code by JitFunction, which runs it from then on.
+// Expressions used only a few times never pay for the compilation.
+// If the JIT can't take the plan, it just stays on the interpreter. It can be shared by threads.
+template <typename T>
+class TieredExpression {
+ public:
+  static constexpr size_t kDefaultThreshold = 1000;
+
+  // "threshold" 0 compiles right away.
+  explicit TieredExpression(CompiledExpression<T> plan, size_t threshold = kDefaultThreshold)
+    : plan_(move(plan)), threshold_(threshold) {
+    if (threshold_ == 0) Tier();
+  }
+
+  const CompiledExpression<T>& Plan(void) const { return plan_; }
+  bool IsNative(void) const { return native_.load(memory_order_acquire) != nullptr; }
+
+  // Count "executions" more, and compile the plan when they reach the threshold.
+  // Return the native code to run, or nullptr to run the interpreter.
+  // Once the JIT has refused the plan there is nothing left to count : the threads stop writing
+  // the shared counter, which would keep bouncing its cache line between them.
+  const JitFunction<T>* Tick(size_t executions) {
+    const JitFunction<T>* native = native_.load(memory_order_acquire);
+    if (native != nullptr || refused_.load(memory_order_relaxed)) return native;
+    size_t before = calls_.fetch_add(executions, memory_order_relaxed);
+    // only the thread crossing the threshold compiles.
+    if (before < threshold_ && before + executions >= threshold_) Tier();
+    return native_.load(memory_order_acquire);
+  }
+
+ private:
+  void Tier(void) {
+    jit_ = JitFunction<T>::Compile(plan_);
+    if (jit_ == nullptr) refused_.store(true, memory_order_relaxed);
+    native_.store(jit_.get(), memory_order_release);
+  }
+
+  CompiledExpression<T> plan_;
+  size_t threshold_;
+  atomic<size_t> calls_{0};
+  atomic<bool> refused_{false};
+  unique_ptr<JitFunction<T>> jit_;
+  atomic<const JitFunction<T>*> native_{nullptr};
+};
+
+// A stack on a flat array, for the tiny stacks an expression needs. It has the same push/pop/top
+// as std::stack, so it's a drop-in replacement.
+//
+// std::stack sits on a deque, which allocates in chunks and scatters the values. Here the array is
+// only grown by Reserve() and kept between expressions, like an arena, so once warmed up pushing
+// and popping never allocate. push() doesn't check the capacity, Reserve() enough for the
+// expression first. pop() and top() on an empty stack do nothing and give V(), so a malformed
+// expression can't read or write out of the array.
+template <typename V>
+class FixedStack {
+private:
+  vector<V> storage_;
+  size_t size_ = 0;
+
+public:
+  void Reserve(size_t capacity) {
+    if (storage_.size() < capacity) {
+      storage_.resize(capacity);
+      Instrumentation::Allocations(1);
+    }
+  }
+  void clear(void) { size_ = 0; }
+  bool empty(void) const { return size_ == 0; }
+  size_t size(void) const { return size_; }
+  void push(V value) { storage_[size_++] = value; }
+  void pop(void) {
+    if (size_ > 0) size_--;
+  }
+  V top(void) const { return size_ > 0? storage_[size_ - 1] : V(); }
+};
+
+// Return the key of "expression" in ResultCache : the expression without the spaces, tabs and
+// newlines that only sit between tokens, so "1 + 2" and "1+2" are the same key. A run of them that
+// separates tokens which would otherwise join is kept as one space : "2 3" stays "2 3", not the
+// number "23", and "1e -3" stays apart from the number "1e-3". So expressions with the same key
+// always have the same tokens, and the same result. The key is only for the lookup, the expression
+// itself is what gets calculated.
+// Most expressions have no spaces, and are returned as they are. The others are copied to "buffer",
+// it's reused by the caller so there is no allocation once warmed up.
+inline string_view NormalizeExpression(string_view expression, string& buffer) {
+  auto is_space = [](char ch) { return ch == ' ' || ch == '\t' || ch == '\r' || ch == '\n'; };
+  auto is_operand = [](char ch) { return isalnum((unsigned char)ch) || ch == '_' || ch == '.'; };
+  auto is_exponent = [](char ch) { return ch == 'e' || ch == 'E'; };
+  auto is_sign = [](char ch) { return ch == '+' || ch == '-'; };
+  size_t first = 0;
+  while (first < expression.size() && !is_space(expression[first])) first++;
+  if (first == expression.size()) return expression;
+
+  buffer.assign(expression.data(), first);
+  for (size_t i = first; i < expression.size(); i++) {
+    if (!is_space(expression[i])) {
+      buffer += expression[i];
+      continue;
+    }
+    size_t end = i;
+    while (end < expression.size() && is_space(expression[end])) end++;
+    if (!buffer.empty() && end < expression.size()) {
+      char before = buffer.back(), after = expression[end];
+      bool join = (is_operand(before) && is_operand(after)) || (is_exponent(before) && is_sign(after)) ||
+                  (is_sign(before) && is_operand(after) && buffer.size() > 1 && is_exponent(buffer[buffer.size() - 2]));
+      if (join) buffer += ' ';
+    }
+    i = end - 1;
+  }
+  return buffer;
+}
+
+// A cache of results, keyed by the normalized text of the expressions, for traffic where the same
+// expressions come over and over. Use it with Calculator::SetResultCache(), then Calculate() and
+// Evaluate() look the expression up first, and only parse and calculate it on a miss.
+//
+// The least recently used results are dropped when the cache takes more than "byte_budget" bytes
+// (the keys plus the bookkeeping of each entry).
+//
+// It is safe to share one cache by calculators on different threads. The entries are split into
+// "shards" by the hash of the key, each with its own lock and its own part of the budget, so the
+// threads seldom wait for each other. With 1 shard the lock is never contended, and costs only a
+// few ns per lookup.
+template <typename T>
+class ResultCache {
+private:
+  struct Entry {
+    string key;
+    T result;
+  };
+  // a key with its hash, which is calculated once and used both to pick the shard and in the index.
+  struct Key {
+    string_view text;
+    size_t hash;
+    bool operator==(const Key& other) const { return text == other.text; }
+  };
+  struct KeyHash {
+    size_t operator()(const Key& key) const { return key.hash; }
+  };
+  struct Shard {
+    mutex lock;
+    list<Entry> entries;   // the most recently used first.
+    unordered_map<Key, typename list<Entry>::iterator, KeyHash> index;   // keys are views of entries[].key.
+    size_t bytes = 0;
+  };
+
+  vector<Shard> shards_;
+  size_t shard_budget_;
+  atomic<size_t> hits_{0};
+  atomic<size_t> misses_{0};
+  atomic<size_t> evictions_{0};
+
+  static size_t EntryBytes(string_view key) {
+    // the list node, the hash table node and bucket, and the text of the key.
+    return sizeof(Entry) + 2 * sizeof(void*) + sizeof(Key) + 3 * sizeof(void*) + key.size();
+  }
+
+  static Key MakeKey(string_view text) {
+    return {text, hash<string_view>()(text)};
+  }
+
+  Shard& ShardOf(const Key& key) {
+    // the low bits pick the bucket in the index, use the high bits here.
+    return shards_[(key.hash >> 32) % shards_.size()];
+  }
+
+public:
+  explicit ResultCache(size_t byte_budget, int shards = 1)
+    : shards_(max(1, shards)), shard_budget_(byte_budget / shards_.size()) {}
+
+  // Get the result of the normalized expression "text" into "result", return false if it's not cached.
+  bool Find(string_view text, T& result) {
+    Key key = MakeKey(text);
+    Shard& shard = ShardOf(key);
+    lock_guard<mutex> guard(shard.lock);
+    auto it = shard.index.find(key);
+    if (it == shard.index.end()) {
+      misses_.fetch_add(1, memory_order_relaxed);
+      return false;
+    }
+    shard.entries.splice(shard.entries.begin(), shard.entries, it->second);   // now the most recently used.
+    result = it->second->result;
+    hits_.fetch_add(1, memory_order_relaxed);
+    return true;
+  }
+
+  // Cache "result" for the normalized expression "text", dropping the least recently used results
+  // if the shard goes over its budget.
+  void Insert(string_view text, T result) {
+    size_t bytes = EntryBytes(text);
+    if (bytes > shard_budget_) return;   // would push everything else out.
+    Key key = MakeKey(text);
+    Shard& shard = ShardOf(key);
+    lock_guard<mutex> guard(shard.lock);
+    if (shard.index.count(key) > 0) return;   // another thread calculated it at the same time.
+    shard.entries.push_front({string(text), result});
+    shard.index.emplace(Key{shard.entries.front().key, key.hash}, shard.entries.begin());
+    shard.bytes += bytes;
+    while (shard.bytes > shard_budget_) {
+      Entry& oldest = shard.entries.back();
+      shard.bytes -= EntryBytes(oldest.key);
+      shard.index.erase(MakeKey(oldest.key));
+      shard.entries.pop_back();
+      evictions_.fetch_add(1, memory_order_relaxed);
+    }
+  }
+
+  size_t Hits(void) const { return hits_; }
+  size_t Misses(void) const { return misses_; }
+  size_t Evictions(void) const { return evictions_; }
+
+  // bytes taken by all the shards now, never more than the budget.
+  size_t Bytes(void) {
+    size_t bytes = 0;
+    for (Shard& shard : shards_) {
+      lock_guard<mutex> guard(shard.lock);
+      bytes += shard.bytes;
+    }
+    return bytes;
+  }
+};
+
+// TryCalculate() of "calculator" with "cache" : look the expression up by its key (see
+// NormalizeExpression() above, "buffer" holds it), and on a miss calculate the expression as it was
+// given, caching the result if it's good. Errors are not cached, their positions are in the text.
+template <typename T, typename Calc>
+CalcResult<T> CachedCalculate(Calc& calculator, ResultCache<T>& cache, string_view expression, string& buffer) {
+  string_view key = NormalizeExpression(expression, buffer);
+  CalcResult<T> result{T(), ParseStatus()};
+  if (cache.Find(key, result.value)) return result;
+  result = calculator.TryCalculateNoCache(expression);
+  if (result.Ok()) cache.Insert(key, result.value);
+  return result;
+}
+
+const int kTraceOff = 0;
+const int kTraceTokens = 1;
+const int kTraceStack = 2;
+
+// T can be double, float or Decimal.
+// TraceLevel is one of kTraceOff, kTraceTokens and kTraceStack, see Calculator_Trace_Level above.
+template <typename T, int TraceLevel = kTraceOff>
+class Calculator {
+private:
+  FixedStack<T> operands_;
+  FixedStack<OpCode> operators_;   // operators and functions waiting for their operands, and kOpenParenthesis.
+  FixedStack<int> arguments_;      // for each kOpenParenthesis on operators_, the arguments of its function so
+                                   // far, or 0 if it's not the '(' of a function.
+  vector<T> exec_stack_;  // the stack used by Execute(). only grows, so no allocation after warm up.
+  vector<T> batch_stack_; // the stack used by ExecuteBatch(), each entry is a block of kBatchBlock values.
+  BlockKernel<T> block_kernel_ = SelectBlockKernel<T>(DetectSimdLevel());
+  T result_ = 0;
+  int result_precision_ = 0;
+  ostream* trace_sink_ = &cout;
+  ResultCache<T>* result_cache_ = nullptr;
+  string normalized_;   // the buffer of NormalizeExpression().
+
+  // Write "args" as one line of trace if TraceLevel is "level" or above. With a lower TraceLevel
+  // the body is discarded at compile time, so the call and its arguments cost nothing.
+  template <int level, typename... Args>
+  void Trace(const Args&... args) {
+    if constexpr (TraceLevel >= level) {
+      (*trace_sink_ << ... << args) << '\n';
+    }
+  }
+
+  // ShuntingYard() below only knows the order in which operands and operators come out, and
+  // leaves "what to do with them" to an emitter, which must have :
+  //   void Operand(T value, string_view text);  // an operand is ready, "text" is the number as written.
+  //   void Variable(string_view name);          // an operand which is a variable is ready.
+  //   void Operator(OpCode op);                 // an operator or function is ready, its operands
+  //                                             // (Arity(op) of them) were emitted before it.
+  //
+  // StackEvaluator calculates right away with operands_ (used by Evaluate),
+  // PlanEmitter records them as RPN instructions (used by Compile).
+  struct StackEvaluator {
+    Calculator* calc;
+
+    void Operand(T value, string_view) {
+      calc->operands_.push(value);
+      Instrumentation::StackDepth(calc->operands_.size());
+    }
+    void Variable(string_view) {
+      // there is no way to bind values to variables when calculating directly, use Compile() and
+      // Execute(plan, values) for that. Let an unbound variable be NaN, so it shows up in the result.
+      calc->operands_.push(numeric_limits<T>::quiet_NaN());
+      Instrumentation::StackDepth(calc->operands_.size());
+    }
+    void Operator(OpCode op) {
+      // pop the operands from stack top (2, or 1 for ex. "-x" or "sqrt(x)"), and push the result of
+      // "operand1 op operand2" back to stack as the new operand.
+      const OperatorInfo& info = Info(op);
+      T operand2 = calc->operands_.top();
+      if (info.arity == 2) calc->operands_.pop();
+      T operand1 = calc->operands_.top();
+      calc->operands_.pop();
+      calc->operands_.push(ApplyOperator(op, operand1, operand2));
+      Instrumentation::Reductions(1);
+      if (info.notation == Notation::kInfix) {
+        calc->template Trace<kTraceStack>("calculated ", operand1, info.symbol, operand2, "=", calc->operands_.top(),
+                                          ", ", calc->operands_.size(), " operand(s) on stack");
+      } else if (info.arity == 1) {
+        calc->template Trace<kTraceStack>("calculated ", info.symbol, "(", operand1, ")=", calc->operands_.top(),
+                                          ", ", calc->operands_.size(), " operand(s) on stack");
+      } else {
+        calc->template Trace<kTraceStack>("calculated ", info.symbol, "(", operand1, ",", operand2, ")=",
+                                          calc->operands_.top(), ", ", calc->operands_.size(), " operand(s) on stack");
+      }
+    }
+  };
+
+  struct PlanEmitter {
+    CompiledExpression<T>* plan;
+    int depth = 0;
+
+    void Operand(T value, string_view) {
+      plan->code.push_back({OpCode::kPushConst, 0, value});
+      Push();
+    }
+    void Variable(string_view name) {
+      int index = plan->VariableIndex(name);
+      if (index < 0) {
+        index = (int)plan->variables.size();
+        plan->variables.push_back(string(name));
+      }
+      plan->code.push_back({OpCode::kPushVar, index, 0});
+      Push();
+    }
+    void Operator(OpCode op) {
+      plan->code.push_back({op, 0, 0});
+      depth += StackEffect(op);
+      Instrumentation::Reductions(1);
+    }
+    void Push() {
+      depth++;
+      if (depth > plan->max_depth) plan->max_depth = depth;
+      Instrumentation::StackDepth(depth);
+    }
+  };
+
+  void modify_result_to_best_precision(void){
+    result_precision_ = BestPrecision(result_, result_);
+  }
+
+  void show_result(void){
+    PhaseTimer timer(Phase::kFormat);
+    // format it ourselves, instead of cout << fixed << setprecision(result_precision_), which we
+    // would have to set back to the defaults after.
+    char text[kMaxFormattedLength];
+    to_chars_result formatted = to_chars(text, text + sizeof(text), result_, chars_format::fixed, result_precision_);
+    cout.write(text, formatted.ptr - text);
+  }
+  
+  // Size operands_, operators_ and arguments_ for "expression" in one quick pass : every operand
+  // takes at most one entry of operands_, and every other char (operator or parenthesis) at most
+  // one entry of operators_, however deep the parentheses nest. A function name looks like an
+  // operand here, but takes an entry of operators_, so the operands are counted for both. A number
+  // with an exponent (ex. "1e-3") counts as 2 operands, which is too many but never too few.
+  void ReserveStacks(string_view expression) {
+    size_t operands = 0, operators = 0;
+    bool in_operand = false;
+    for (char ch : expression) {
+      bool operand_char = isalnum((unsigned char)ch) || (ch == '_') || (ch == '.');
+      if (operand_char && !in_operand) operands++;
+      if (!operand_char) operators++;
+      in_operand = operand_char;
+    }
+    operands_.Reserve(operands);
+    operators_.Reserve(operators + operands);
+    arguments_.Reserve(operators);
+  }
+
+  // Report "error" at "position" of the expression being parsed.
+  ParseStatus Malformed(ParseError error, size_t position) {
+    ParseStatus status{error, (uint32_t)position};
+    Trace<kTraceTokens>("malformed expression : ", status.Message(), " at ", position);
+    Instrumentation::Malformed(1);
+    return status;
+  }
+
+  // Tokenize "expression" and arrange operands/operators by their priority (the "shunting-yard"
+  // algorithm), handing them to "emitter" in RPN order.
+  // The expression is checked in the same pass, with the state the algorithm keeps anyway : whether
+  // an operand or an operator comes next, and the '(' waiting on operators_. At the first error it
+  // stops and returns what and where, with whatever it emitted so far left to the caller to drop.
+  // Any valid prefix of an expression emits a well-formed RPN for its complete part, so a
+  // malformed expression never reaches an empty stack.
+  template <typename Emitter>
+  ParseStatus ShuntingYard(string_view expression, Emitter& emitter) {
+    // start from empty stacks, whatever a malformed expression before left on them.
+    ReserveStacks(expression);
+    operands_.clear();
+    operators_.clear();
+    arguments_.clear();
+    // true at the start and after '(', ',' or an operator, where a '-' is a negation.
+    bool expect_operand = true;
+
+    size_t pos = 0;
+    while (pos < expression.size()) {
+      char ch = expression[pos];
+      if (isalpha((unsigned char)ch) || (ch == '_')) {
+        // a variable starts with a letter or '_', followed by letters, digits or '_',
+        // ex. "price", "qty2", "_fee". A name of kOperators followed by '(' is a function.
+        size_t start = pos;
+        if (!expect_operand) return Malformed(ParseError::kMissingOperator, start);
+        while (pos < expression.size() && (isalnum((unsigned char)expression[pos]) || expression[pos] == '_')) pos++;
+        string_view name = expression.substr(start, pos - start);
+        size_t next = pos;
+        while (next < expression.size() && isspace((unsigned char)expression[next])) next++;
+        Instrumentation::Tokens(1);
+        if (next < expression.size() && expression[next] == '(') {
+          OpCode function = FunctionOperator(name);
+          if (function == OpCode::kCount) return Malformed(ParseError::kUnknownFunction, start);
+          // it waits on operators_, under its '(', for the ')' after its arguments.
+          Trace<kTraceTokens>("got function \"", name, "\"");
+          operators_.push(function);
+          continue;
+        }
+        Trace<kTraceTokens>("got variable \"", name, "\"");
+        emitter.Variable(name);
+        expect_operand = false;
+        continue;
+      }
+      if (isdigit((unsigned char)ch) || (ch == '.')) {
+        // the whole number literal in one go, ex. "12345", "12.5", "1.5e-3".
+        size_t start = pos;
+        if (!expect_operand) return Malformed(ParseError::kMissingOperator, start);
+        T operand = ParseNumber<T>(expression, pos);
+        if (pos == start) return Malformed(ParseError::kUnexpectedCharacter, start);
+        Trace<kTraceTokens>("got operand \"", expression.substr(start, pos - start), "\" = ", operand);
+        Instrumentation::Tokens(1);
+        emitter.Operand(operand, expression.substr(start, pos - start));
+        expect_operand = false;
+        continue;
+      }
+      pos++;
+      if (isspace((unsigned char)ch)) continue;
+      Trace<kTraceTokens>("got operator '", ch, "'");
+      Instrumentation::Tokens(1);
+
+      // 如果是運算子
+      if (ch == '(') {
+        if (!expect_operand) return Malformed(ParseError::kMissingOperator, pos - 1);
+        // the arguments of a function so far, or 0 for a '(' which only groups, where ',' is wrong.
+        arguments_.push(Info(operators_.top()).notation == Notation::kFunction? 1 : 0);
+        operators_.push(kOpenParenthesis);
+        expect_operand = true;
+      } else if (ch == ')' || ch == ',') {
+        if (arguments_.empty()) {
+          return Malformed(ch == ')'? ParseError::kUnbalancedClose : ParseError::kMisplacedComma, pos - 1);
+        }
+        if (expect_operand) return Malformed(ParseError::kMissingOperand, pos - 1);
+        // point-1 to start calculation(^) - when getting ')'
+        // stop condition (s) - calculate until '(' met from stack top.
+        // (continue: '<', skip: '.', value : new operand1/2)
+        //
+        // 1+2*(3+4*(5+6*7+1))*(8+9)
+        //          s...47<<^         // Time2, got 48, pop one '('
+        //     s<<<<48.......^        // Time3, got 195, pop one '('
+        //                     s<<<^  // Time5, got 17, pop one '('
+        //
+        // ',' between the arguments of a function does the same, but leaves the '(' there.
+        while (!operators_.empty() && operators_.top() != kOpenParenthesis) {
+          // pop one operator each time, and let the emitter handle it with the operands emitted
+          // before it.
+          emitter.Operator(operators_.top());
+          operators_.pop();
+        }
+        int arguments = arguments_.top();
+        if (ch == ',') {
+          if (arguments == 0) return Malformed(ParseError::kMisplacedComma, pos - 1);
+          arguments_.pop();
+          arguments_.push(arguments + 1);
+          expect_operand = true;
+          continue;
+        }
+        operators_.pop();
+        arguments_.pop();
+        // the ')' of a function call : its arguments are all out, so it's the function's turn.
+        if (arguments > 0) {
+          if (arguments != Arity(operators_.top())) return Malformed(ParseError::kWrongArgumentCount, pos - 1);
+          emitter.Operator(operators_.top());
+          operators_.pop();
+        }
+        expect_operand = false;
+      } else if (expect_operand) {
+        // a sign before an operand, ex. "-x", "2*-3", "-(1+2)". It has no left operand, so it takes
+        // no operator off the stack. A '+' changes nothing.
+        OpCode op = PrefixOperator(ch);
+        if (op != OpCode::kCount) {
+          operators_.push(op);
+        } else if (ch != '+') {
+          return Malformed(InfixOperator(ch) != OpCode::kCount? ParseError::kMissingOperand
+                                                               : ParseError::kUnexpectedCharacter, pos - 1);
+        }
+      } else {
+        // point-2 to start calculation (^)- when getting operator after operand2 with priority
+        // lower than or equivalent to the previous one (the one on stack top, should not be '(').
+        // stop condition - calculate until
+        //    a) no more operator available,
+        //    b) '(' met from stack top.
+        //    c) current operator has higher priority (* or /) than the one on stack top, or the
+        //       same priority and is right-associative (^).
+        //
+        // 1+2*(3+4*(5+6*7+1)*(8+9)
+        //          b<<<<<^           // Time1, got 47.
+        //  c<<195...........^        // Time4, got 390.
+        //
+        OpCode op = InfixOperator(ch);
+        if (op == OpCode::kCount) return Malformed(ParseError::kUnexpectedCharacter, pos - 1);
+        while (!operators_.empty() && operators_.top() != kOpenParenthesis &&
+              CalculatedBefore(operators_.top(), op)) {
+          emitter.Operator(operators_.top());
+          operators_.pop();
+        }
+        operators_.push(op);
+        expect_operand = true;
+      }
+    }
+    if (expect_operand) {
+      bool empty = all_of(expression.begin(), expression.end(), [](char ch) { return isspace((unsigned char)ch); });
+      return Malformed(empty? ParseError::kEmpty : ParseError::kMissingOperand, empty? 0 : expression.size());
+    }
+    if (!arguments_.empty()) return Malformed(ParseError::kUnbalancedOpen, expression.size());
+
+    // point-3 to start calculation - last part, after all the "()" and "operations with high-then-low priority" 
+    // done. All the left parts are of operations with low-then-high priority.
+    // stop condition - no more operator available.
+    // 
+    // 1+2*(3+4*(5+6*7+1)*(8+9)
+    // s<390.............<17...^   // Time7 : got the final result.
+    // 
+    while (!operators_.empty()) {
+      emitter.Operator(operators_.top());
+      operators_.pop();
+    }
+    return ParseStatus();
+  }
+
+public:
+  // Parse and calculate "expression" in one go, without printing anything but the trace, and tell
+  // if it's malformed, what's wrong and where. No exception, and no allocation once warmed up, even
+  // for a malformed one, so a batch of expressions can skip the bad ones at full speed.
+  // With a result cache, the expression is looked up there first. Only good ones are cached.
+  CalcResult<T> TryCalculate(string_view expression) {
+    PhaseTimer timer(Phase::kCalculate);
+    if (result_cache_) return CachedCalculate(*this, *result_cache_, expression, normalized_);
+    return TryCalculateNoCache(expression);
+  }
+
+  // TryCalculate() without looking at the result cache. Its time is only recorded as part of TryCalculate().
+  CalcResult<T> TryCalculateNoCache(string_view expression) {
+    Instrumentation::Expressions(1);
+    StackEvaluator evaluator{this};
+    ParseStatus status = ShuntingYard(expression, evaluator);
+    if (!status.Ok()) return {numeric_limits<T>::quiet_NaN(), status};
+    return {operands_.top(), status};
+  }
+
+  // The value of TryCalculate()/TryCalculateNoCache() : NaN for a malformed expression.
+  T Calculate(string_view expression) { return TryCalculate(expression).value; }
+  T CalculateNoCache(string_view expression) { return TryCalculateNoCache(expression).value; }
+
+  // Parse and check "expression", handing its operands and operators in RPN order to "emitter", an
+  // emitter as StackEvaluator and PlanEmitter above, for other ways to calculate, ex. MixedCalculator.
+  template <typename Emitter>
+  ParseStatus Parse(string_view expression, Emitter& emitter) {
+    return ShuntingYard(expression, emitter);
+  }
+
+  void Evaluate(const string& expression) {
+    CalcResult<T> result = TryCalculate(expression);
+    if (!result.Ok()) {
+      char text[kMaxFormattedLength];
+      cout.write(text, FormatError(result.status, text, sizeof(text)));
+      cout << endl;
+      return;
+    }
+    result_ = result.value;
+    // print fraction part of result with proper decimal digits.
+    // TBD : to determine the best number of decimal digits to display.
+    cout << "result=";
+    modify_result_to_best_precision();
+    show_result();
+    cout << endl;
+  }
+
+  // Parse "expression" once into a plan, and use Execute() to evaluate it as many times as we want.
+  // ex.
+  //    CompiledExpression<double> plan = calculator.Compile("12+34*(56+78*2)");
+  //    for (...) sum += calculator.Execute(plan);   // no parsing, no stringstream, no allocation.
+  // "optimize" runs Optimize() on the plan, see above.
+  // A malformed expression gives a plan with plan.status telling what's wrong, which calculates NaN.
+  CompiledExpression<T> Compile(string_view expression, bool optimize = true) {
+    PhaseTimer timer(Phase::kCompile);
+    Instrumentation::Expressions(1);
+    CompiledExpression<T> plan;
+    PlanEmitter emitter{&plan};
+    plan.status = ShuntingYard(expression, emitter);
+    if (!plan.status.Ok()) {
+      plan.code.assign(1, {OpCode::kPushConst, 0, numeric_limits<T>::quiet_NaN()});
+      plan.max_depth = 1;
+      plan.variables.clear();
+      return plan;
+    }
+    if (optimize) Optimize(plan);
+    return plan;
+  }
+
+  // Run the RPN instructions of "plan".
+  // "values" are the values of plan.variables, in the same order. It can be nullptr if the plan has
+  // no variable.
+  // exec_stack_ is resized only when a plan needs a deeper stack than any plan before, so repeated
+  // executions do no heap allocation.
+  T Execute(const CompiledExpression<T>& plan, const T* values = nullptr) {
+    PhaseTimer timer(Phase::kExecute);
+    if (exec_stack_.size() < (size_t)plan.max_depth) {
+      exec_stack_.resize(plan.max_depth);
+      Instrumentation::Allocations(1);
+    }
+    T* stack = exec_stack_.data();
+    int sp = 0;   // stack pointer : number of values on the stack.
+    for (const Instruction<T>& ins : plan.code) {
+      if (ins.code == OpCode::kPushConst) {
+        stack[sp++] = ins.value;
+      } else if (ins.code == OpCode::kPushVar) {
+        stack[sp++] = values[ins.index];
+      } else if (ins.code <= OpCode::kDiv) {   // + - * /, nearly all the instructions.
+        sp--;
+        stack[sp - 1] = ApplyOperator(ins.code, stack[sp - 1], stack[sp]);
+      } else {
+        int arity = Arity(ins.code);
+        sp -= arity - 1;
+        stack[sp - 1] = ApplyOtherOperator(ins.code, stack[sp - 1], stack[sp + arity - 2]);
+      }
+    }
+    return stack[0];
+  }
+
+  // Number of rows ExecuteBatch() works on at a time. Small enough that the whole stack of blocks
+  // stays in L1/L2 cache, big enough that the loop over instructions costs nothing per row.
+  static constexpr size_t kBatchBlock = 256;
+
+  // Evaluate "plan" over "rows" rows of data stored column by column (structure-of-arrays) :
+  // columns[i] points to the "rows" values of plan.variables[i], and the results go to out[0..rows-1].
+  //
+  // Instead of running all the instructions row by row, every instruction is applied to a whole
+  // block of rows before moving to the next instruction, so each operator is a tight loop over
+  // contiguous values, and the data is read in one pass.
+  void ExecuteBatch(const CompiledExpression<T>& plan, const vector<const T*>& columns, size_t rows, T* out) {
+    PhaseTimer timer(Phase::kExecuteBatch);
+    if (batch_stack_.size() < plan.max_depth * kBatchBlock) {
+      batch_stack_.resize(plan.max_depth * kBatchBlock);
+      Instrumentation::Allocations(1);
+    }
+
+    for (size_t row = 0; row < rows; row += kBatchBlock) {
+      size_t n = min(kBatchBlock, rows - row);
+      T* slot = batch_stack_.data();   // the block on the stack top is slot - kBatchBlock.
+      for (const Instruction<T>& ins : plan.code) {
+        if (ins.code == OpCode::kPushConst) {
+          fill(slot, slot + n, ins.value);
+          slot += kBatchBlock;
+        } else if (ins.code == OpCode::kPushVar) {
+          copy(columns[ins.index] + row, columns[ins.index] + row + n, slot);
+          slot += kBatchBlock;
+        } else {
+          int arity = Arity(ins.code);
+          slot -= (arity - 1) * kBatchBlock;
+          block_kernel_(ins.code, slot - kBatchBlock, slot + (arity - 2) * (ptrdiff_t)kBatchBlock, n);
+        }
+      }
+      copy(batch_stack_.data(), batch_stack_.data() + n, out + row);
+    }
+  }
+
+  // Same as Execute(plan, values) and ExecuteBatch(plan, columns, rows, out), but once "expression"
+  // has been executed enough times it runs as native code. See TieredExpression.
+  T Execute(TieredExpression<T>& expression, const T* values = nullptr) {
+    if (const JitFunction<T>* native = expression.Tick(1)) {
+      PhaseTimer timer(Phase::kExecute);
+      return (*native)(values);
+    }
+    return Execute(expression.Plan(), values);
+  }
+
+  void ExecuteBatch(TieredExpression<T>& expression, const vector<const T*>& columns, size_t rows, T* out) {
+    if (const JitFunction<T>* native = expression.Tick(rows)) {
+      PhaseTimer timer(Phase::kExecuteBatch);
+      native->Batch(columns.data(), rows, out);
+      return;
+    }
+    ExecuteBatch(expression.Plan(), columns, rows, out);
+  }
+
+  // Look up the results of Calculate() and Evaluate() in "cache" first, and put new results there.
+  // nullptr to stop using the cache. The cache can be shared with calculators on other threads.
+  void SetResultCache(ResultCache<T>* cache) {
+    result_cache_ = cache;
+  }
+
+  // Write the trace to "sink" instead of cout. Nothing is written with kTraceOff.
+  void SetTraceSink(ostream& sink) {
+    trace_sink_ = &sink;
+  }
+
+  // Use the block kernels of "level" in ExecuteBatch() instead of the best one of this CPU.
+  // Mainly for testing the kernels against each other, "level" should be supported by the CPU.
+  void SetSimdLevel(SimdLevel level) {
+    block_kernel_ = SelectBlockKernel<T>(level);
+  }
+
+  // Same as above, but with the columns given by the variable names.
+  // Return what's wrong if a variable of the plan has no column, or the columns are not of the same
+  // length, and leave "out" as it was.
+  BindStatus ExecuteBatch(const CompiledExpression<T>& plan, const map<string, vector<T>>& columns, vector<T>& out) {
+    vector<const T*> bound;
+    size_t rows = columns.empty()? 1 : columns.begin()->second.size();
+    for (const auto& column : columns) {
+      if (column.second.size() != rows) return {BindError::kColumnLength, column.first};
+    }
+    for (const string& name : plan.variables) {
+      auto it = columns.find(name);
+      if (it == columns.end()) return {BindError::kUnboundVariable, name};
+      bound.push_back(it->second.data());
+    }
+    out.resize(rows);
+    ExecuteBatch(plan, bound, rows, out.data());
+    return BindStatus();
+  }
+
+  // In most cases, the reason we have a friend function is to make it able to access private members
+  // of a class, so we will have a friend function with a parameter of "reference to the targeted class",
+  //
+  // notice the function tp o be friend of a class should be defined before the class definition, 
+  // or have a prototype there before the class definition.
+  // ex.
+  //    void ext_func(X &x, ...){   // definition before the class, or place a prototype declaration here.
+  //      x.priv_data=...;
+  //    }
+  //    class X {
+  //      private:
+  //        priv_data;
+  //      public:
+  //        friend void ext_func(X &x, ...);
+  //    }
+  //
+  // To have a template function as a friend, the containing class must have the same template parameter.
+  // ex.
+  //    template <typename T>             // have the same template param
+  //    void ext_func(X<T> &x, ...){      // use class of template param in func parameter
+  //      x.priv_data=...;
+  //    }
+  //    template <typename T>             // have the same template param
+  //    class X {
+  //      private:
+  //        priv_data;
+  //      public:
+  //        friend void ext_func<T> (X<T> &x, ...);   // use template param in both func name and parameter
+  //    }
+  // 
+  // The following doesn't work.
+  //    class Calculator {   // the containing class doesn't have the same template parameters.
+  //      ...
+  //      friend template <class T>
+  //      int round_to_best_precision(T orig, T &result);
+  //    }
+  //
+  // Correct way is :
+  //    template <class T>
+  //    int round_to_best_precision(T orig, T &result){
+  //      ...
+  //    }
+  //    template <typename T>
+  //    class Calculator {
+  //      ...
+  //      friend int round_to_best_precision<T>(T orig, T &result);
+  //    }
+};
+
+// Incremental evaluation of many formulas, for spreadsheet-like use where the user changes one
+// number or one input at a time and wants every formula up to date right away.
+//
+// The formulas are kept as one DAG of nodes (constants, variables, operators), every node with its
+// value cached :
+//   - nodes are hash-consed : the same operator on the same operands is the same node, so a
+//     sub-expression used by many formulas (or many times in one formula) is calculated once.
+//   - SetVariable() marks the operators above the variable dirty, and Value() calculates the dirty
+//     nodes only, so only the formulas using the variable are calculated again, and in them only
+//     the path from the variable to the root.
+//   - SetLiteral() changes one number of a formula in place. Since a node can be shared, the nodes
+//     are never changed : the path from that literal to the root is rebuilt with new nodes (which
+//     may exist already, with their values), and everything beside the path is reused as it is.
+//   - SetFormula() takes an edited text. It's parsed again, but every unchanged sub-expression
+//     finds its node and its value, so only the new nodes are calculated.
+// Nodes no formula uses any more are freed (reference counting).
+//
+// The results are the same bit for bit as Execute() of the plan not optimized, since every node is
+// ApplyOperator() on the same operands in the same order.
+template <typename T>
+class ExpressionGraph {
+ public:
+  static_assert(is_trivially_copyable<T>::value && sizeof(T) <= 8, "constants are hashed by their bits");
+
+  // Add a formula, return its id for the functions below, or -1 if it's malformed, with what's
+  // wrong and where in "status" if it's given.
+  int AddFormula(string_view expression, ParseStatus* status = nullptr) {
+    Formula formula;
+    ParseStatus built = Build(expression, formula);
+    if (status) *status = built;
+    if (!built.Ok()) return -1;
+    formulas_.push_back(move(formula));
+    return (int)formulas_.size() - 1;
+  }
+
+  // Replace formula "id" by an edited "expression". Return what's wrong with it if it's malformed,
+  // and keep the formula as it was.
+  ParseStatus SetFormula(int id, string_view expression) {
+    Formula formula;
+    ParseStatus status = Build(expression, formula);
+    if (!status.Ok()) return status;
+    Release(formulas_[id].Root());
+    formulas_[id] = move(formula);
+    return status;
+  }
+
+  // Number of number literals in formula "id", in the order of the text.
+  size_t Literals(int id) const {
+    return formulas_[id].literals.size();
+  }
+
+  // Change the "literal"-th number literal of formula "id" to "value", ex. literal 1 of "2*(3+x)" is 3.
+  void SetLiteral(int id, size_t literal, T value) {
+    Formula& formula = formulas_[id];
+    int old_root = formula.Root();
+    int at = formula.literals[literal];
+    formula.items[at].node = Constant(value);
+    for (int parent = formula.items[at].parent; parent >= 0; parent = formula.items[parent].parent) {
+      Item& item = formula.items[parent];
+      item.node = Operator(item.code, formula.items[item.left].node, item.right < 0? -1 : formula.items[item.right].node);
+    }
+    Acquire(formula.Root());
+    Release(old_root);
+  }
+
+  // Set the value of variable "name" in every formula. A variable never set is NaN.
+  void SetVariable(string_view name, T value) {
+    int node = Variable(name);
+    if (memcmp(&nodes_[node].value, &value, sizeof(T)) == 0) return;
+    nodes_[node].value = value;
+    MarkParentsDirty(node);
+  }
+
+  // The value of formula "id", calculating only the nodes that changed since last time.
+  T Value(int id) {
+    int root = formulas_[id].Root();
+    Recalculate(root);
+    return nodes_[root].value;
+  }
+
+  size_t Formulas(void) const { return formulas_.size(); }
+  // nodes in use, less than the instructions of all the formulas when they share sub-expressions.
+  size_t Nodes(void) const { return nodes_.size() - free_.size(); }
+  // operators calculated so far.
+  uint64_t Calculations(void) const { return calculations_; }
+
+ private:
+  // What makes a node : the operator and its operands, a variable, or the bits of a constant.
+  struct Key {
+    OpCode code;
+    int64_t a, b;
+    bool operator==(const Key& other) const { return code == other.code && a == other.a && b == other.b; }
+  };
+  struct KeyHash {
+    size_t operator()(const Key& key) const {
+      uint64_t h = (uint64_t)key.a * 0x9E3779B97F4A7C15ull ^ (uint64_t)key.b * 0xC2B2AE3D27D4EB4Full ^ (uint64_t)key.code;
+      return (size_t)(h ^ (h >> 29));
+    }
+  };
+  struct Node {
+    Key key;
+    int left = -1, right = -1;   // operands of an operator, right is -1 for one of 1 operand.
+    T value = T();
+    bool dirty = false;
+    int references = 0;          // operators using it, formulas having it as the root, and the variable table.
+    vector<int> parents;         // operators using it.
+  };
+  // One instruction of a formula's RPN, and the node it is now.
+  struct Item {
+    OpCode code;
+    int node;
+    int parent = -1;             // the operator using it, -1 for the root.
+    int left = -1, right = -1;   // for an operator, its operands.
+  };
+  struct Formula {
+    vector<Item> items;
+    vector<int> literals;        // the items of the number literals, in the order of the text.
+    int Root(void) const { return items.back().node; }
+  };
+
+  ParseStatus Build(string_view expression, Formula& formula) {
+    CompiledExpression<T> plan = calculator_.Compile(expression, false);
+    if (!plan.status.Ok()) return plan.status;
+    vector<int> stack;
+    for (const Instruction<T>& ins : plan.code) {
+      Item item{ins.code, -1};
+      if (ins.code == OpCode::kPushConst) {
+        item.node = Constant(ins.value);
+        formula.literals.push_back((int)formula.items.size());
+      } else if (ins.code == OpCode::kPushVar) {
+        item.node = Variable(plan.variables[ins.index]);
+      } else {
+        if (Arity(ins.code) == 2) {
+          item.right = stack.back();
+          stack.pop_back();
+          formula.items[item.right].parent = (int)formula.items.size();
+        }
+        item.left = stack.back();
+        stack.pop_back();
+        formula.items[item.left].parent = (int)formula.items.size();
+        item.node = Operator(ins.code, formula.items[item.left].node, item.right < 0? -1 : formula.items[item.right].node);
+      }
+      stack.push_back((int)formula.items.size());
+      formula.items.push_back(item);
+    }
+    Acquire(formula.Root());
+    return ParseStatus();
+  }
+
+  int Find(const Key& key) {
+    auto it = table_.find(key);
+    return (it == table_.end())? -1 : it->second;
+  }
+
+  int NewNode(const Key& key) {
+    int id;
+    if (free_.empty()) {
+      id = (int)nodes_.size();
+      nodes_.emplace_back();
+    } else {
+      id = free_.back();
+      free_.pop_back();
+    }
+    nodes_[id].key = key;
+    table_.emplace(key, id);
+    return id;
+  }
+
+  int Constant(T value) {
+    int64_t bits = 0;
+    memcpy(&bits, &value, sizeof(T));
+    Key key{OpCode::kPushConst, bits, 0};
+    int id = Find(key);
+    if (id >= 0) return id;
+    id = NewNode(key);
+    nodes_[id].value = value;
+    return id;
+  }
+
+  int Variable(string_view name) {
+    auto it = variables_.find(string(name));
+    if (it != variables_.end()) return it->second;
+    int id = NewNode({OpCode::kPushVar, (int64_t)variables_.size(), 0});
+    nodes_[id].value = numeric_limits<T>::quiet_NaN();
+    nodes_[id].references = 1;   // held by variables_, so its value stays even when no formula uses it.
+    variables_.emplace(string(name), id);
+    return id;
+  }
+
+  int Operator(OpCode code, int left, int right) {
+    Key key{code, left, right};
+    int id = Find(key);
+    if (id >= 0) return id;
+    id = NewNode(key);
+    Node& node = nodes_[id];
+    node.left = left;
+    node.right = right;
+    node.dirty = true;
+    for (int operand : {left, right}) {
+      if (operand < 0) continue;
+      nodes_[operand].parents.push_back(id);
+      Acquire(operand);
+    }
+    return id;
+  }
+
+  void Acquire(int id) {
+    nodes_[id].references++;
+  }
+
+  // Drop one reference to "id", and free it, and the operands only it was using, when it's the last.
+  void Release(int id) {
+    vector<int>& pending = release_stack_;
+    pending.push_back(id);
+    while (!pending.empty()) {
+      int current = pending.back();
+      pending.pop_back();
+      Node& node = nodes_[current];
+      if (--node.references > 0) continue;
+      table_.erase(node.key);
+      for (int operand : {node.left, node.right}) {
+        if (operand < 0) continue;
+        vector<int>& parents = nodes_[operand].parents;
+        parents.erase(find(parents.begin(), parents.end(), current));
+        pending.push_back(operand);
+      }
+      node = Node();
+      free_.push_back(current);
+    }
+  }
+
+  void MarkParentsDirty(int id) {
+    vector<int>& pending = dirty_stack_;
+    pending.assign(nodes_[id].parents.begin(), nodes_[id].parents.end());
+    while (!pending.empty()) {
+      Node& node = nodes_[pending.back()];
+      pending.pop_back();
+      if (node.dirty) continue;   // and so are the nodes above it.
+      node.dirty = true;
+      pending.insert(pending.end(), node.parents.begin(), node.parents.end());
+    }
+  }
+
+  // Calculate the dirty nodes under "root", operands first, without recursion so a long formula
+  // can't overflow the call stack.
+  void Recalculate(int root) {
+    vector<int>& pending = dirty_stack_;
+    pending.clear();
+    pending.push_back(root);
+    while (!pending.empty()) {
+      Node& node = nodes_[pending.back()];
+      if (!node.dirty) {
+        pending.pop_back();
+      } else if (nodes_[node.left].dirty) {
+        pending.push_back(node.left);
+      } else if (node.right >= 0 && nodes_[node.right].dirty) {
+        pending.push_back(node.right);
+      } else {
+        const T& operand1 = nodes_[node.left].value;
+        node.value = ApplyOperator(node.key.code, operand1, node.right < 0? operand1 : nodes_[node.right].value);
+        node.dirty = false;
+        calculations_++;
+        pending.pop_back();
+      }
+    }
+  }
+
+  Calculator<T> calculator_;   // for Compile().
+  vector<Node> nodes_;
+  vector<int> free_;           // ids of freed nodes, to use again.
+  unordered_map<Key, int, KeyHash> table_;
+  unordered_map<string, int> variables_;
+  vector<Formula> formulas_;
+  vector<int> release_stack_, dirty_stack_;
+  uint64_t calculations_ = 0;
+};
+
+// Mixed precision : calculate every expression with the cheapest representation giving its exact
+// result, or one close enough, instead of always with double.
+//
+// Most expressions we get are integers, ex. "12345+67890". As double, they are exact below 2^53,
+// but the result still goes through the rounding loop of BestPrecision() to find it has no
+// decimals, and a product of big integers loses its last digits. As int64, they are exact up to
+// 2^63 and the result is written by one to_chars().
+enum class Precision : unsigned char { kInt64, kFloat, kDouble, kCount };
+const char* const kPrecisionNames[] = {"int64", "float", "double"};
+static_assert(sizeof(kPrecisionNames) / sizeof(kPrecisionNames[0]) == (size_t)Precision::kCount,
+              "a name for every Precision");
+
+// Put "value" in "integer" if it's an integer a double holds exactly (up to 2^53), return false
+// otherwise. -0 is 0.
+inline bool IntegerValue(double value, int64_t& integer) {
+  const double kMaxExact = 9007199254740992.0;   // 2^53
+  if (!(value >= -kMaxExact && value <= kMaxExact)) return false;   // NaN too.
+  integer = (int64_t)value;
+  return (double)integer == value;
+}
+
+// Whether ApplyIntegerOperator() can calculate "op".
+constexpr bool HasIntegerOperator(OpCode op) {
+  return op != OpCode::kSqrt && op != OpCode::kExp && op != OpCode::kLog;
+}
+
+// The integer counterpart of ApplyOperator() : put the exact result of "operand1 op operand2" in
+// "result", or return false if it's not an int64, ex. an overflow, a division with a remainder or
+// by 0, a negative power, sqrt(). % truncates toward 0, like fmod().
+inline bool ApplyIntegerOperator(OpCode op, int64_t operand1, int64_t operand2, int64_t& result) {
+  switch (op) {
+    case OpCode::kAdd:
+      return !__builtin_add_overflow(operand1, operand2, &result);
+    case OpCode::kSub:
+      return !__builtin_sub_overflow(operand1, operand2, &result);
+    case OpCode::kMul:
+      return !__builtin_mul_overflow(operand1, operand2, &result);
+    case OpCode::kDiv:
+      if (operand2 == 0 || operand2 == -1 || operand1 % operand2 != 0) {
+        // x/-1 is the only division that can overflow, as a negation.
+        return operand2 == -1 && !__builtin_sub_overflow((int64_t)0, operand1, &result);
+      }
+      result = operand1 / operand2;
+      return true;
+    case OpCode::kMod:
+      if (operand2 == 0) return false;   // NaN.
+      result = (operand2 == -1)? 0 : operand1 % operand2;
+      return true;
+    case OpCode::kPow: {
+      if (operand2 < 0) return false;
+      // by squaring, stopping at the first overflow.
+      int64_t base = operand1, power = 1;
+      for (int64_t exponent = operand2; exponent > 0; exponent >>= 1) {
+        if ((exponent & 1) && __builtin_mul_overflow(power, base, &power)) return false;
+        if (exponent > 1 && __builtin_mul_overflow(base, base, &base)) return false;
+      }
+      result = power;
+      return true;
+    }
+    case OpCode::kNeg:
+      return !__builtin_sub_overflow((int64_t)0, operand1, &result);
+    case OpCode::kAbs:
+      if (operand1 == numeric_limits<int64_t>::min()) return false;
+      result = operand1 < 0? -operand1 : operand1;
+      return true;
+    case OpCode::kMin:
+      result = operand1 < operand2? operand1 : operand2;
+      return true;
+    case OpCode::kMax:
+      result = operand1 > operand2? operand1 : operand2;
+      return true;
+    default:
+      return false;
+  }
+}
+
+// The precision MixedCalculator calculates "plan" with :
+//   - kInt64 if every constant is an integer (see IntegerValue()) and every operator has an integer
+//     counterpart. The values of the variables, a division with a remainder, an overflow... are
+//     only known when executing, which falls back to double for them.
+//   - kFloat if the rounding errors of float are proved to stay within "max_relative_error" of the
+//     result, whatever the values of the variables. It's the classic bound of error analysis,
+//     counted in units of float rounding u = 2^-24 : a constant not exact in float or a variable
+//     rounded to float costs 1, * and / add the errors of their operands plus 1 for their own
+//     rounding, + of 2 values of the same known sign takes the bigger plus 1, -x, abs(), min() and
+//     max() keep it, sqrt() halves it plus 1. n units bound the error by n*u/(1-n*u). Anything
+//     else (a + which can cancel, ^, %, exp(), log()) has no bound and rules float out.
+//     The bound only holds while every value along the way is a normal float : a subnormal or 0
+//     from an underflow has lost digits, even if it's multiplied back up to a normal result. So
+//     the binary exponent of each value is bounded too, as scale*L+offset for variables of
+//     magnitude within [2^-L, 2^L] (or 0) : * and / add the bounds plus 1, + of the same sign takes
+//     the bigger plus 1, sqrt() halves it plus 1, a constant has its own exponent. The biggest L
+//     keeping all of them within the exponents of normal floats goes to "float_exponent", executing
+//     checks the variables against it and falls back to double outside. Float is ruled out if L
+//     would be less than 1.
+//   - kDouble otherwise.
+inline Precision ChoosePrecision(const CompiledExpression<double>& plan, double max_relative_error = 0,
+                                 int* float_exponent = nullptr) {
+  enum Sign { kPositive, kNegative, kUnknown };   // >= 0, <= 0.
+  struct Value {
+    double units;   // infinity : no bound.
+    Sign sign;
+    double scale, offset;   // |binary exponent| <= scale*L+offset.
+  };
+  const double kUnbounded = numeric_limits<double>::infinity();
+  // normal floats have binary exponents -126 to 127, with some margin for the rounding.
+  const double kMaxExponent = 125;
+  double exponent_limit = kMaxExponent;   // the biggest L so far.
+  auto limit = [&](const Value& value) {
+    if (value.scale > 0) {
+      exponent_limit = min(exponent_limit, (kMaxExponent - value.offset) / value.scale);
+    } else if (value.offset > kMaxExponent) {
+      exponent_limit = -1;
+    }
+  };
+  bool integer = true;
+  vector<Value> stack;
+  for (const Instruction<double>& ins : plan.code) {
+    if (ins.code == OpCode::kPushConst) {
+      int64_t value;
+      integer = integer && IntegerValue(ins.value, value);
+      double exponent = (ins.value == 0 || !isfinite(ins.value))? (ins.value == 0? 0 : kUnbounded)
+                                                                : fabs((double)ilogb(ins.value)) + 1;
+      stack.push_back({(double)(float)ins.value == ins.value? 0.0 : 1.0, ins.value < 0? kNegative : kPositive,
+                       0, exponent});
+      limit(stack.back());
+      continue;
+    }
+    if (ins.code == OpCode::kPushVar) {
+      stack.push_back({1, kUnknown, 1, 0});
+      continue;
+    }
+    integer = integer && HasIntegerOperator(ins.code);
+    Value operand2 = stack.back();
+    if (Arity(ins.code) == 2) stack.pop_back();
+    Value& operand1 = stack.back();
+    Sign known = (operand1.sign == operand2.sign)? operand1.sign : kUnknown;
+    switch (ins.code) {
+      case OpCode::kSub:
+        operand2.sign = (operand2.sign == kUnknown)? kUnknown : (operand2.sign == kPositive)? kNegative : kPositive;
+        known = (operand1.sign == operand2.sign)? operand1.sign : kUnknown;
+        [[fallthrough]];
+      case OpCode::kAdd:
+        operand1 = {known == kUnknown? kUnbounded : max(operand1.units, operand2.units) + 1, known,
+                    max(operand1.scale, operand2.scale), max(operand1.offset, operand2.offset) + 1};
+        break;
+      case OpCode::kMul:
+      case OpCode::kDiv:
+        operand1 = {operand1.units + operand2.units + 1,
+                    (operand1.sign == kUnknown || operand2.sign == kUnknown)? kUnknown
+                                                                            : (known != kUnknown)? kPositive : kNegative,
+                    operand1.scale + operand2.scale, operand1.offset + operand2.offset + 1};
+        break;
+      case OpCode::kNeg:
+        operand1.sign = (operand1.sign == kUnknown)? kUnknown : (operand1.sign == kPositive)? kNegative : kPositive;
+        break;
+      case OpCode::kAbs:
+        operand1.sign = kPositive;
+        break;
+      case OpCode::kMin:
+      case OpCode::kMax:
+        operand1 = {max(operand1.units, operand2.units), known, max(operand1.scale, operand2.scale),
+                    max(operand1.offset, operand2.offset)};
+        break;
+      case OpCode::kSqrt:
+        operand1 = {operand1.units / 2 + 1, kPositive, operand1.scale / 2, operand1.offset / 2 + 1};
+        break;
+      default:
+        operand1.units = kUnbounded;
+        break;
+    }
+    limit(operand1);
+  }
+  if (integer) return Precision::kInt64;
+  const double kUnit = 1.0 / (1 << 24);
+  double units = stack.empty()? kUnbounded : stack.back().units;
+  if (units * kUnit < 1 && units * kUnit / (1 - units * kUnit) <= max_relative_error && exponent_limit >= 1) {
+    if (float_exponent) *float_exponent = (int)exponent_limit;
+    return Precision::kFloat;
+  }
+  return Precision::kDouble;
+}
+
+// A result of MixedCalculator : an int64, or a real number (a float result is widened to double).
+struct MixedValue {
+  Precision precision = Precision::kDouble;
+  int64_t integer = 0;   // the value if precision is kInt64.
+  double real = 0;       // the value, rounded to double for an int64.
+};
+
+// Format "value" the same way as a double result, but an int64 with all its digits and no rounding
+// loop.
+inline size_t FormatBestPrecision(const MixedValue& value, char* buffer, size_t size) {
+  if (value.precision != Precision::kInt64) return FormatBestPrecision(value.real, buffer, size);
+  PhaseTimer timer(Phase::kFormat);
+  to_chars_result formatted = to_chars(buffer, buffer + size, value.integer);
+  if (formatted.ec != errc()) return 0;
+  return formatted.ptr - buffer;
+}
+
+// An expression compiled by MixedCalculator, with the precision to execute it with.
+struct MixedPlan {
+  Precision precision = Precision::kDouble;
+  CompiledExpression<double> plan;        // always there : kInt64 and kFloat fall back to it.
+  CompiledExpression<float> float_plan;   // for kFloat : the same instructions, with the constants rounded to float.
+  // for kFloat : the magnitudes of the variables (besides 0) keeping every value along the way a
+  // normal float, see ChoosePrecision().
+  double float_low = 0, float_high = 0;
+};
+
+// Calculate expressions with the cheapest exact precision, see ChoosePrecision(), with a
+// Calculator<double> or Calculator<float> for the real ones.
+//
+// TryCalculate() chooses once per expression : one with a literal which is not an integer, ex. "1.5"
+// or "1e3", is calculated by Calculator<double> as it is. The others are parsed by
+// Calculator<int64_t>, which reads each literal once as int64, and calculated as int64 until an
+// operand or a result is not an exact int64, then as double from there. It gives the int64 if it
+// stayed exact, otherwise the double, which is bit for bit what Calculator<double> gives, without
+// calculating again. The int64 differs from the double only where double rounded a value past 2^53
+// on the way, ex. 99^9%99 is 0, not 61, and for -0 which is 0. There is no float here : a float is
+// not faster than a double one value at a time.
+//
+// Compile() chooses the precision of the plan once, and Execute()/ExecuteBatch() run it with it.
+// float pays off in ExecuteBatch(), twice as many values in each SIMD instruction, on long formulas.
+class MixedCalculator {
+private:
+  Calculator<int64_t> integer_;   // only to parse, the literals as int64.
+  Calculator<double> double_;
+  Calculator<float> float_;
+  FixedStack<double> reals_;      // the values of TryCalculate() as double, see Evaluator.
+  vector<int64_t> integers_;      // the values of TryCalculate() as int64, while they are exact.
+  vector<int64_t> exec_stack_;    // the stack of Execute() for kInt64.
+  vector<float> float_values_;    // the values of the variables as float, for Execute().
+  vector<float> float_columns_;   // a block of rows of the columns as float, for ExecuteBatch().
+  vector<const float*> float_column_pointers_;
+  vector<const double*> double_column_pointers_;
+  vector<float> float_out_;
+  ResultCache<MixedValue>* result_cache_ = nullptr;
+  string normalized_;   // the buffer of NormalizeExpression().
+
+  // Whether every number literal of "expression" is an integer without an exponent, ex.
+  // "12345+67890", not "1.5" or "1e3". TryCalculate() only tries int64 on these, with
+  // Calculator<int64_t> reading each literal once, as int64. A "1e3" in a name, ex. "x1e3", is
+  // taken for a literal too, and goes to double as a variable would.
+  // memchr() looks at many chars at a time, it costs next to nothing next to the parsing.
+  static bool IntegerLiterals(string_view expression) {
+    const char* first = expression.data();
+    const char* last = first + expression.size();
+    if (memchr(first, '.', last - first) != nullptr) return false;
+    for (char exponent : {'e', 'E'}) {
+      for (const char* at = first; (at = (const char*)memchr(at, exponent, last - at)) != nullptr; at++) {
+        if (at > first && isdigit((unsigned char)at[-1])) return false;
+      }
+    }
+    return true;
+  }
+
+  // The emitter of TryCalculate() for IntegerLiterals(), see Calculator::Parse(). It calculates
+  // with int64 on integers_ while every value is an exact int64, and once one is not, goes on with
+  // double on reals_ from there.
+  // Until then, each value Calculator<double> would calculate is the int64 itself, but for a value
+  // past 2^53, which double rounds, and for a -0. From the first of these, reals_ follows
+  // integers_ with the values of double, so a fall back to double never calculates again.
+  struct Evaluator {
+    MixedCalculator* calc;
+    bool exact = true;      // every value so far is an exact int64.
+    bool shadowed = false;  // reals_ holds the values of double next to integers_.
+
+    void Shadow() {
+      shadowed = true;
+      for (int64_t integer : calc->integers_) calc->reals_.push((double)integer);
+    }
+    void ToReals() {
+      exact = false;
+      if (!shadowed) Shadow();
+    }
+    void Push(double value) {
+      calc->reals_.push(value);
+      Instrumentation::StackDepth(calc->reals_.size());
+    }
+    // Whether double gives another value than "integer" for "integer1 op integer2", the
+    // operands being the same in both.
+    static bool Diverges(OpCode op, int64_t integer1, int64_t integer2, int64_t integer) {
+      const int64_t kMaxExact = int64_t(1) << 53;
+      if (integer > kMaxExact || integer < -kMaxExact) return true;
+      return integer == 0 && signbit(ApplyOperator(op, (double)integer1, (double)integer2));
+    }
+
+    void Operand(int64_t value, string_view text) {
+      // past int64, from_chars() leaves "value" 0. Past 2^53, double rounds the literal.
+      const int64_t kMaxExact = int64_t(1) << 53;
+      bool in_range = value != 0 || text.find_first_not_of('0') == string_view::npos;
+      size_t pos = 0;
+      double real = (!in_range || value > kMaxExact)? ParseNumber<double>(text, pos) : (double)value;
+      if (exact && in_range) {
+        if (!shadowed && value > kMaxExact) Shadow();
+        calc->integers_.push_back(value);
+        Instrumentation::StackDepth(calc->integers_.size());
+        if (shadowed) calc->reals_.push(real);
+        return;
+      }
+      if (exact) ToReals();
+      Push(real);
+    }
+    void Variable(string_view) {
+      // unbound, NaN as with Calculator.
+      if (exact) ToReals();
+      Push(numeric_limits<double>::quiet_NaN());
+    }
+    void Operator(OpCode op) {
+      Instrumentation::Reductions(1);
+      if (exact) {
+        vector<int64_t>& integers = calc->integers_;
+        int arity = Arity(op);
+        int64_t& integer1 = integers[integers.size() - arity];
+        int64_t integer;
+        if (ApplyIntegerOperator(op, integer1, integers.back(), integer)) {
+          if (!shadowed && Diverges(op, integer1, integers.back(), integer)) Shadow();
+          integer1 = integer;
+          if (arity == 2) integers.pop_back();
+          if (!shadowed) return;
+        } else {
+          ToReals();
+        }
+      }
+      double real2 = calc->reals_.top();
+      if (Arity(op) == 2) calc->reals_.pop();
+      double real1 = calc->reals_.top();
+      calc->reals_.pop();
+      calc->reals_.push(ApplyOperator(op, real1, real2));
+    }
+  };
+
+  // Run "plan" with int64, return false if a value or a result is not an exact int64.
+  bool ExecuteInteger(const CompiledExpression<double>& plan, const double* values, int64_t& result) {
+    if (exec_stack_.size() < (size_t)plan.max_depth) {
+      exec_stack_.resize(plan.max_depth);
+      Instrumentation::Allocations(1);
+    }
+    int64_t* stack = exec_stack_.data();
+    int sp = 0;
+    for (const Instruction<double>& ins : plan.code) {
+      if (ins.code == OpCode::kPushConst) {
+        stack[sp++] = (int64_t)ins.value;   // ChoosePrecision() checked they are integers.
+      } else if (ins.code == OpCode::kPushVar) {
+        if (!IntegerValue(values[ins.index], stack[sp++])) return false;
+      } else {
+        int arity = Arity(ins.code);
+        sp -= arity - 1;
+        if (!ApplyIntegerOperator(ins.code, stack[sp - 1], stack[sp + arity - 2], stack[sp - 1])) return false;
+      }
+    }
+    result = stack[0];
+    return true;
+  }
+
+  // Whether "value" is 0 or of a magnitude within [low, high].
+  static bool InRange(double value, double low, double high) {
+    double magnitude = fabs(value);
+    return (magnitude >= low && magnitude <= high) || value == 0;
+  }
+
+  // values[0..n-1] to float into out[0..n-1], return whether all of them are InRange() of
+  // [low, high]. The conversion and the check are done in one pass, 4 values at a time : done one
+  // by one, they cost more than the float kernels save. SSE2 is always there on x86-64, without a
+  // target attribute.
+  static bool ToFloat(const double* values, float* out, size_t n, double low_magnitude, double high_magnitude) {
+    size_t i = 0;
+    bool in_range = true;
+#if defined(Have_X86_Simd_Kernels) && defined(__SSE2__)
+    const __m128d sign = _mm_set1_pd(-0.0), zero = _mm_setzero_pd();
+    const __m128d low = _mm_set1_pd(low_magnitude), high = _mm_set1_pd(high_magnitude);
+    __m128d all = _mm_cmpeq_pd(zero, zero);
+    for (; i + 4 <= n; i += 4) {
+      __m128d first = _mm_loadu_pd(values + i), second = _mm_loadu_pd(values + i + 2);
+      for (__m128d x : {first, second}) {
+        __m128d magnitude = _mm_andnot_pd(sign, x);
+        __m128d normal = _mm_and_pd(_mm_cmpge_pd(magnitude, low), _mm_cmple_pd(magnitude, high));
+        all = _mm_and_pd(all, _mm_or_pd(normal, _mm_cmpeq_pd(x, zero)));
+      }
+      _mm_storeu_ps(out + i, _mm_movelh_ps(_mm_cvtpd_ps(first), _mm_cvtpd_ps(second)));
+    }
+    in_range = _mm_movemask_pd(all) == 3;
+#endif
+    for (; i < n; i++) {
+      out[i] = (float)values[i];
+      in_range = in_range && InRange(values[i], low_magnitude, high_magnitude);
+    }
+    return in_range;
+  }
+
+  // values[0..n-1] to double into out[0..n-1], return whether all of them are normal floats. With
+  // the variables in the range of the plan, the others come from a 0, ex. a division by 0.
+  static bool ToDouble(const float* values, double* out, size_t n) {
+    size_t i = 0;
+    bool in_range = true;
+#if defined(Have_X86_Simd_Kernels) && defined(__SSE2__)
+    const __m128 sign = _mm_set1_ps(-0.0f);
+    const __m128 low = _mm_set1_ps(numeric_limits<float>::min()), high = _mm_set1_ps(numeric_limits<float>::max());
+    __m128 all = _mm_cmpeq_ps(low, low);
+    for (; i + 4 <= n; i += 4) {
+      __m128 x = _mm_loadu_ps(values + i);
+      __m128 magnitude = _mm_andnot_ps(sign, x);
+      all = _mm_and_ps(all, _mm_and_ps(_mm_cmpge_ps(magnitude, low), _mm_cmple_ps(magnitude, high)));
+      _mm_storeu_pd(out + i, _mm_cvtps_pd(x));
+      _mm_storeu_pd(out + i + 2, _mm_cvtps_pd(_mm_movehl_ps(x, x)));
+    }
+    in_range = _mm_movemask_ps(all) == 15;
+#endif
+    for (; i < n; i++) {
+      out[i] = values[i];
+      in_range = in_range && values[i] != 0 &&
+                 InRange(values[i], numeric_limits<float>::min(), numeric_limits<float>::max());
+    }
+    return in_range;
+  }
+
+public:
+  void SetResultCache(ResultCache<MixedValue>* cache) { result_cache_ = cache; }
+
+  // Parse and calculate "expression" in one go, with int64 if it's exact, otherwise with double.
+  // The same as Calculator::TryCalculate() otherwise.
+  CalcResult<MixedValue> TryCalculate(string_view expression) {
+    PhaseTimer timer(Phase::kCalculate);
+    if (result_cache_) return CachedCalculate(*this, *result_cache_, expression, normalized_);
+    return TryCalculateNoCache(expression);
+  }
+
+  CalcResult<MixedValue> TryCalculateNoCache(string_view expression) {
+    if (!IntegerLiterals(expression)) {
+      // double for sure, without looking at each value.
+      CalcResult<double> real = double_.TryCalculateNoCache(expression);
+      return {{Precision::kDouble, 0, real.value}, real.status};
+    }
+    Instrumentation::Expressions(1);
+    // every operand takes at least one char.
+    reals_.Reserve(expression.size());
+    if (integers_.capacity() < expression.size()) {
+      integers_.reserve(expression.size());
+      Instrumentation::Allocations(1);
+    }
+    reals_.clear();
+    integers_.clear();
+    Evaluator evaluator{this};
+    CalcResult<MixedValue> result{MixedValue(), integer_.Parse(expression, evaluator)};
+    if (!result.Ok()) {
+      result.value.real = numeric_limits<double>::quiet_NaN();
+    } else if (evaluator.exact) {
+      result.value = {Precision::kInt64, integers_.back(), (double)integers_.back()};
+    } else {
+      result.value.real = reals_.top();
+    }
+    return result;
+  }
+
+  MixedValue Calculate(string_view expression) { return TryCalculate(expression).value; }
+
+  // Compile "expression" and choose its precision, see ChoosePrecision(). With "max_relative_error"
+  // 0, it's exact, or as double.
+  MixedPlan Compile(string_view expression, double max_relative_error = 0) {
+    MixedPlan mixed;
+    mixed.plan = double_.Compile(expression);
+    if (!mixed.plan.status.Ok()) return mixed;
+    int exponent = 0;
+    mixed.precision = ChoosePrecision(mixed.plan, max_relative_error, &exponent);
+    if (mixed.precision == Precision::kFloat) {
+      mixed.float_low = ldexp(1.0, -exponent);
+      mixed.float_high = ldexp(1.0, exponent);
+      CompiledExpression<float>& plan = mixed.float_plan;
+      for (const Instruction<double>& ins : mixed.plan.code) plan.code.push_back({ins.code, ins.index, (float)ins.value});
+      plan.max_depth = mixed.plan.max_depth;
+      plan.variables = mixed.plan.variables;
+    }
+    return mixed;
+  }
+
+  // Run "mixed" with its precision, falling back to double where it can't : a value of a variable
+  // which is not an integer for kInt64, or out of the range of the plan for kFloat, etc.
+  // "values" are the values of plan.variables, as for Calculator::Execute().
+  MixedValue Execute(const MixedPlan& mixed, const double* values = nullptr) {
+    if (mixed.precision == Precision::kInt64) {
+      int64_t result;
+      if (ExecuteInteger(mixed.plan, values, result)) return {Precision::kInt64, result, (double)result};
+    } else if (mixed.precision == Precision::kFloat) {
+      size_t variables = mixed.float_plan.variables.size();
+      if (float_values_.size() < variables) float_values_.resize(variables);
+      bool in_range = true;
+      for (size_t i = 0; i < variables; i++) {
+        float_values_[i] = (float)values[i];
+        in_range = in_range && InRange(values[i], mixed.float_low, mixed.float_high);
+      }
+      // with the variables in range, no value along the way overflows or underflows. A result
+      // which is still not a normal float comes from a 0, ex. a division by 0, and is left to double
+      // for its sign and NaN.
+      float result = in_range? float_.Execute(mixed.float_plan, float_values_.data()) : 0;
+      if (in_range && result != 0 && InRange(result, numeric_limits<float>::min(), numeric_limits<float>::max())) {
+        return {Precision::kFloat, 0, result};
+      }
+    }
+    return {Precision::kDouble, 0, double_.Execute(mixed.plan, values)};
+  }
+
+  // Run "mixed" on "rows" rows of "columns" (one per variable of the plan), as
+  // Calculator::ExecuteBatch(). kFloat runs a block of rows at a time, converted to float, and runs
+  // again as double a block with a value out of the range of the plan, or a result which is not a
+  // normal float. kInt64 runs as double : the results are doubles anyway, and there is no SIMD
+  // multiplication of int64 before AVX-512.
+  void ExecuteBatch(const MixedPlan& mixed, const vector<const double*>& columns, size_t rows, double* out) {
+    if (mixed.precision != Precision::kFloat) {
+      double_.ExecuteBatch(mixed.plan, columns, rows, out);
+      return;
+    }
+    // small enough that the float columns stay in L1 cache next to the stack of blocks. Reading the
+    // double columns costs as much as with double, the float kernels are where the time is saved.
+    const size_t kBlock = 4 * Calculator<float>::kBatchBlock;
+    if (float_columns_.size() < columns.size() * kBlock) float_columns_.resize(columns.size() * kBlock);
+    if (float_out_.size() < kBlock) float_out_.resize(kBlock);
+    float_column_pointers_.resize(columns.size());
+    double_column_pointers_.resize(columns.size());
+    for (size_t first = 0; first < rows; first += kBlock) {
+      size_t n = min(kBlock, rows - first);
+      bool in_range = true;
+      for (size_t c = 0; c < columns.size(); c++) {
+        float* column = &float_columns_[c * kBlock];
+        const double* source = columns[c] + first;
+        in_range = in_range && ToFloat(source, column, n, mixed.float_low, mixed.float_high);
+        float_column_pointers_[c] = column;
+        double_column_pointers_[c] = source;
+      }
+      if (in_range) {
+        float_.ExecuteBatch(mixed.float_plan, float_column_pointers_, n, float_out_.data());
+        if (ToDouble(float_out_.data(), out + first, n)) continue;
+      }
+      double_.ExecuteBatch(mixed.plan, double_column_pointers_, n, out + first);
+    }
+  }
+};
+
+// A thread pool with work-stealing.
+//
+// ParallelFor(count, task) runs task(worker, index) for every index in [0, count) and returns when
+// all of them are done. The indexes are split evenly into one queue per worker at first. Each worker
+// takes indexes from the front of its own queue, and when it runs out, it steals from the back of
+// another worker's queue, so a worker that got the slow items doesn't keep the others waiting.
+//
+// "worker" is in [0, Size()), tasks can use it to pick per-thread data without locking, ex. one
+// Calculator<T> per worker. The calling thread works as worker 0 as well.
+class ThreadPool {
+private:
+  struct WorkQueue {
+    mutex lock;
+    deque<size_t> items;
+  };
+
+  vector<WorkQueue> queues_;
+  vector<thread> threads_;
+  const function<void(int, size_t)>* task_ = nullptr;
+  atomic<size_t> remaining_{0};   // number of items not finished yet.
+
+  mutex mutex_;                   // protects generation_ and stop_.
+  condition_variable wake_;       // workers wait here for a new ParallelFor().
+  condition_variable done_;       // ParallelFor() waits here for the last item.
+  size_t generation_ = 0;         // increased by each ParallelFor().
+  bool stop_ = false;
+
+  bool Pop(int worker, size_t& index) {
+    WorkQueue& queue = queues_[worker];
+    lock_guard<mutex> guard(queue.lock);
+    if (queue.items.empty()) return false;
+    index = queue.items.front();
+    queue.items.pop_front();
+    return true;
+  }
+
+  bool Steal(int worker, size_t& index) {
+    for (size_t i = 1; i < queues_.size(); i++) {
+      WorkQueue& victim = queues_[(worker + i) % queues_.size()];
+      lock_guard<mutex> guard(victim.lock);
+      if (victim.items.empty()) continue;
+      index = victim.items.back();
+      victim.items.pop_back();
+      return true;
+    }
+    return false;
+  }
+
+  void RunTasks(int worker) {
+    size_t index;
+    while (Pop(worker, index) || Steal(worker, index)) {
+      (*task_)(worker, index);
+      if (remaining_.fetch_sub(1) == 1) {
+        lock_guard<mutex> guard(mutex_);
+        done_.notify_all();
+      }
+    }
+  }
+
+  void WorkerLoop(int worker) {
+    size_t seen = 0;
+    while (true) {
+      {
+        unique_lock<mutex> guard(mutex_);
+        wake_.wait(guard, [&] { return stop_ || generation_ != seen; });
+        if (stop_) return;
+        seen = generation_;
+      }
+      RunTasks(worker);
+    }
+  }
+
+public:
+  // threads <= 0 means one thread per CPU core.
+  explicit ThreadPool(int threads) : queues_(threads > 0? threads : max(1u, thread::hardware_concurrency())) {
+    for (int i = 1; i < Size(); i++) threads_.emplace_back([this, i] { WorkerLoop(i); });
+  }
+
+  ~ThreadPool() {
+    {
+      lock_guard<mutex> guard(mutex_);
+      stop_ = true;
+    }
+    wake_.notify_all();
+    for (thread& t : threads_) t.join();
+  }
+
+  int Size() const { return (int)queues_.size(); }
+
+  void ParallelFor(size_t count, const function<void(int worker, size_t index)>& task) {
+    if (count == 0) return;
+    // task_ must be set before any item shows up in the queues, a worker still looking for items of
+    // the previous ParallelFor() may pick up the new ones right away.
+    task_ = &task;
+    remaining_ = count;
+    for (int worker = 0; worker < Size(); worker++) {
+      lock_guard<mutex> guard(queues_[worker].lock);
+      for (size_t i = count * worker / Size(); i < count * (worker + 1) / Size(); i++)
+        queues_[worker].items.push_back(i);
+    }
+    {
+      lock_guard<mutex> guard(mutex_);
+      generation_++;
+    }
+    wake_.notify_all();
+
+    RunTasks(0);
+    unique_lock<mutex> guard(mutex_);
+    done_.wait(guard, [&] { return remaining_ == 0; });
+  }
+};
+
+// Calculate each of "expressions" with the threads of "pool", results[i] is the result of
+// expressions[i]. Each worker has its own Calculator, since a Calculator keeps its stacks in members.
+// "Text" can be string or string_view. All the workers share "cache" if it's given.
+// "Calc" is the calculator giving T, ex. MixedCalculator for MixedValue.
+template <typename T, typename Text, typename Calc = Calculator<T>>
+void CalculateInParallel(ThreadPool& pool, const vector<Text>& expressions, vector<T>& results,
+                         ResultCache<T>* cache = nullptr, vector<ParseStatus>* statuses = nullptr) {
+  // a few hundreds of expressions per item, so taking an item costs nothing compared to the work.
+  const size_t kChunk = 256;
+  vector<Calc> calculators(pool.Size());
+  for (Calc& calculator : calculators) calculator.SetResultCache(cache);
+  results.resize(expressions.size());
+  if (statuses) statuses->resize(expressions.size());
+  pool.ParallelFor((expressions.size() + kChunk - 1) / kChunk, [&](int worker, size_t chunk) {
+    size_t end = min(expressions.size(), (chunk + 1) * kChunk);
+    for (size_t i = chunk * kChunk; i < end; i++) {
+      CalcResult<T> result = calculators[worker].TryCalculate(expressions[i]);
+      results[i] = result.value;
+      if (statuses) (*statuses)[i] = result.status;
+    }
+  });
+}
+
+// ExecuteBatch() with the threads of "pool", each worker evaluates a range of rows.
+template <typename T>
+void ExecuteBatchInParallel(ThreadPool& pool, const CompiledExpression<T>& plan, const vector<const T*>& columns,
+                            size_t rows, T* out) {
+  const size_t kChunk = 64 * Calculator<T>::kBatchBlock;
+  vector<Calculator<T>> calculators(pool.Size());
+  pool.ParallelFor((rows + kChunk - 1) / kChunk, [&](int worker, size_t chunk) {
+    size_t first = chunk * kChunk;
+    size_t n = min(kChunk, rows - first);
+    vector<const T*> chunk_columns;
+    for (const T* column : columns) chunk_columns.push_back(column + first);
+    calculators[worker].ExecuteBatch(plan, chunk_columns, n, out + first);
+  });
+}
+
+// Read a file of newline-delimited expressions one big chunk at a time. Every chunk ends at the end
+// of a line, so no expression is cut in two, and the views of a chunk stay valid until the next
+// Next() call. Only one chunk is held at a time, so the memory used doesn't grow with the input.
+//
+// A regular file is memory-mapped (on POSIX systems), the expressions are read right from the page
+// cache without any copy. Pipes (ex. stdin) and other systems fall back to fread() into a buffer.
+class ChunkedInput {
+private:
+  static constexpr size_t kChunkBytes = 16 << 20;
+
+  FILE* file_ = nullptr;
+  bool close_file_ = false;     // false for stdin, which we didn't open.
+  vector<char> buffer_;         // fread() mode : the chunk, followed by the unfinished line after it.
+  size_t filled_ = 0;           // number of bytes read into buffer_.
+  size_t consumed_ = 0;         // number of bytes of buffer_ handed out by the last Next().
+  bool eof_ = false;
+
+  const char* mapped_ = nullptr;   // mmap mode : the whole file.
+  size_t mapped_size_ = 0;
+  size_t position_ = 0;            // where the next chunk starts.
+
+  static bool FindLastNewline(const char* data, size_t size, size_t& end) {
+    for (size_t i = size; i > 0; i--) {
+      if (data[i - 1] == '\n') {
+        end = i;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool NextMapped(string_view& chunk) {
+    if (position_ >= mapped_size_) return false;
+#ifdef Have_Posix_Mmap
+    // the lines before position_ are done, give their pages back, so the resident memory stays at
+    // about one chunk however big the file is.
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t done = position_ / page * page;
+    if (done > 0) madvise((void*)mapped_, done, MADV_DONTNEED);
+#endif
+    size_t end = mapped_size_;
+    if (position_ + kChunkBytes < mapped_size_) {
+      if (FindLastNewline(mapped_ + position_, kChunkBytes, end)) {
+        end += position_;
+      } else {
+        // a line longer than a chunk, take all of it.
+        const char* newline = (const char*)memchr(mapped_ + position_ + kChunkBytes, '\n',
+                                                  mapped_size_ - position_ - kChunkBytes);
+        end = newline? newline - mapped_ + 1 : mapped_size_;
+      }
+    }
+    chunk = string_view(mapped_ + position_, end - position_);
+    position_ = end;
+    return true;
+  }
+
+  bool NextRead(string_view& chunk) {
+    // move the unfinished line after the last chunk to the front.
+    memmove(buffer_.data(), buffer_.data() + consumed_, filled_ - consumed_);
+    filled_ -= consumed_;
+    consumed_ = 0;
+    while (!eof_) {
+      if (filled_ == buffer_.size()) buffer_.resize(buffer_.size() * 2);   // a line longer than the buffer.
+      size_t n = fread(buffer_.data() + filled_, 1, buffer_.size() - filled_, file_);
+      filled_ += n;
+      if (n == 0) eof_ = true;
+      if (FindLastNewline(buffer_.data(), filled_, consumed_)) break;
+    }
+    if (eof_) consumed_ = filled_;   // the last line may have no newline.
+    if (consumed_ == 0) return false;
+    chunk = string_view(buffer_.data(), consumed_);
+    return true;
+  }
+
+public:
+  ~ChunkedInput() {
+#ifdef Have_Posix_Mmap
+    if (mapped_) munmap((void*)mapped_, mapped_size_);
+#endif
+    if (close_file_) fclose(file_);
+  }
+
+  // Open "path", or stdin if "path" is "-". Return false if the file can't be opened.
+  bool Open(const string& path) {
+    if (path == "-") {
+      file_ = stdin;
+    } else {
+      file_ = fopen(path.c_str(), "rb");
+      if (!file_) {
+        cout << "cannot open \"" << path << "\"" << endl;
+        return false;
+      }
+      close_file_ = true;
+    }
+#ifdef Have_Posix_Mmap
+    struct stat info;
+    if (fstat(fileno(file_), &info) == 0 && S_ISREG(info.st_mode)) {
+      mapped_size_ = (size_t)info.st_size;
+      if (mapped_size_ == 0) return true;   // mmap() doesn't take an empty file, and nothing to read anyway.
+      void* data = mmap(nullptr, mapped_size_, PROT_READ, MAP_PRIVATE, fileno(file_), 0);
+      if (data != MAP_FAILED) {
+        madvise(data, mapped_size_, MADV_SEQUENTIAL);
+        mapped_ = (const char*)data;
+        return true;
+      }
+      mapped_size_ = 0;
+    }
+#endif
+    buffer_.resize(kChunkBytes);
+    return true;
+  }
+
+  // Get the next chunk of whole lines, return false at the end of the input.
+  bool Next(string_view& chunk) {
+    if (mapped_ || buffer_.empty()) return NextMapped(chunk);
+    return NextRead(chunk);
+  }
+};
+
+// Output buffered in a big block and written with one fwrite() per block, instead of going
+// through cout, which locks and checks the stream state on every "<<".
+class BufferedWriter {
+private:
+  FILE* file_;
+  vector<char> buffer_;
+  size_t used_ = 0;
+
+public:
+  explicit BufferedWriter(FILE* file, size_t size = 1 << 20) : file_(file), buffer_(max(size, kMaxFormattedLength)) {}
+  ~BufferedWriter() { Flush(); }
+
+  void Flush(void) {
+    if (used_ > 0) fwrite(buffer_.data(), 1, used_, file_);
+    used_ = 0;
+    fflush(file_);
+  }
+
+  void Put(char ch) {
+    if (used_ == buffer_.size()) Flush();
+    buffer_[used_++] = ch;
+  }
+
+  // Write "value" with its best number of decimal digits, the same way Evaluate() shows a result.
+  template <typename T>
+  void Result(T value) {
+    if (buffer_.size() - used_ < kMaxFormattedLength) Flush();
+    size_t length = FormatBestPrecision(value, buffer_.data() + used_, buffer_.size() - used_);
+    if (length == 0) {
+      // only a Decimal with hundreds of digits can be that long, give it the whole buffer.
+      Flush();
+      length = FormatBestPrecision(value, buffer_.data(), buffer_.size());
+    }
+    used_ += length;
+  }
+};
+
+// Batch mode : calculate one expression per line of "input" with "threads" threads, and write one
+// result per line to stdout, in the same order as the input. Empty lines are skipped.
+// A malformed expression gets an empty line instead of a result, so the results stay in line with
+// the expressions, and is reported at the end on stderr, all at once : how many, and the first
+// kMaxReported of them with their line number, what's wrong and where.
+// The expressions are taken as views into the chunk of ChunkedInput, no string is copied.
+// With "cache_megabytes" > 0, the results are cached in a ResultCache shared by all the threads.
+// "Calc" calculates the results, ex. RunBatchMode<MixedValue, MixedCalculator>.
+template <typename T, typename Calc = Calculator<T>>
+void RunBatchMode(ChunkedInput& input, int threads, size_t cache_megabytes) {
+  const size_t kMaxReported = 20;
+  ThreadPool pool(threads);
+  // a few shards per thread, so 2 threads seldom want the same lock at the same time.
+  ResultCache<T> cache(cache_megabytes << 20, 4 * pool.Size());
+  BufferedWriter out(stdout);
+  vector<string_view> lines;
+  vector<T> results;
+  vector<ParseStatus> statuses;
+  size_t line_number = 0;   // of the first line of the chunk, counting from 0.
+  size_t malformed = 0;
+  vector<string> reported;
+  string_view chunk;
+
+  while (input.Next(chunk)) {
+    lines.clear();
+    size_t start = 0;
+    while (start < chunk.size()) {
+      size_t end = chunk.find('\n', start);
+      if (end == string_view::npos) end = chunk.size();
+      string_view line = chunk.substr(start, end - start);
+      if (!line.empty() && line.back() == '\r') line.remove_suffix(1);   // files from Windows.
+      if (!line.empty()) lines.push_back(line);
+      start = end + 1;
+    }
+    CalculateInParallel<T, string_view, Calc>(pool, lines, results, (cache_megabytes > 0)? &cache : nullptr, &statuses);
+    const char* counted = chunk.data();   // the newlines before it are counted in line_number.
+    for (size_t i = 0; i < results.size(); i++) {
+      if (statuses[i].Ok()) {
+        out.Result(results[i]);
+      } else if (malformed++ < kMaxReported) {
+        line_number += count(counted, lines[i].data(), '\n');
+        counted = lines[i].data();
+        char text[kMaxFormattedLength];
+        reported.push_back("line " + to_string(line_number + 1) + " : " +
+                           string(text, FormatError(statuses[i], text, sizeof(text))) + " : " + string(lines[i]));
+      }
+      out.Put('\n');
+    }
+    line_number += count(counted, chunk.data() + chunk.size(), '\n');
+  }
+  out.Flush();
+  if (malformed > 0) {
+    cerr << malformed << " malformed expression(s), left with an empty line :" << endl;
+    for (const string& report : reported) cerr << "  " << report << endl;
+    if (malformed > reported.size()) cerr << "  ..." << endl;
+  }
+}
+
+// Server mode : a long-running process answering expressions, so the start-up cost of the program
+// is paid once instead of once per expression.
+//
+// The protocol is the same on a socket and on a pipe, a stream of frames in both directions :
+//   frame = 4-byte length (little endian) + that many bytes.
+// A request frame holds one expression, its response frame holds the result as Evaluate() shows it
+// (ex. "1614.702", "nan", "inf"), or what's wrong with a malformed one, ex. "error : missing operand
+// at 2" for "1+". A malformed request costs no more than a good one, and the connection goes on. Responses come in the order of the requests, so a client can
+// send many requests without waiting (pipelining), and gets the responses of everything the server
+// read at once in one write. A request longer than kMaxFrameLength is a protocol error, the server
+// closes the connection.
+const size_t kMaxFrameLength = 1 << 20;
+
+inline uint32_t ReadFrameLength(const char* header) {
+  return (uint32_t)(uint8_t)header[0] | (uint32_t)(uint8_t)header[1] << 8 |
+         (uint32_t)(uint8_t)header[2] << 16 | (uint32_t)(uint8_t)header[3] << 24;
+}
+
+inline void AppendFrame(string& output, string_view payload) {
+  uint32_t length = (uint32_t)payload.size();
+  char header[4] = {(char)length, (char)(length >> 8), (char)(length >> 16), (char)(length >> 24)};
+  output.append(header, 4);
+  output.append(payload.data(), payload.size());
+}
+
+// Calculate every complete request frame at the start of "input", and append their response frames
+// to "output". Return the number of bytes used (the frame left unfinished stays for next time), or
+// string_view::npos on a protocol error.
+template <typename T>
+size_t ServeFrames(string_view input, Calculator<T>& calculator, string& output) {
+  size_t pos = 0;
+  while (input.size() - pos >= 4) {
+    uint32_t length = ReadFrameLength(input.data() + pos);
+    if (length > kMaxFrameLength) return string_view::npos;
+    if (input.size() - pos - 4 < length) break;
+    CalcResult<T> result = calculator.TryCalculate(input.substr(pos + 4, length));
+    pos += 4 + length;
+
+    // format right into "output", after room for the header.
+    size_t start = output.size();
+    output.resize(start + 4 + kMaxFormattedLength);
+    size_t text_length = result.Ok()? FormatBestPrecision(result.value, &output[start + 4], kMaxFormattedLength)
+                                    : FormatError(result.status, &output[start + 4], kMaxFormattedLength);
+    if (text_length == 0) {
+      // only a Decimal with hundreds of digits can be that long.
+      output.resize(start + 4 + kMaxFrameLength);
+      text_length = FormatBestPrecision(result.value, &output[start + 4], kMaxFrameLength);
+    }
+    output.resize(start + 4 + text_length);
+    uint32_t encoded = (uint32_t)text_length;
+    for (int i = 0; i < 4; i++) output[start + i] = (char)(encoded >> (8 * i));
+  }
+  return pos;
+}
+
+#ifdef Have_Posix_Io
+
+// Pipe mode : the protocol over stdin/stdout, for a parent process holding the pipes.
+// Return false on a protocol error.
+template <typename T>
+bool RunPipeMode(size_t cache_megabytes) {
+  Calculator<T> calculator;
+  ResultCache<T> cache(cache_megabytes << 20);
+  if (cache_megabytes > 0) calculator.SetResultCache(&cache);
+  vector<char> buffer(1 << 16);
+  string input, output;
+  while (true) {
+    ssize_t n = read(STDIN_FILENO, buffer.data(), buffer.size());
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return input.empty();
+    input.append(buffer.data(), n);
+    size_t used = ServeFrames<T>(input, calculator, output);
+    if (used == string_view::npos) {
+      cerr << "protocol error : a frame longer than " << kMaxFrameLength << " bytes" << endl;
+      return false;
+    }
+    input.erase(0, used);
+    for (size_t written = 0; written < output.size();) {
+      ssize_t w = write(STDOUT_FILENO, output.data() + written, output.size() - written);
+      if (w < 0 && errno == EINTR) continue;
+      if (w <= 0) return false;
+      written += w;
+    }
+    output.clear();
+  }
+}
+
+#endif
+
+#ifdef Have_Epoll_Server
+
+// Set by SIGINT/SIGTERM in server mode, to stop the server cleanly.
+static atomic<bool> server_interrupted{false};
+
+// The server on a Unix domain socket. Every worker thread has its own epoll, its own Calculator and
+// its own connections, so a request is read, calculated and answered by one thread without any
+// hand-off or lock (but the ResultCache's). The workers all wait on the listening socket with
+// EPOLLEXCLUSIVE, and the one woken up takes the new connection.
+// The sockets are non-blocking : a worker reads all a connection has, answers every complete frame
+// in one write, and while a response can't be written completely it stops reading that connection
+// (so a client which doesn't read its responses can't make the server buffer without end).
+template <typename T>
+class EvaluationServer {
+ public:
+  EvaluationServer(int threads, size_t cache_megabytes)
+    : threads_(threads > 0? threads : max(1u, thread::hardware_concurrency())),
+      cache_(cache_megabytes << 20, 4 * threads_), use_cache_(cache_megabytes > 0) {}
+
+  ~EvaluationServer() {
+    if (listen_fd_ >= 0) {
+      close(listen_fd_);
+      unlink(path_.c_str());
+    }
+  }
+
+  // Create the socket at "path". A socket left there by a server before is replaced.
+  bool Listen(const string& path) {
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+      cout << "socket path too long : " << path << endl;
+      return false;
+    }
+    memcpy(address.sun_path, path.c_str(), path.size() + 1);
+    struct stat info;
+    if (stat(path.c_str(), &info) == 0 && S_ISSOCK(info.st_mode)) unlink(path.c_str());
+
+    listen_fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listen_fd_ < 0 || bind(listen_fd_, (sockaddr*)&address, sizeof(address)) != 0 ||
+        listen(listen_fd_, SOMAXCONN) != 0) {
+      cout << "can't listen on " << path << " : " << strerror(errno) << endl;
+      if (listen_fd_ >= 0) close(listen_fd_);
+      listen_fd_ = -1;
+      return false;
+    }
+    path_ = path;
+    return true;
+  }
+
+  // Serve until Stop() or SIGINT/SIGTERM.
+  void Run(void) {
+    vector<thread> workers;
+    for (int i = 1; i < threads_; i++) workers.emplace_back([this]() { Work(); });
+    Work();
+    for (thread& worker : workers) worker.join();
+  }
+
+  void Stop(void) {
+    stop_ = true;
+  }
+
+ private:
+  struct Connection {
+    string input;     // the unfinished frame of the last read.
+    string output;    // responses not written yet.
+    size_t written = 0;
+    bool polling_out = false;   // waiting for EPOLLOUT instead of EPOLLIN.
+  };
+
+  static constexpr int kPollMilliseconds = 100;   // how often the workers look at stop_.
+
+  bool Stopping(void) const {
+    return stop_ || server_interrupted;
+  }
+
+  void Work(void) {
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) return;
+    epoll_event event = {};
+#ifdef EPOLLEXCLUSIVE
+    event.events = EPOLLIN | EPOLLEXCLUSIVE;
+#else
+    event.events = EPOLLIN;
+#endif
+    event.data.fd = listen_fd_;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd_, &event);
+
+    Calculator<T> calculator;
+    if (use_cache_) calculator.SetResultCache(&cache_);
+    unordered_map<int, Connection> connections;
+    vector<char> buffer(1 << 16);
+    epoll_event events[64];
+
+    while (!Stopping()) {
+      int count = epoll_wait(epoll_fd, events, 64, kPollMilliseconds);
+      for (int i = 0; i < count; i++) {
+        int fd = events[i].data.fd;
+        if (fd == listen_fd_) {
+          Accept(epoll_fd, connections);
+          continue;
+        }
+        auto it = connections.find(fd);
+        if (it == connections.end()) continue;
+        bool open = true;
+        if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) open = Read(fd, it->second, calculator, buffer);
+        if (open) open = Write(epoll_fd, fd, it->second);
+        if (!open) {
+          close(fd);
+          connections.erase(it);
+        }
+      }
+    }
+    for (auto& connection : connections) close(connection.first);
+    close(epoll_fd);
+  }
+
+  void Accept(int epoll_fd, unordered_map<int, Connection>& connections) {
+    while (true) {
+      int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (fd < 0) return;   // EAGAIN : nothing more, or another worker took it.
+      epoll_event event = {};
+      event.events = EPOLLIN;
+      event.data.fd = fd;
+      epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+      connections[fd];
+    }
+  }
+
+  // Read all "fd" has, and calculate every complete frame. Return false to close the connection.
+  bool Read(int fd, Connection& connection, Calculator<T>& calculator, vector<char>& buffer) {
+    while (true) {
+      ssize_t n = read(fd, buffer.data(), buffer.size());
+      if (n < 0) return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+      if (n == 0) return false;   // the client is gone.
+      // most of the time there is no unfinished frame : calculate right from the read buffer.
+      size_t used;
+      if (connection.input.empty()) {
+        used = ServeFrames<T>(string_view(buffer.data(), n), calculator, connection.output);
+        if (used == string_view::npos) return false;
+        connection.input.assign(buffer.data() + used, n - used);
+      } else {
+        connection.input.append(buffer.data(), n);
+        used = ServeFrames<T>(connection.input, calculator, connection.output);
+        if (used == string_view::npos) return false;
+        connection.input.erase(0, used);
+      }
+      if ((size_t)n < buffer.size()) return true;   // drained, no need to get EAGAIN.
+    }
+  }
+
+  // Write what the connection has to write. Wait for EPOLLOUT instead of EPOLLIN while it can't
+  // be written completely. Return false to close the connection.
+  bool Write(int epoll_fd, int fd, Connection& connection) {
+    while (connection.written < connection.output.size()) {
+      ssize_t n = send(fd, connection.output.data() + connection.written, connection.output.size() - connection.written,
+                       MSG_NOSIGNAL);
+      if (n < 0) {
+        if (errno == EINTR) continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK) return false;
+        if (!connection.polling_out) Poll(epoll_fd, fd, EPOLLOUT);
+        connection.polling_out = true;
+        return true;
+      }
+      connection.written += n;
+    }
+    connection.output.clear();
+    connection.written = 0;
+    if (connection.polling_out) Poll(epoll_fd, fd, EPOLLIN);
+    connection.polling_out = false;
+    return true;
+  }
+
+  static void Poll(int epoll_fd, int fd, uint32_t events) {
+    epoll_event event = {};
+    event.events = events;
+    event.data.fd = fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &event);
+  }
+
+  int threads_;
+  ResultCache<T> cache_;
+  bool use_cache_;
+  int listen_fd_ = -1;
+  string path_;
+  atomic<bool> stop_{false};
+};
+
+// The load generator of server mode : "connections" clients, each sending "requests" requests with
+// up to "pipeline" of them waiting for their responses, cycling through "expressions". Every response
+// is checked against Calculate() here, and its latency (from the request sent to the response read)
+// goes to "latency". Return the number of wrong or missing responses.
+inline uint64_t RunLoadClient(const string& path, int connections, uint64_t requests, int pipeline,
+                              const vector<string>& expressions, LatencyHistogram& latency) {
+  // the expected responses, and the request frames.
+  Calculator<double> calculator;
+  vector<string> expected, frames;
+  for (const string& expression : expressions) {
+    char text[kMaxFormattedLength];
+    CalcResult<double> result = calculator.TryCalculate(expression);
+    expected.emplace_back(text, result.Ok()? FormatBestPrecision(result.value, text, sizeof(text))
+                                           : FormatError(result.status, text, sizeof(text)));
+    frames.emplace_back();
+    AppendFrame(frames.back(), expression);
+  }
+  pipeline = max(1, pipeline);
+
+  vector<LatencyHistogram> histograms(connections);
+  vector<uint64_t> failures(connections, 0);
+  vector<thread> clients;
+  for (int c = 0; c < connections; c++) {
+    clients.emplace_back([&, c]() {
+      uint64_t& failed = failures[c];
+      int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+      sockaddr_un address = {};
+      address.sun_family = AF_UNIX;
+      strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+      if (fd < 0 || connect(fd, (sockaddr*)&address, sizeof(address)) != 0) {
+        failed = requests;
+        if (fd >= 0) close(fd);
+        return;
+      }
+      vector<chrono::steady_clock::time_point> sent_at(pipeline);
+      string output, input;
+      vector<char> buffer(1 << 16);
+      uint64_t sent = 0, received = 0;
+      while (received < requests) {
+        // top the pipeline up, and send it all in one write.
+        output.clear();
+        auto now = chrono::steady_clock::now();
+        for (; sent < requests && sent - received < (uint64_t)pipeline; sent++) {
+          output += frames[sent % frames.size()];
+          sent_at[sent % pipeline] = now;
+        }
+        for (size_t written = 0; written < output.size();) {
+          ssize_t n = send(fd, output.data() + written, output.size() - written, MSG_NOSIGNAL);
+          if (n <= 0) break;
+          written += n;
+        }
+        ssize_t n = read(fd, buffer.data(), buffer.size());
+        if (n <= 0) break;
+        now = chrono::steady_clock::now();
+        input.append(buffer.data(), n);
+        size_t pos = 0;
+        while (input.size() - pos >= 4 && input.size() - pos - 4 >= ReadFrameLength(input.data() + pos)) {
+          uint32_t length = ReadFrameLength(input.data() + pos);
+          if (string_view(input.data() + pos + 4, length) != expected[received % expected.size()]) failed++;
+          histograms[c].Record((uint64_t)chrono::duration_cast<chrono::nanoseconds>(now - sent_at[received % pipeline]).count());
+          received++;
+          pos += 4 + length;
+        }
+        input.erase(0, pos);
+      }
+      failed += requests - received;
+      close(fd);
+    });
+  }
+  uint64_t failed = 0;
+  for (int c = 0; c < connections; c++) {
+    clients[c].join();
+    latency.Merge(histograms[c]);
+    failed += failures[c];
+  }
+  return failed;
+}
+
+#endif
+
+#ifdef Also_Run_Console_Out_Test
+void cout_control_test(void);   // this test requires #include <iomanip>.
+#endif
+
+#ifdef Also_Run_Precision_Test
+void precision_test(void);   // this test requires #include <cmath>.
+#endif
+
+#ifdef Also_Run_Compile_Test
+void compile_test(void);   // this test requires #include <chrono>.
+#endif
+
+#ifdef Also_Run_Batch_Test
+template <typename T>
+void batch_test(void);
+#endif
+
+#ifdef Also_Run_Simd_Test
+template <typename T>
+void simd_test(void);   // this test requires #include <cstring> for memcmp.
+#endif
+
+#ifdef Also_Run_Parallel_Test
+void parallel_test(void);
+#endif
+
+#ifdef Also_Run_Trace_Test
+void trace_test(void);
+#endif
+
+#ifdef Also_Run_Allocation_Test
+void allocation_test(void);
+#endif
+
+#ifdef Also_Run_Optimize_Test
+void optimize_test(void);
+#endif
+
+#ifdef Also_Run_Cache_Test
+void cache_test(void);
+#endif
+
+#ifdef Also_Run_Format_Test
+template <typename T>
+void format_test(void);   // this test requires #include <sstream>.
+#endif
+
+#ifdef Also_Run_Decimal_Test
+void decimal_test(void);
+#endif
+
+#ifdef Also_Run_Lexer_Test
+template <typename T>
+void lexer_test(void);   // this test requires #include <sstream> and <cstring> for memcmp.
+#endif
+
+#ifdef Also_Run_Jit_Test
+template <typename T>
+void jit_test(void);   // this test requires #include <cstring> for memcmp.
+#endif
+
+#ifdef Also_Run_Constexpr_Test
+void constexpr_test(void);
+#endif
+
+#ifdef Also_Run_Benchmark
+template <typename T>
+void benchmark(void);   // this requires #include <iomanip> for setw.
+#endif
+
+#ifdef Also_Run_Instrumentation_Test
+void instrumentation_test(void);
+#endif
+
+#ifdef Also_Run_Server_Test
+void server_test(void);
+#endif
+
+#ifdef Also_Run_Incremental_Test
+void incremental_test(void);   // this test requires #include <cstring> for memcmp.
+#endif
+
+#ifdef Also_Run_Operators_Test
+void operators_test(void);   // this test requires #include <cstring> for memcmp.
+#endif
+
+#ifdef Also_Run_Validation_Test
+void validation_test(void);   // this test requires #include <cstring> for memcmp.
+#endif
+
+#ifdef Also_Run_Mixed_Test
+void mixed_test(void);
+#endif
+
+void show_usage(const char* program) {
+  cout << "usage : " << program << " [--file PATH] [--threads N] [--cache MB] [--decimal|--mixed] [--stats text|json]" << endl;
+  cout << "        " << program << " --serve SOCKET | --pipe [--threads N] [--cache MB] [--decimal]" << endl;
+  cout << "        " << program << " --load SOCKET [--connections N] [--requests N] [--pipeline N]" << endl;
+  cout << "  (no option)  : read one expression from the console and show how it is evaluated." << endl;
+  cout << "  --file PATH  : batch mode. read one expression per line from file PATH (\"-\" for the console)," << endl;
+  cout << "                 and print one result per line. a malformed expression gets an empty line, and" << endl;
+  cout << "                 is reported on stderr at the end, with what's wrong and where." << endl;
+  cout << "  --threads N  : batch mode with N threads (0 = one per CPU core, the default)." << endl;
+  cout << "                 reads from the console if --file is not given." << endl;
+  cout << "  --cache MB   : batch mode, cache the results of repeated expressions in MB megabytes." << endl;
+  cout << "  --decimal    : batch mode, calculate with exact decimals instead of double." << endl;
+  cout << "  --mixed      : batch mode, calculate with int64 when the expression and its result are integers" << endl;
+  cout << "                 (exact up to 2^63), and with double otherwise." << endl;
+  cout << "  --stats FMT  : batch mode, print the instrumentation snapshot (text or json) to stderr at the end." << endl;
+  cout << "                 needs a build with -DCalculator_Instrumentation=1." << endl;
+  cout << "  --serve SOCKET : server mode. answer expressions on the Unix domain socket SOCKET, until" << endl;
+  cout << "                 SIGINT/SIGTERM. each request and response is a frame : a 4-byte little endian" << endl;
+  cout << "                 length and that many bytes, the expression or its result." << endl;
+  cout << "  --pipe       : the same protocol on stdin/stdout." << endl;
+  cout << "  --load SOCKET : load generator for --serve : N connections (1) sending N requests (100000)" << endl;
+  cout << "                 each, with up to N of them in flight (1). prints the latency percentiles." << endl;
+  cout << "  expressions  : numbers, variables, ( ), + - * / % (remainder) ^ (power), the negation -a, and" << endl;
+  cout << "                 the functions sqrt(a) abs(a) exp(a) log(a) min(a,b) max(a,b)." << endl;
+}
+
+int main(int argc, char* argv[]) {
+  int threads = -1;   // -1 : not given.
+  string path;        // empty : not in batch mode.
+  int cache_megabytes = 0;
+  bool decimal = false;
+  bool mixed = false;
+  string stats;       // empty : no instrumentation snapshot.
+  string serve_path, load_path;
+  bool pipe_mode = false;
+  int connections = 1, pipeline = 1;
+  long long requests = 100000;
+  for (int i = 1; i < argc; i++) {
+    string option = argv[i];
+    if (option == "--threads" && i + 1 < argc) {
+      threads = max(0, atoi(argv[++i]));
+    } else if (option == "--file" && i + 1 < argc) {
+      path = argv[++i];
+    } else if (option == "--cache" && i + 1 < argc) {
+      cache_megabytes = max(0, atoi(argv[++i]));
+    } else if (option == "--decimal") {
+      decimal = true;
+    } else if (option == "--mixed") {
+      mixed = true;
+    } else if (option == "--stats" && i + 1 < argc && (string(argv[i + 1]) == "text" || string(argv[i + 1]) == "json")) {
+      stats = argv[++i];
+    } else if (option == "--serve" && i + 1 < argc) {
+      serve_path = argv[++i];
+    } else if (option == "--pipe") {
+      pipe_mode = true;
+    } else if (option == "--load" && i + 1 < argc) {
+      load_path = argv[++i];
+    } else if (option == "--connections" && i + 1 < argc) {
+      connections = max(1, atoi(argv[++i]));
+    } else if (option == "--requests" && i + 1 < argc) {
+      requests = max(1LL, atoll(argv[++i]));
+    } else if (option == "--pipeline" && i + 1 < argc) {
+      pipeline = max(1, atoi(argv[++i]));
+    } else {
+      show_usage(argv[0]);
+      return 1;
+    }
+  }
+  if (!serve_path.empty() || !load_path.empty()) {
+#ifdef Have_Epoll_Server
+    if (!load_path.empty()) {
+      LatencyHistogram latency;
+      const vector<string> expressions = {"1+2*(3+4*(5+6*7+1))*(8+9)", "12345+67890", "12+34*(56+78*2)*(1+2)",
+                                          "12.+13.45*(23.56+47.8*2)"};
+      auto start = chrono::steady_clock::now();
+      uint64_t failed = RunLoadClient(load_path, connections, (uint64_t)requests, pipeline, expressions, latency);
+      double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+      cout << latency.Count() << " responses in " << seconds << " s (" << latency.Count() / seconds
+        << " requests/s), failed=" << failed << endl;
+      cout << "latency us : p50=" << latency.Percentile(50) / 1e3 << " p90=" << latency.Percentile(90) / 1e3
+        << " p99=" << latency.Percentile(99) / 1e3 << " p99.9=" << latency.Percentile(99.9) / 1e3
+        << " max=" << latency.Max() / 1e3 << endl;
+      return failed == 0? 0 : 1;
+    }
+    signal(SIGINT, [](int) { server_interrupted = true; });
+    signal(SIGTERM, [](int) { server_interrupted = true; });
+    if (decimal) {
+      EvaluationServer<Decimal> server(max(0, threads), cache_megabytes);
+      if (!server.Listen(serve_path)) return 1;
+      server.Run();
+    } else {
+      EvaluationServer<double> server(max(0, threads), cache_megabytes);
+      if (!server.Listen(serve_path)) return 1;
+      server.Run();
+    }
+    return 0;
+#else
+    cout << "server mode needs epoll, which this system doesn't have. use --pipe." << endl;
+    return 1;
+#endif
+  }
+  if (pipe_mode) {
+#ifdef Have_Posix_Io
+    return (decimal? RunPipeMode<Decimal>(cache_megabytes) : RunPipeMode<double>(cache_megabytes))? 0 : 1;
+#else
+    cout << "pipe mode needs POSIX read/write, which this system doesn't have." << endl;
+    return 1;
+#endif
+  }
+  if ((threads >= 0 || cache_megabytes > 0 || decimal || mixed || !stats.empty()) && path.empty()) path = "-";
+  if (!path.empty()) {
+    ChunkedInput input;
+    if (!input.Open(path)) return 1;
+    if (decimal)
+      RunBatchMode<Decimal>(input, max(0, threads), cache_megabytes);
+    else if (mixed)
+      RunBatchMode<MixedValue, MixedCalculator>(input, max(0, threads), cache_megabytes);
+    else
+      RunBatchMode<double>(input, max(0, threads), cache_megabytes);
+    if (!stats.empty()) {
+      if constexpr (kInstrumentation) {
+        InstrumentationCounters snapshot = Instrumentation::Snapshot();
+        string text = (stats == "json")? snapshot.ToJson() + "\n" : snapshot.ToText();
+        fputs(text.c_str(), stderr);
+      } else {
+        fputs("no instrumentation in this build, rebuild with -DCalculator_Instrumentation=1\n", stderr);
+      }
+    }
+    return 0;
+  }
+
+  cout << "Calculator Test. Please enter teh expression to evaluate :" << endl; 
+  string expression;
+  // use the following string for testing, and debug step-by-step to understand how this program runs : 
+  // 
+  // 1+2*(3+4*(5+6*7+1))*(8+9) = 6631
+  // 12345+67890           = 80235
+  // 12+34*(56+78*2)*(1+2) = 21636
+  // 12.+13.45*(23.56+47.8*2) = 1614.702
+  //
+  cin >> expression;
+
+  // Calculator<float, Calculator_Trace_Level> calculator;   // calculator with float type variables.
+  Calculator<double, Calculator_Trace_Level> calculator;    // calculator with double type variables.
+  calculator.Evaluate(expression);
+
+#ifdef Also_Run_Console_Out_Test
+  cout << endl << "--- Console out control test ---" << endl; 
+  cout_control_test();
+#endif
+#ifdef Also_Run_Precision_Test
+  cout << endl << "--- Float/Double presision and round to best position test ---" << endl; 
+  precision_test();
+#endif
+#ifdef Also_Run_Compile_Test
+  cout << endl << "--- Compile once, execute many times test ---" << endl; 
+  compile_test();
+#endif
+#ifdef Also_Run_Batch_Test
+  cout << endl << "--- Batch (columnar) evaluation test ---" << endl; 
+  batch_test<float>();
+  batch_test<double>();
+#endif
+#ifdef Also_Run_Simd_Test
+  cout << endl << "--- SIMD block kernels test ---" << endl; 
+  simd_test<float>();
+  simd_test<double>();
+#endif
+#ifdef Also_Run_Parallel_Test
+  cout << endl << "--- Multi-threaded evaluation test ---" << endl; 
+  parallel_test();
+#endif
+#ifdef Also_Run_Trace_Test
+  cout << endl << "--- Trace level test ---" << endl; 
+  trace_test();
+#endif
+#ifdef Also_Run_Allocation_Test
+  cout << endl << "--- Allocation test ---" << endl; 
+  allocation_test();
+#endif
+#ifdef Also_Run_Optimize_Test
+  cout << endl << "--- Optimize (constant folding) test ---" << endl; 
+  optimize_test();
+#endif
+#ifdef Also_Run_Cache_Test
+  cout << endl << "--- Result cache test ---" << endl; 
+  cache_test();
+#endif
+#ifdef Also_Run_Format_Test
+  cout << endl << "--- Best precision formatting test ---" << endl; 
+  format_test<float>();
+  format_test<double>();
+#endif
+#ifdef Also_Run_Decimal_Test
+  cout << endl << "--- Decimal test ---" << endl; 
+  decimal_test();
+#endif
+#ifdef Also_Run_Lexer_Test
+  cout << endl << "--- Number lexer test ---" << endl; 
+  lexer_test<float>();
+  lexer_test<double>();
+#endif
+#ifdef Also_Run_Jit_Test
+  cout << endl << "--- JIT test ---" << endl; 
+  jit_test<float>();
+  jit_test<double>();
+#endif
+#ifdef Also_Run_Constexpr_Test
+  cout << endl << "--- Compile-time expression test ---" << endl; 
+  constexpr_test();
+#endif
+#ifdef Also_Run_Benchmark
+  cout << endl << "--- Benchmark ---" << endl; 
+  benchmark<float>();
+  benchmark<double>();
+#endif
+#ifdef Also_Run_Instrumentation_Test
+  cout << endl << "--- Instrumentation test ---" << endl; 
+  instrumentation_test();
+#endif
+#ifdef Also_Run_Server_Test
+  cout << endl << "--- Server mode test ---" << endl; 
+  server_test();
+#endif
+#ifdef Also_Run_Incremental_Test
+  cout << endl << "--- Incremental evaluation test ---" << endl; 
+  incremental_test();
+#endif
+#ifdef Also_Run_Operators_Test
+  cout << endl << "--- Operators test ---" << endl; 
+  operators_test();
+#endif
+#ifdef Also_Run_Validation_Test
+  cout << endl << "--- Validation test ---" << endl; 
+  validation_test();
+#endif
+#ifdef Also_Run_Mixed_Test
+  cout << endl << "--- Mixed precision test ---" << endl; 
+  mixed_test();
+#endif
+
+  return 0;
 }
 
 #ifdef Also_Run_Console_Out_Test
 
-void cout_control_test(void)
-{
-  // How to declare float/double number in program, and control precision when cout them.
-  //   ref link : https://www.programiz.com/cpp-programming/float-double
-  //
-  // notice for float (32bit) 23 bits are used for the mantissa (about 7 decimal digits).
-  // while for double (64bit) 52 bits are used for the mantissa (about 16 decimal digits)
-  double a = 39.12348239;   // var with dicimal points but without trailing "f" will be interpreted as of "double" type.
-  float  b = 39.12348239f;  // var of float type should be assigned by a number with trailing "f".
+void cout_control_test(void)
+{
+  // How to declare float/double number in program, and control precision when cout them.
+  //   ref link : https://www.programiz.com/cpp-programming/float-double
+  //
+  // notice for float (32bit) 23 bits are used for the mantissa (about 7 decimal digits).
+  // while for double (64bit) 52 bits are used for the mantissa (about 16 decimal digits)
+  double a = 39.12348239;   // var with dicimal points but without trailing "f" will be interpreted as of "double" type.
+  float  b = 39.12348239f;  // var of float type should be assigned by a number with trailing "f".
+
+  // Modifiers only affect fpt numbers : "std::setprecision()", "std::fixed", "std::scientific".
+  // Have persistent effect : ALL. 
+  //
+  // ----- Console output of the following code ----
+  //  Test 1 : c++ Modifiers affacting fpt numbers 3.912348239
+  //   <Default             > a(double)=39.1235, b(float)=39.1235
+  //   <fixed, precision=8  > a(double)=39.12348239, b(float)=39.12348175
+  //   <Retest w/o modifiers> a(double)=39.12348239, b(float)=39.12348175
+  //   <scientific, precision=2> a(double)=3.91e+01, b(float)=3.91e+01
+  //   <Retest w/o modifiers   > a(double)=3.91e+01, b(float)=3.91e+01
+  //   <reset back to default  > a(double)=39.1235, b(float)=39.1235
+  //
+  cout << " Test 1 : c++ Modifiers affacting fpt numbers 3.912348239" << endl;
+  cout << "  <Default             > ";
+  cout << "a(double)=" << a << ", b(float)=" << b << endl;
+  cout << "  <fixed, precision=8  > " << fixed << setprecision(8);
+  cout << "a(double)=" << a << ", b(float)=" << b << endl;
+  cout << "  <Retest w/o modifiers> ";
+  cout << "a(double)=" << a << ", b(float)=" << b << endl;
+  cout << "  <scientific, precision=2> "  << scientific << setprecision(2);
+  cout << "a(double)=" << a << ", b(float)=" << b << endl;
+  cout << "  <Retest w/o modifiers   > ";
+  cout << "a(double)=" << a << ", b(float)=" << b << endl;
+  
+  // to reset back to default, Gemini mentioned "ios::defaultfmt", "ios:generic", but they are not 
+  // defined in fact. let's use cout.unsetf() and set presision back to default (6) instead.
+  cout << "  <reset back to default  > ";
+  cout.unsetf(ios::fixed | ios::scientific);  
+  cout << setprecision(6);  // default is 6.
+  cout << "a(double)=" << a << ", b(float)=" << b << endl;
+
+  // notice "std::setprecision", "std::fixed", and "std::scientific" only affect floating-point numbers.
+  //
+  // ----- Console output of the following code ----
+  //  Test 2 : c++ Output integer c -128
+  //   <No modifiers. No effect on integers.> c(int)=-128, c(uint)=4294967168
+  //
+  cout << " Test 2 : c++ Output integer c -128" << endl;
+  int c = -128;
+  cout << "  <No modifiers. No effect on integers.> c(int)=" << c << ", c(uint)=" << (unsigned int)c << endl;
+
+  // Modifiers only affect integers : "std::hex","std::dec","std::oct","std::showbase","std::right","std::setw()".
+  // Have persistent effect : "std::hex","std::dec","std::oct","std::showbase","std::right" 
+  // Only effective for once : "std::setw()"
+  //
+  // ----- Console output of the following code ----
+  //  Test 3 : c++ Modifiers affecting integers -128
+  //   <hex, showbase, width=8, right-aligned> c(int)='0xffffff80'
+  //   <Retest w/i width=10                  > c(int)='0xffffff80'
+  //   <Retest w/o modifiers                 > c(int)='0xffffff80'
+  //   <Retest on fpt number. No effect.     > a(double)='39.1235'
+  //
+  cout << " Test 3 : c++ Modifiers affecting integers -128" << endl;
+  cout << "  <hex, showbase, width=8, right-aligned> c(int)='" << hex << showbase << setw(8) << right << c << "'" << endl;
+  cout << "  <Retest w/i width=10                  > c(int)='" << setw(10) << c << "'" << endl;
+  cout << "  <Retest w/o modifiers                 > c(int)='" << c << "'" << endl;
+  cout << "  <Retest on fpt number. No effect.     > a(double)='" << a << "'" << endl;
+  
+  // cout is too lousy to control. That's why we still use c-style printf in c++ for debugging.
+  // by the way, notice to use c-lib in c++ programs, the best practice is to include c-equivalent header
+  // instead of c headers, they imports symbols into namespace "std".
+  // More precisely, The difference is that stdio.h and other C-like libraries when imported in a C++ file 
+  // may pollute the global namespace, while the corresponding C++ headers (cstdio, cstdlib, cassert) place 
+  // the corresponding functions, variables, etc., in the std namespace.
+  // ref link : https://cplusplus.com/reference/cstdio/
+  //
+  // for example, to include stdio.h, we should,
+  //
+  //   #include <cstdio>    // instead of #include <stdio.h>
+  //
+  // However, in this test we didn't include <cstdio>, but printf still works !! 
+  // Need to check whether <iostream> had ever included <cstdio> already.
+  //
+  // ----- Console output of the following code ----
+  //  Test 4 : use c printf still.
+  //   fpt/double with precision 8, width 12 : a(double)=' 39.12348239', b(float)=' 39.12348175'
+  //   int with width 12 : c(int)='        -128', c(uint)='  4294967168', c(in 8 hex digits)='0xffffff80'
+  //
+  printf(" Test 4 : use c printf still.\n");
+  printf("  fpt/double with precision 8, width 12 : a(double)='%12.8f', b(float)='%12.8f'\n", a, b);
+  printf("  int with width 12 : c(int)='%12d', c(uint)='%12u', c(in 8 hex digits)='0x%08x'\n", c, c, c);
+}
+#endif
+
+// round "orig" to the best decimal digit, see BestPrecision().
+// also notice it's recommended to use "template <typename T>" instead of "template <class T>".
+template <class T>
+int round_to_best_precision(T orig, T &result){
+  return BestPrecision(orig, result);
+}
+
+#ifdef Also_Run_Precision_Test
+
+void precision_test(void){
+  float x = 3.192837465f;
+  double y = 321.192837465;
+  double z = 123.00;
+
+  cout << "originally            x(float)='3.192837465', y(double)='321.192837465', z(double)='123.00'" << endl;
+  cout << fixed << setprecision(9);
+  cout << "after precision loss, x(float)='" << x << "', y(double)='" << y << "', z(double)='" << z << "'" << endl;
+  cout << fixed;
+  float x_result;
+  int idx = round_to_best_precision<float>(x, x_result);
+  cout << setprecision(idx);
+  cout << "After rounding to " << idx << "th decimal digit, result x='" << x_result << "'" << endl;
+  double y_result;
+  idx = round_to_best_precision<double>(y, y_result);
+  cout << setprecision(idx);
+  cout << "After rounding to " << idx << "th decimal digit, result y='" << y_result << "'" << endl;
+  double z_result;
+  idx = round_to_best_precision<double>(z, z_result);
+  cout << setprecision(idx);
+  cout << "After rounding to " << idx << "th decimal digit, result y='" << z_result << "'" << endl;
+}
+
+#endif
+#ifdef Also_Run_Compile_Test
+
+void compile_test(void){
+  const char* expressions[] = {
+    "1+2*(3+4*(5+6*7+1))*(8+9)",
+    "12345+67890",
+    "12+34*(56+78*2)*(1+2)",
+    "12.+13.45*(23.56+47.8*2)",
+  };
+  const int kRepeat = 1000000;
+  Calculator<double> calculator;
+
+  for (const char* expression : expressions) {
+    // not optimized, or these all-constant expressions would be folded into one constant.
+    CompiledExpression<double> plan = calculator.Compile(expression, false);
+    double expected = calculator.Calculate(expression);
+    double got = calculator.Execute(plan);
+    cout << expression << " : Calculate()=" << expected << ", Execute()=" << got
+      << ((expected == got)? " (same)" : " (MISMATCH)") << endl;
+
+    // time the 2 ways of evaluating the same expression many times.
+    // "sum" is printed out so the compiler cannot optimize the loops away.
+    double sum = 0;
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < kRepeat / 100; i++) sum += calculator.Calculate(expression);
+    auto middle = chrono::steady_clock::now();
+    for (int i = 0; i < kRepeat; i++) sum += calculator.Execute(plan);
+    auto end = chrono::steady_clock::now();
+    double ns_calculate = chrono::duration<double, nano>(middle - start).count() / (kRepeat / 100);
+    double ns_execute = chrono::duration<double, nano>(end - middle).count() / kRepeat;
+    cout << "  ns per evaluation : Calculate()=" << ns_calculate << ", Execute()=" << ns_execute
+      << " (sum=" << sum << ")" << endl;
+  }
+}
+
+#endif
+
+#ifdef Also_Run_Batch_Test
+
+template <typename T>
+void batch_test(void){
+  const size_t kRows = 1000000;
+  Calculator<T> calculator;
+  CompiledExpression<T> plan = calculator.Compile("price*qty+fee*(qty-1)/2");
+
+  // build the columns with some made-up data.
+  map<string, vector<T>> columns;
+  for (size_t i = 0; i < kRows; i++) {
+    columns["price"].push_back((T)(i % 1000) / 8);
+    columns["qty"].push_back((T)(i % 37 + 1));
+    columns["fee"].push_back((T)(i % 5) / 4);
+  }
+
+  vector<T> out;
+  auto start = chrono::steady_clock::now();
+  BindStatus bound = calculator.ExecuteBatch(plan, columns, out);
+  auto end = chrono::steady_clock::now();
+  if (!bound.Ok()) {
+    char text[kMaxFormattedLength];
+    cout << string_view(text, FormatError(bound, text, sizeof(text))) << endl;
+    return;
+  }
+
+  // compare with Execute() row by row.
+  size_t mismatch = 0;
+  T values[3];
+  for (size_t i = 0; i < kRows; i++) {
+    for (size_t v = 0; v < plan.variables.size(); v++) values[v] = columns[plan.variables[v]][i];
+    if (calculator.Execute(plan, values) != out[i]) mismatch++;
+  }
+  cout << (sizeof(T) == sizeof(float)? "float " : "double") << " : " << kRows << " rows in "
+    << chrono::duration<double, milli>(end - start).count() << " ms, mismatch with Execute()="
+    << mismatch << endl;
+
+  // a missing column, or one of another length, is given back to the caller.
+  map<string, vector<T>> missing = {{"price", {1, 2}}, {"qty", {3, 4}}};
+  map<string, vector<T>> uneven = {{"price", {1, 2}}, {"qty", {3}}, {"fee", {5, 6}}};
+  char text[kMaxFormattedLength];
+  for (const map<string, vector<T>>* bad : {&missing, &uneven}) {
+    BindStatus status = calculator.ExecuteBatch(plan, *bad, out);
+    cout << string_view(text, FormatError(status, text, sizeof(text)))
+      << (!status.Ok() && out.size() == kRows? " (OK)" : " (FAILED)") << endl;
+  }
+}
+
+#endif
+
+#ifdef Also_Run_Simd_Test
+
+template <typename T>
+void simd_test(void){
+  const size_t kRows = 4000000 + 3;   // not a multiple of any SIMD width, to test the left values too.
+  const int kRepeat = 10;
+  const char* level_names[] = {"scalar", "SSE", "AVX", "AVX2"};
+  Calculator<T> calculator;
+  CompiledExpression<T> plan = calculator.Compile("(a+b)*(a-b)/(b+3)-a*0.5");
+
+  vector<T> a(kRows), b(kRows);
+  for (size_t i = 0; i < kRows; i++) {
+    a[i] = (T)((i * 7919) % 10007) / 13;
+    b[i] = (T)((i * 104729) % 1009) / 7 - 50;
+  }
+  vector<const T*> columns = {a.data(), b.data()};
+
+  vector<T> expected(kRows), out(kRows);
+  calculator.SetSimdLevel(SimdLevel::kScalar);
+  calculator.ExecuteBatch(plan, columns, kRows, expected.data());
+
+  for (int level = (int)SimdLevel::kScalar; level <= (int)DetectSimdLevel(); level++) {
+    calculator.SetSimdLevel((SimdLevel)level);
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < kRepeat; i++) calculator.ExecuteBatch(plan, columns, kRows, out.data());
+    auto end = chrono::steady_clock::now();
+    double seconds = chrono::duration<double>(end - start).count() / kRepeat;
+    // bytes moved : 2 input columns and 1 output column.
+    double gb_per_second = 3.0 * kRows * sizeof(T) / seconds / 1e9;
+    cout << (sizeof(T) == sizeof(float)? "float " : "double") << " " << level_names[level] << " : "
+      << kRows / seconds / 1e6 << " M rows/s, " << gb_per_second << " GB/s, "
+      << (memcmp(out.data(), expected.data(), kRows * sizeof(T)) == 0? "same as scalar" : "MISMATCH with scalar")
+      << endl;
+  }
+}
+
+#endif
+
+#ifdef Also_Run_Parallel_Test
+
+void parallel_test(void){
+  // many independent expressions.
+  const size_t kExpressions = 2000000;
+  vector<string> expressions;
+  for (size_t i = 0; i < kExpressions; i++)
+    expressions.push_back(to_string(i % 997) + "+" + to_string(i % 13) + "*(" + to_string(i % 101) + ".5-3)/7");
+  // one expression over big columns.
+  const size_t kRows = 20000000;
+  Calculator<double> calculator;
+  CompiledExpression<double> plan = calculator.Compile("(a+b)*(a-b)/(b+3)");
+  vector<double> a(kRows), b(kRows), out(kRows);
+  for (size_t i = 0; i < kRows; i++) {
+    a[i] = (double)(i % 10007) / 13;
+    b[i] = (double)(i % 1009) / 7;
+  }
+  vector<const double*> columns = {a.data(), b.data()};
+
+  vector<double> expected;
+  vector<double> expected_out(kRows);
+  double base_expressions = 0, base_rows = 0;
+  int max_threads = max(1u, thread::hardware_concurrency());
+  for (int threads = 1; threads <= max_threads; threads = (threads * 2 > max_threads && threads < max_threads)? max_threads : threads * 2) {
+    ThreadPool pool(threads);
+    vector<double> results;
+    auto start = chrono::steady_clock::now();
+    CalculateInParallel(pool, expressions, results);
+    auto middle = chrono::steady_clock::now();
+    ExecuteBatchInParallel(pool, plan, columns, kRows, out.data());
+    auto end = chrono::steady_clock::now();
+
+    double seconds_expressions = chrono::duration<double>(middle - start).count();
+    double seconds_rows = chrono::duration<double>(end - middle).count();
+    if (threads == 1) {
+      expected = results;
+      expected_out = out;
+      base_expressions = seconds_expressions;
+      base_rows = seconds_rows;
+    }
+    cout << threads << " threads : " << kExpressions / seconds_expressions / 1e6 << " M expressions/s (x"
+      << base_expressions / seconds_expressions << "), " << kRows / seconds_rows / 1e6 << " M rows/s (x"
+      << base_rows / seconds_rows << "), "
+      << ((results == expected && out == expected_out)? "same as 1 thread" : "MISMATCH with 1 thread") << endl;
+  }
+}
+
+#endif
+
+#ifdef Also_Run_Lexer_Test
+
+// The way the tokenizer used to read a number : feed it to a stringstream char by char, then let
+// "ss >> value" convert it.
+template <typename T>
+T StringstreamNumber(stringstream& ss, const string& literal) {
+  for (char ch : literal) ss << ch;
+  T value = 0;
+  ss >> value;
+  ss.str(""); // make ss.str().length() = 0.
+  // NOTICE "ss.clear()" is MUST here !!
+  // after ss >> value, ss will get its "eof" and "fail" state set, so any followed "ss << xxx"
+  // won't take effect any more. ss.clear() is used to clear the "eof" and possible "bad" or "fail" states.
+  ss.clear();
+  return value;
+}
+
+template <typename T>
+void lexer_test(void){
+  const size_t kNumbers = 1000000;
+  // integers, short decimals, decimals with more digits than T can hold, and exponents.
+  vector<string> literals;
+  for (size_t i = 0; i < kNumbers; i++) {
+    switch (i % 4) {
+      case 0:
+        literals.push_back(to_string(i * 7919 % 100000));
+        break;
+      case 1:
+        literals.push_back(to_string(i % 1000) + "." + to_string(i * 104729 % 1000));
+        break;
+      case 2:
+        literals.push_back("0." + to_string(i * 2654435761ULL % 100000000000000000ULL));
+        break;
+      default:
+        literals.push_back(to_string(i % 97) + "." + to_string(i % 13) + "e" + ((i % 8 == 3)? "-" : "+")
+                           + to_string(i % 40));
+        break;
+    }
+  }
+
+  // ParseNumber() must give bit-for-bit the same value as strtod()/strtof(), which round correctly.
+  size_t mismatches = 0;
+  for (const string& literal : literals) {
+    size_t pos = 0;
+    T value = ParseNumber<T>(literal, pos);
+    T expected = is_same<T, float>::value? strtof(literal.c_str(), nullptr) : strtod(literal.c_str(), nullptr);
+    if (pos != literal.size() || memcmp(&value, &expected, sizeof(T)) != 0) mismatches++;
+  }
+
+  T sum = 0;  // use the values, so the compiler can't skip the loops.
+  auto start = chrono::steady_clock::now();
+  for (const string& literal : literals) {
+    size_t pos = 0;
+    sum += ParseNumber<T>(literal, pos);
+  }
+  auto middle = chrono::steady_clock::now();
+  stringstream ss;
+  for (const string& literal : literals) sum += StringstreamNumber<T>(ss, literal);
+  auto end = chrono::steady_clock::now();
+
+  double seconds_lexer = chrono::duration<double>(middle - start).count();
+  double seconds_stream = chrono::duration<double>(end - middle).count();
+  cout << (sizeof(T) == sizeof(float)? "float " : "double") << " : ParseNumber()=" << kNumbers / seconds_lexer / 1e6
+    << " M numbers/s, stringstream=" << kNumbers / seconds_stream / 1e6 << " M numbers/s (x"
+    << seconds_stream / seconds_lexer << "), mismatch with strto" << (sizeof(T) == sizeof(float)? "f" : "d")
+    << "()=" << mismatches << " (sum=" << sum << ")" << endl;
+}
+
+#endif
+
+#ifdef Also_Run_Trace_Test
+
+// A stream buffer which throws the output away, but counts how many times it is called and how
+// many chars it gets, so we can tell how much I/O the trace does.
+class CountingBuffer : public streambuf {
+public:
+  size_t calls = 0;
+  size_t chars = 0;
+
+protected:
+  int overflow(int ch) override {
+    calls++;
+    chars++;
+    return ch;
+  }
+  streamsize xsputn(const char*, streamsize n) override {
+    calls++;
+    chars += n;
+    return n;
+  }
+};
+
+template <int TraceLevel>
+void trace_level_test(const char* name, const string& expression, int repeat) {
+  CountingBuffer buffer;
+  ostream sink(&buffer);
+  Calculator<double, TraceLevel> calculator;
+  calculator.SetTraceSink(sink);
+
+  double sum = 0;
+  auto start = chrono::steady_clock::now();
+  for (int i = 0; i < repeat; i++) sum += calculator.Calculate(expression);
+  auto end = chrono::steady_clock::now();
+  double ns = chrono::duration<double, nano>(end - start).count() / repeat;
+  cout << name << " : " << ns << " ns per Calculate(), " << (double)buffer.calls / repeat << " I/O calls and "
+    << (double)buffer.chars / repeat << " chars of trace per Calculate() (sum=" << sum << ")" << endl;
+}
+
+void trace_test(void){
+  const string expression = "1+2*(3+4*(5+6*7+1))*(8+9)";
+  const int kRepeat = 200000;
+  cout << expression << " (" << expression.size() << " chars)" << endl;
+  trace_level_test<kTraceOff>("kTraceOff   ", expression, kRepeat);
+  trace_level_test<kTraceTokens>("kTraceTokens", expression, kRepeat);
+  trace_level_test<kTraceStack>("kTraceStack ", expression, kRepeat);
+}
+
+#endif
+
+#if defined(Also_Run_Allocation_Test) || defined(Also_Run_Benchmark)
+
+// every heap allocation of the program goes through here, so we can count them. The whole set is
+// replaced, arrays, nothrow, sized and aligned forms too, so that whatever new gives, the matching
+// delete takes back. They are not inlined, or gcc sees free() on what it knows as new's pointer.
+static size_t allocations = 0;
+
+__attribute__((noinline)) static void* CountedAllocate(size_t size, size_t alignment) {
+  allocations++;
+  size = size > 0? size : 1;
+  if (alignment <= alignof(max_align_t)) return malloc(size);
+  return aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+}
+__attribute__((noinline)) static void CountedFree(void* p) { free(p); }
+
+void* operator new(size_t size) {
+  void* p = CountedAllocate(size, 0);
+  if (!p) throw bad_alloc();
+  return p;
+}
+void* operator new[](size_t size) { return operator new(size); }
+void* operator new(size_t size, const nothrow_t&) noexcept { return CountedAllocate(size, 0); }
+void* operator new[](size_t size, const nothrow_t&) noexcept { return CountedAllocate(size, 0); }
+void* operator new(size_t size, align_val_t alignment) {
+  void* p = CountedAllocate(size, (size_t)alignment);
+  if (!p) throw bad_alloc();
+  return p;
+}
+void* operator new[](size_t size, align_val_t alignment) { return operator new(size, alignment); }
+void* operator new(size_t size, align_val_t alignment, const nothrow_t&) noexcept {
+  return CountedAllocate(size, (size_t)alignment);
+}
+void* operator new[](size_t size, align_val_t alignment, const nothrow_t&) noexcept {
+  return CountedAllocate(size, (size_t)alignment);
+}
+
+void operator delete(void* p) noexcept { CountedFree(p); }
+void operator delete[](void* p) noexcept { CountedFree(p); }
+void operator delete(void* p, size_t) noexcept { CountedFree(p); }
+void operator delete[](void* p, size_t) noexcept { CountedFree(p); }
+void operator delete(void* p, const nothrow_t&) noexcept { CountedFree(p); }
+void operator delete[](void* p, const nothrow_t&) noexcept { CountedFree(p); }
+void operator delete(void* p, align_val_t) noexcept { CountedFree(p); }
+void operator delete[](void* p, align_val_t) noexcept { CountedFree(p); }
+void operator delete(void* p, size_t, align_val_t) noexcept { CountedFree(p); }
+void operator delete[](void* p, size_t, align_val_t) noexcept { CountedFree(p); }
+void operator delete(void* p, align_val_t, const nothrow_t&) noexcept { CountedFree(p); }
+void operator delete[](void* p, align_val_t, const nothrow_t&) noexcept { CountedFree(p); }
+
+#endif
+
+#ifdef Also_Run_Allocation_Test
+
+void allocation_test(void){
+  const int kRepeat = 10000;
+  const vector<string> expressions = {
+    "1+2*(3+4*(5+6*7+1))*(8+9)",
+    "12345+67890",
+    "((((((((1+2)*3)-4)/5)+6)*7)-8)/9)",
+    "1.5e-3*price+qty2*(_fee-0.25)",
+    // malformed ones are reported without any allocation either.
+    "1+2*(3+4*(5+6*7+1)*(8+9)",
+    "max(1)+foo(2)",
+  };
+  Calculator<double> calculator;
+
+  // warm up : the stacks grow to what the biggest expression needs, and stay.
+  for (const string& expression : expressions) calculator.Calculate(expression);
+  size_t before = allocations;
+  double sum = 0;
+  for (int i = 0; i < kRepeat; i++)
+    for (const string& expression : expressions) sum += calculator.Calculate(expression);
+  size_t calculate_allocations = allocations - before;
+
+  CompiledExpression<double> plan = calculator.Compile("(a+b)*(a-b)/(b+3)");
+  vector<double> a(10000, 1.5), b(10000, 2.5), out(10000);
+  vector<const double*> columns = {a.data(), b.data()};
+  double values[] = {1.5, 2.5};
+  calculator.Execute(plan, values);
+  calculator.ExecuteBatch(plan, columns, a.size(), out.data());
+  before = allocations;
+  for (int i = 0; i < kRepeat; i++) sum += calculator.Execute(plan, values);
+  for (int i = 0; i < 10; i++) calculator.ExecuteBatch(plan, columns, a.size(), out.data());
+  size_t execute_allocations = allocations - before;
+
+  cout << "allocations after warm up : Calculate()=" << calculate_allocations << ", Execute()/ExecuteBatch()="
+    << execute_allocations << ((calculate_allocations + execute_allocations == 0)? " (OK)" : " (FAILED)")
+    << " (sum=" << sum << ")" << endl;
+
+  // a malformed expression must not leave anything on the stacks for the next one.
+  calculator.Calculate("1a");
+  calculator.Calculate("(1+2");
+  double result = calculator.Calculate("1+2");
+  cout << "1+2 after malformed expressions = " << result << ((result == 3)? " (OK)" : " (FAILED)") << endl;
+}
+
+#endif
+
+#ifdef Also_Run_Optimize_Test
+
+void optimize_test(void){
+  // formulas with constant parts next to the variable parts, as they come from configurations.
+  const vector<string> corpus = {
+    "price*qty*(1+8/100)",
+    "price*(3+4*(5+6*7+1))-fee",
+    "(a+b)*(a-b)/(b+3)",
+    "x*1+y*0+z/1-0",
+    "1*rate*(365/360)+0",
+    "(base+12*30)*(1-15/100)/(24*60*60)",
+    "a/(1+1)+b*(2*3.5)-c*(10-9)",
+    "total*(0.5+0.25)+(100-100)*bonus",
+  };
+  const int kRepeat = 1000000;
+  Calculator<double> calculator;
+  double values[] = {12.5, 3, 0.75, 4, 9};   // more than any expression above needs.
+
+  size_t before_total = 0, after_total = 0;
+  for (const string& expression : corpus) {
+    CompiledExpression<double> plain = calculator.Compile(expression, false);
+    CompiledExpression<double> optimized = calculator.Compile(expression);
+    before_total += plain.code.size();
+    after_total += optimized.code.size();
+
+    double expected = calculator.Execute(plain, values);
+    double got = calculator.Execute(optimized, values);
+
+    double sum = 0;
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < kRepeat; i++) sum += calculator.Execute(plain, values);
+    auto middle = chrono::steady_clock::now();
+    for (int i = 0; i < kRepeat; i++) sum += calculator.Execute(optimized, values);
+    auto end = chrono::steady_clock::now();
+    double ns_plain = chrono::duration<double, nano>(middle - start).count() / kRepeat;
+    double ns_optimized = chrono::duration<double, nano>(end - middle).count() / kRepeat;
+
+    cout << expression << " : instructions " << plain.code.size() << " => " << optimized.code.size()
+      << ", ns per Execute() " << ns_plain << " => " << ns_optimized
+      << ((expected == got)? " (same)" : " (MISMATCH)") << " (sum=" << sum << ")" << endl;
+  }
+  cout << "corpus : instructions " << before_total << " => " << after_total << " ("
+    << 100.0 * (before_total - after_total) / before_total << "% removed)" << endl;
+}
+
+#endif
+
+#ifdef Also_Run_Cache_Test
+
+void cache_test(void){
+  // 2000 different expressions, each written with and without spaces, coming in a random order.
+  const size_t kDistinct = 2000;
+  const size_t kRequests = 2000000;
+  vector<string> distinct;
+  for (size_t i = 0; i < kDistinct; i++)
+    distinct.push_back(to_string(i) + "+" + to_string(i % 13) + "*(" + to_string(i % 101) + ".5-3*(2+" + to_string(i % 7) + "))/7");
+  vector<string> requests;
+  size_t seed = 12345;
+  for (size_t i = 0; i < kRequests; i++) {
+    seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    const string& expression = distinct[(seed >> 33) % kDistinct];
+    if (i % 2 == 0) {
+      requests.push_back(expression);
+    } else {
+      // spaces around the operators and parentheses, where they don't change the tokens.
+      string spaced;
+      for (char ch : expression) {
+        if (isdigit((unsigned char)ch) || ch == '.') {
+          spaced += ch;
+        } else {
+          ((spaced += ' ') += ch) += ' ';
+        }
+      }
+      requests.push_back(spaced);
+    }
+  }
+
+  Calculator<double> plain;
+  vector<double> expected(kRequests);
+  auto start = chrono::steady_clock::now();
+  for (size_t i = 0; i < kRequests; i++) expected[i] = plain.Calculate(requests[i]);
+  auto end = chrono::steady_clock::now();
+  double ns_plain = chrono::duration<double, nano>(end - start).count() / kRequests;
+
+  // spaces inside an expression : with or without cache, the same result or the same error at the
+  // same place, whatever was cached before under a key close to it.
+  const char* spacings[] = {"23", "2 3", "12", "1 2", "1 +", "1+", "12 +3", "1e-3", "1e -3", "1e- 3", "1 e-3",
+                            "max (1, 2)", "x y", "xy", "\t4 * ( 2 + 1 )\n", "7 . 5", "7.5"};
+  ResultCache<double> spacing_cache(1 << 20);
+  Calculator<double> spacing_cached;
+  spacing_cached.SetResultCache(&spacing_cache);
+  size_t differences = 0;
+  for (int round = 0; round < 2; round++) {
+    for (const char* expression : spacings) {
+      CalcResult<double> with = spacing_cached.TryCalculate(expression), without = plain.TryCalculate(expression);
+      bool same = with.status.error == without.status.error && with.status.position == without.status.position &&
+                  (memcmp(&with.value, &without.value, sizeof(double)) == 0 || (isnan(with.value) && isnan(without.value)));
+      if (!same) {
+        differences++;
+        cout << "\"" << expression << "\" : " << with.value << " with cache, " << without.value << " without" << endl;
+      }
+    }
+  }
+  cout << "expressions with spaces inside : " << differences << " differences with cache"
+       << (differences == 0? " (OK)" : " (FAILED)") << endl;
+
+  // a budget big enough for all, and one for about a quarter of them.
+  for (size_t budget : {size_t(1) << 20, size_t(64) << 10}) {
+    ResultCache<double> cache(budget);
+    Calculator<double> cached;
+    cached.SetResultCache(&cache);
+    size_t mismatches = 0;
+    start = chrono::steady_clock::now();
+    for (size_t i = 0; i < kRequests; i++)
+      if (cached.Calculate(requests[i]) != expected[i]) mismatches++;
+    end = chrono::steady_clock::now();
+    double ns_cached = chrono::duration<double, nano>(end - start).count() / kRequests;
+    cout << "budget " << (budget >> 10) << " KB : " << ns_cached << " ns per Calculate() (x" << ns_plain / ns_cached
+      << " of " << ns_plain << " ns without cache), hits=" << cache.Hits() << ", misses=" << cache.Misses()
+      << ", evictions=" << cache.Evictions() << ", bytes=" << cache.Bytes() << ", mismatches=" << mismatches << endl;
+  }
+
+  // one cache shared by all the threads.
+  int max_threads = max(1u, thread::hardware_concurrency());
+  for (int threads = 1; ; threads = max_threads) {
+    ThreadPool pool(threads);
+    ResultCache<double> cache(1 << 20, 4 * pool.Size());
+    vector<double> results;
+    start = chrono::steady_clock::now();
+    CalculateInParallel(pool, requests, results, &cache);
+    end = chrono::steady_clock::now();
+    cout << threads << " threads : " << kRequests / chrono::duration<double>(end - start).count() / 1e6
+      << " M expressions/s, hits=" << cache.Hits() << ", misses=" << cache.Misses() << ", "
+      << ((results == expected)? "same as without cache" : "MISMATCH without cache") << endl;
+    if (threads == max_threads) break;
+  }
+}
+
+#endif
+
+#ifdef Also_Run_Format_Test
+
+// The way results used to be formatted : round with pow() and floor() for 0, 1, 2 ... digits until
+// it's close enough, then print with fixed and setprecision, and set the stream back.
+// (with the abs() of the sum, as BestPrecision() has, or negative values always get 0 digits.)
+template <typename T>
+void StreamFormat(T value, ostringstream& os) {
+  int digits = 0;
+  T rounded = value;
+  if (value != 0 && isfinite(value)) {
+    while (1) {
+      rounded = floor(value * pow(10, digits) + 0.5) / pow(10, digits);
+      T difference = value - rounded;
+      if (difference < 0) difference = 0 - difference;
+      T sum = value + rounded;
+      if (sum < 0) sum = 0 - sum;
+      if ((difference * 2 / sum) < 1e-6) break;
+      digits++;
+    }
+  }
+  os << fixed << setprecision(digits);
+  os << rounded;
+  os << setprecision(6);
+  os.unsetf(ios::fixed);
+}
+
+template <typename T>
+void format_test(void){
+  const size_t kValues = 1000000;
+  // results as they come out of expressions : integers, money, ratios, big and tiny values.
+  vector<T> values;
+  for (size_t i = 0; i < kValues; i++) {
+    T value;
+    switch (i % 5) {
+      case 0: value = (T)(i * 7919 % 100000); break;
+      case 1: value = (T)(i % 100000) / 100; break;
+      case 2: value = (T)(i % 997) / 7; break;
+      case 3: value = (T)(i % 1013) * (T)1e9 / 3; break;
+      default: value = (T)(i % 89) / (T)1e7; break;
+    }
+    values.push_back((i % 3 == 0)? -value : value);
+  }
+
+  // same text from both ways.
+  size_t mismatches = 0;
+  ostringstream os;
+  char buffer[kMaxFormattedLength];
+  for (T value : values) {
+    os.str("");
+    StreamFormat(value, os);
+    size_t length = FormatBestPrecision(value, buffer, sizeof(buffer));
+    if (os.str() != string(buffer, length)) mismatches++;
+  }
+
+  size_t chars = 0;   // use the text, so the compiler can't skip the loops.
+  auto start = chrono::steady_clock::now();
+  for (T value : values) chars += FormatBestPrecision(value, buffer, sizeof(buffer));
+  auto middle = chrono::steady_clock::now();
+  for (T value : values) {
+    os.str("");
+    StreamFormat(value, os);
+    chars += os.str().size();
+  }
+  auto end = chrono::steady_clock::now();
+
+  double seconds_new = chrono::duration<double>(middle - start).count();
+  double seconds_old = chrono::duration<double>(end - middle).count();
+  cout << (sizeof(T) == sizeof(float)? "float " : "double") << " : FormatBestPrecision()=" << kValues / seconds_new / 1e6
+    << " M values/s, pow/floor loop + stream=" << kValues / seconds_old / 1e6 << " M values/s (x"
+    << seconds_old / seconds_new << "), mismatch=" << mismatches << " (chars=" << chars << ")" << endl;
+}
+
+#endif
+
+#ifdef Also_Run_Decimal_Test
+
+template <typename T>
+string FormatResult(T value) {
+  char text[kMaxFormattedLength];
+  return string(text, FormatBestPrecision(value, text, sizeof(text)));
+}
+
+// time Calculate(), Execute() and ExecuteBatch() of Calculator<T> on "corpus".
+template <typename T>
+void decimal_speed_test(const char* name, const vector<string>& corpus) {
+  const int kRepeat = 20000;
+  const size_t kRows = 1000000;
+  Calculator<T> calculator;
+  T sum = 0;
+
+  auto start = chrono::steady_clock::now();
+  for (int i = 0; i < kRepeat; i++)
+    for (const string& expression : corpus) sum = sum + calculator.Calculate(expression);
+  auto end = chrono::steady_clock::now();
+  double calculate_per_second = kRepeat * corpus.size() / chrono::duration<double>(end - start).count();
+
+  vector<CompiledExpression<T>> plans;
+  for (const string& expression : corpus) plans.push_back(calculator.Compile(expression));
+  start = chrono::steady_clock::now();
+  for (int i = 0; i < kRepeat * 10; i++)
+    for (const CompiledExpression<T>& plan : plans) sum = sum + calculator.Execute(plan);
+  end = chrono::steady_clock::now();
+  double execute_per_second = kRepeat * 10 * plans.size() / chrono::duration<double>(end - start).count();
+
+  CompiledExpression<T> plan = calculator.Compile("price*qty*(1+tax/100)-discount");
+  vector<T> price(kRows), qty(kRows), tax(kRows), discount(kRows), out(kRows);
+  for (size_t i = 0; i < kRows; i++) {
+    price[i] = T((long long)(i % 10000)) / T(100);   // 0.00 .. 99.99
+    qty[i] = T((long long)(i % 7 + 1));
+    tax[i] = T((long long)(i % 3 * 5));
+    discount[i] = T((long long)(i % 50)) / T(10);
+  }
+  vector<const T*> columns;
+  for (const string& variable : plan.variables) {
+    columns.push_back((variable == "price")? price.data() : (variable == "qty")? qty.data() :
+                      (variable == "tax")? tax.data() : discount.data());
+  }
+  start = chrono::steady_clock::now();
+  calculator.ExecuteBatch(plan, columns, kRows, out.data());
+  end = chrono::steady_clock::now();
+  double rows_per_second = kRows / chrono::duration<double>(end - start).count();
+
+  cout << name << " : Calculate()=" << calculate_per_second / 1e6 << " M/s, Execute()=" << execute_per_second / 1e6
+    << " M/s, ExecuteBatch()=" << rows_per_second / 1e6 << " M rows/s (sum=" << FormatResult(sum) << ")" << endl;
+}
+
+void decimal_test(void){
+  struct Case {
+    const char* expression;
+    const char* expected;
+  };
+  const Case cases[] = {
+    {"0.1+0.2", "0.3"},
+    {"19.99*3-59.97", "0"},
+    {"1/3", "0.333333333333333333"},
+    {"2/3", "0.666666666666666667"},
+    {"1.5e-3*2", "0.003"},
+    {"100/8", "12.5"},
+    {"1/0", "inf"},
+    {"0/0", "nan"},
+    // over 128 bits, and back.
+    {"12345678901234567890123456789*98765432109876543210", "1219326311370217952249657064223746380111126352690"},
+    {"12345678901234567890123456789*98765432109876543210/7", "174189473052888278892808152031963768587303764670"},
+    {"12345678901234567890123456789*98765432109876543210-12345678901234567890123456789*98765432109876543210+1.5", "1.5"},
+    {"123456789012345678901234567890123456789012345+0.000001", "123456789012345678901234567890123456789012345.000001"},
+  };
+  Calculator<Decimal> calculator;
+  int failed = 0;
+  for (const Case& test : cases) {
+    string got = FormatResult(calculator.Calculate(test.expression));
+    bool ok = (got == test.expected);
+    if (!ok) failed++;
+    cout << test.expression << " = " << got << (ok? "" : string(" (FAILED, expecting ") + test.expected + ")") << endl;
+  }
+
+  // add 0.1 a million times.
+  CompiledExpression<Decimal> decimal_plan = calculator.Compile("total+0.1");
+  Calculator<double> double_calculator;
+  CompiledExpression<double> double_plan = double_calculator.Compile("total+0.1");
+  Decimal decimal_total = 0;
+  double double_total = 0;
+  for (int i = 0; i < 1000000; i++) {
+    decimal_total = calculator.Execute(decimal_plan, &decimal_total);
+    double_total = double_calculator.Execute(double_plan, &double_total);
+  }
+  cout << "0.1 added 1000000 times : Decimal=" << decimal_total << ", double=" << setprecision(17) << double_total
+    << setprecision(6) << endl;
+  cout << ((failed == 0 && decimal_total == Decimal(100000))? "all exact (OK)" : "NOT EXACT (FAILED)") << endl;
+
+  const vector<string> corpus = {
+    "19.99*3+4.50",
+    "1250.00*(1+0.05)-100",
+    "(10.25+0.75)*(3-1.5)/4",
+    "12345.67+89012.34-5678.90",
+    "99.95*12/100",
+  };
+  decimal_speed_test<double>("double ", corpus);
+  decimal_speed_test<Decimal>("Decimal", corpus);
+}
+
+#endif
+
+#ifdef Also_Run_Jit_Test
+
+// A random expression over the variables a, b, c, d and small constants, "depth" levels deep at most.
+static string RandomExpression(uint32_t& seed, int depth) {
+  auto next = [&seed](uint32_t n) { seed = seed * 1664525 + 1013904223; return (seed >> 8) % n; };
+  if (depth == 0 || next(4) == 0) {
+    if (next(2) == 0) return string(1, (char)('a' + next(4)));
+    return to_string(next(100)) + (next(2) == 0? "" : "." + to_string(next(1000)));
+  }
+  string left = RandomExpression(seed, depth - 1);
+  string right = RandomExpression(seed, depth - 1);
+  return "(" + left + "+-*/"[next(4)] + right + ")";
+}
+
+template <typename T>
+void jit_test(void){
+  const char* name = sizeof(T) == sizeof(float)? "float " : "double";
+  const int kExpressions = 2000;
+  const size_t kRows = 1000 + 3;   // not a multiple of the SIMD width, to test the left rows too.
+  Calculator<T> calculator;
+
+  vector<vector<T>> data(4, vector<T>(kRows));
+  for (size_t i = 0; i < kRows; i++) {
+    data[0][i] = (T)((i * 7919) % 10007) / 13;
+    data[1][i] = (T)((i * 104729) % 1009) / 7 - 50;
+    data[2][i] = (T)(i % 17) - 8;   // has zeros, for the divisions by zero.
+    data[3][i] = (T)1 / (T)(i + 1);
+  }
+
+  // every random expression : native code against the interpreter, bit for bit.
+  uint32_t seed = 12345;
+  int compiled = 0, interpreted = 0;
+  size_t scalar_mismatch = 0, batch_mismatch = 0;
+  vector<T> expected(kRows), out(kRows);
+  for (int e = 0; e < kExpressions; e++) {
+    CompiledExpression<T> plan = calculator.Compile(RandomExpression(seed, 1 + e % 6), false);
+    unique_ptr<JitFunction<T>> native = JitFunction<T>::Compile(plan);
+    if (!native) {
+      interpreted++;
+      continue;
+    }
+    compiled++;
+
+    vector<const T*> columns;
+    for (const string& variable : plan.variables) columns.push_back(data[variable[0] - 'a'].data());
+    vector<T> values(plan.variables.size());
+    for (size_t row = 0; row < kRows; row++) {
+      for (size_t v = 0; v < columns.size(); v++) values[v] = columns[v][row];
+      T want = calculator.Execute(plan, values.data());
+      T got = (*native)(values.data());
+      if (memcmp(&want, &got, sizeof(T)) != 0) scalar_mismatch++;
+    }
+    calculator.ExecuteBatch(plan, columns, kRows, expected.data());
+    native->Batch(columns.data(), kRows, out.data());
+    if (memcmp(out.data(), expected.data(), kRows * sizeof(T)) != 0) batch_mismatch++;
+  }
+  cout << name << " : " << kExpressions << " random expressions, " << compiled << " compiled, " << interpreted
+    << " left to the interpreter, mismatch : scalar=" << scalar_mismatch << " batch=" << batch_mismatch << endl;
+
+  // too deep for the registers : stays on the interpreter.
+  string deep = "a";
+  for (int i = 0; i < 20; i++) deep = "(" + to_string(i) + "+" + deep + ")";
+  TieredExpression<T> deep_expression(calculator.Compile(deep, false), 0);
+  T a = 2;
+  cout << name << " : 21 deep expression " << (deep_expression.IsNative()? "NATIVE (FAILED)" : "interpreted (OK)")
+    << ", result " << calculator.Execute(deep_expression, &a) << " (expecting 192)" << endl;
+  // refused at the threshold : stays on the interpreter, with the right results.
+  TieredExpression<T> refused(calculator.Compile(deep, false), 10);
+  int wrong = 0;
+  for (int i = 0; i < 100; i++) wrong += calculator.Execute(refused, &a) != 192;
+  cout << name << " : refused after 10 executions " << (refused.IsNative()? "NATIVE (FAILED)" : "interpreted (OK)")
+    << ", wrong results " << wrong << " of 100" << endl;
 
-  // Modifiers only affect fpt numbers : "std::setprecision()", "std::fixed", "std::scientific".
-  // Have persistent effect : ALL. 
-  //
-  // ----- Console output of the following code ----
-  //  Test 1 : c++ Modifiers affacting fpt numbers 3.912348239
-  //   <Default             > a(double)=39.1235, b(float)=39.1235
-  //   <fixed, precision=8  > a(double)=39.12348239, b(float)=39.12348175
-  //   <Retest w/o modifiers> a(double)=39.12348239, b(float)=39.12348175
-  //   <scientific, precision=2> a(double)=3.91e+01, b(float)=3.91e+01
-  //   <Retest w/o modifiers   > a(double)=3.91e+01, b(float)=3.91e+01
-  //   <reset back to default  > a(double)=39.1235, b(float)=39.1235
-  //
-  cout << " Test 1 : c++ Modifiers affacting fpt numbers 3.912348239" << endl;
-  cout << "  <Default             > ";
-  cout << "a(double)=" << a << ", b(float)=" << b << endl;
-  cout << "  <fixed, precision=8  > " << fixed << setprecision(8);
-  cout << "a(double)=" << a << ", b(float)=" << b << endl;
-  cout << "  <Retest w/o modifiers> ";
-  cout << "a(double)=" << a << ", b(float)=" << b << endl;
-  cout << "  <scientific, precision=2> "  << scientific << setprecision(2);
-  cout << "a(double)=" << a << ", b(float)=" << b << endl;
-  cout << "  <Retest w/o modifiers   > ";
-  cout << "a(double)=" << a << ", b(float)=" << b << endl;
-  
-  // to reset back to default, Gemini mentioned "ios::defaultfmt", "ios:generic", but they are not 
-  // defined in fact. let's use cout.unsetf() and set presision back to default (6) instead.
-  cout << "  <reset back to default  > ";
-  cout.unsetf(ios::fixed | ios::scientific);  
-  cout << setprecision(6);  // default is 6.
-  cout << "a(double)=" << a << ", b(float)=" << b << endl;
+  // tiering : interpreted until the threshold.
+  const char* hot = "(a+b)*(a-b)/(b+3)-a*0.5";
+  TieredExpression<T> tiered(calculator.Compile(hot), 1000);
+  T ab[] = {(T)3.5, (T)1.25};
+  for (int i = 0; i < 999; i++) calculator.Execute(tiered, ab);
+  bool before = tiered.IsNative();
+  calculator.Execute(tiered, ab);
+  cout << name << " : native after 999 executions=" << before << ", after 1000=" << tiered.IsNative() << endl;
 
-  // notice "std::setprecision", "std::fixed", and "std::scientific" only affect floating-point numbers.
-  //
-  // ----- Console output of the following code ----
-  //  Test 2 : c++ Output integer c -128
-  //   <No modifiers. No effect on integers.> c(int)=-128, c(uint)=4294967168
-  //
-  cout << " Test 2 : c++ Output integer c -128" << endl;
-  int c = -128;
-  cout << "  <No modifiers. No effect on integers.> c(int)=" << c << ", c(uint)=" << (unsigned int)c << endl;
+  // timing, the interpreter against the native code.
+  const int kRepeat = 10000000;
+  const CompiledExpression<T>& plan = tiered.Plan();
+  T sum = 0;
+  auto start = chrono::steady_clock::now();
+  for (int i = 0; i < kRepeat; i++) {
+    ab[0] = (T)(i & 1023);
+    sum += calculator.Execute(plan, ab);
+  }
+  auto middle = chrono::steady_clock::now();
+  for (int i = 0; i < kRepeat; i++) {
+    ab[0] = (T)(i & 1023);
+    sum += calculator.Execute(tiered, ab);
+  }
+  auto end = chrono::steady_clock::now();
+  cout << name << " : ns per execution, interpreter=" << chrono::duration<double, nano>(middle - start).count() / kRepeat
+    << " native=" << chrono::duration<double, nano>(end - middle).count() / kRepeat << " (sum=" << sum << ")" << endl;
 
-  // Modifiers only affect integers : "std::hex","std::dec","std::oct","std::showbase","std::right","std::setw()".
-  // Have persistent effect : "std::hex","std::dec","std::oct","std::showbase","std::right" 
-  // Only effective for once : "std::setw()"
-  //
-  // ----- Console output of the following code ----
-  //  Test 3 : c++ Modifiers affecting integers -128
-  //   <hex, showbase, width=8, right-aligned> c(int)='0xffffff80'
-  //   <Retest w/i width=10                  > c(int)='0xffffff80'
-  //   <Retest w/o modifiers                 > c(int)='0xffffff80'
-  //   <Retest on fpt number. No effect.     > a(double)='39.1235'
-  //
-  cout << " Test 3 : c++ Modifiers affecting integers -128" << endl;
-  cout << "  <hex, showbase, width=8, right-aligned> c(int)='" << hex << showbase << setw(8) << right << c << "'" << endl;
-  cout << "  <Retest w/i width=10                  > c(int)='" << setw(10) << c << "'" << endl;
-  cout << "  <Retest w/o modifiers                 > c(int)='" << c << "'" << endl;
-  cout << "  <Retest on fpt number. No effect.     > a(double)='" << a << "'" << endl;
-  
-  // cout is too lousy to control. That's why we still use c-style printf in c++ for debugging.
-  // by the way, notice to use c-lib in c++ programs, the best practice is to include c-equivalent header
-  // instead of c headers, they imports symbols into namespace "std".
-  // More precisely, The difference is that stdio.h and other C-like libraries when imported in a C++ file 
-  // may pollute the global namespace, while the corresponding C++ headers (cstdio, cstdlib, cassert) place 
-  // the corresponding functions, variables, etc., in the std namespace.
-  // ref link : https://cplusplus.com/reference/cstdio/
-  //
-  // for example, to include stdio.h, we should,
-  //
-  //   #include <cstdio>    // instead of #include <stdio.h>
-  //
-  // However, in this test we didn't include <cstdio>, but printf still works !! 
-  // Need to check whether <iostream> had ever included <cstdio> already.
-  //
-  // ----- Console output of the following code ----
-  //  Test 4 : use c printf still.
-  //   fpt/double with precision 8, width 12 : a(double)=' 39.12348239', b(float)=' 39.12348175'
-  //   int with width 12 : c(int)='        -128', c(uint)='  4294967168', c(in 8 hex digits)='0xffffff80'
-  //
-  printf(" Test 4 : use c printf still.\n");
-  printf("  fpt/double with precision 8, width 12 : a(double)='%12.8f', b(float)='%12.8f'\n", a, b);
-  printf("  int with width 12 : c(int)='%12d', c(uint)='%12u', c(in 8 hex digits)='0x%08x'\n", c, c, c);
+  const size_t kBatchRows = 4000000;
+  vector<T> column_a(kBatchRows), column_b(kBatchRows), batch_out(kBatchRows);
+  for (size_t i = 0; i < kBatchRows; i++) {
+    column_a[i] = (T)((i * 7919) % 10007) / 13;
+    column_b[i] = (T)((i * 104729) % 1009) / 7 - 50;
+  }
+  vector<const T*> columns = {column_a.data(), column_b.data()};
+  start = chrono::steady_clock::now();
+  calculator.ExecuteBatch(plan, columns, kBatchRows, batch_out.data());
+  middle = chrono::steady_clock::now();
+  calculator.ExecuteBatch(tiered, columns, kBatchRows, batch_out.data());
+  end = chrono::steady_clock::now();
+  cout << name << " : M rows/s in batch, interpreter=" << kBatchRows / chrono::duration<double, micro>(middle - start).count()
+    << " native=" << kBatchRows / chrono::duration<double, micro>(end - middle).count() << endl;
 }
+
 #endif
 
-// round routine.
-// round to 1st decimal = multiply by 10, add 0.5 to it, then drop the faction part, and then divide by 10. 
-// the template class T can be float or double.
-//
-// also notice it's recommended to use "template <typename T>" instead of "template <class T>".
-template <class T>
-T round(T value, int decimal_digits) {
-  return floor(value * pow(10, decimal_digits) + 0.5) / pow(10, decimal_digits);
+#ifdef Also_Run_Constexpr_Test
+
+// Constant formulas are fully calculated by the compiler, these fail the build if they're wrong.
+static_assert(calc::compile("12+34*(56+78*2)")() == 12+34*(56+78*2), "constant formula");
+static_assert(calc::compile("1+2*(3+4*(5+6*7+1))*(8+9)").Size() == 1, "folded to one constant");
+static_assert(calc::compile(" (1.5 + 2.25) * 4 ")() == 15, "spaces between tokens");
+static_assert(calc::compile("2.5e3/1e-2")() == 250000, "exponents");
+static_assert(calc::compile("a*(b+1)-a")(2.0, 3.0) == 6, "variables, bound in order");
+static_assert(calc::compile("x*x+x")(3.0) == 12, "a variable used twice");
+static_assert(calc::compile("rate*(365/360)").Variables() == 1, "only rate is a variable");
+static_assert(calc::compile<float>("0.1+0.2")() == 0.1f + 0.2f, "float");
+static constexpr auto kArea = calc::compile("w*h/2");
+static_assert(calc::evaluate<kArea>(3.0, 4.0) == 6, "unrolled evaluation");
+static_assert(calc::compile("-2*-3+max(1,min(4,2))")() == 8, "negation, min and max");
+static_assert(calc::compile("-2*-3+max(1,min(4,2))").Size() == 1, "negation, min and max folded");
+static_assert(calc::compile("-x")(3.0) == -3, "negation of a variable");
+// Each of these fails the build, with MalformedExpression() and the reason in the error :
+//   constexpr auto unbalanced = calc::compile("(1+2");
+//   constexpr auto dangling = calc::compile("1+");
+//   constexpr auto doubled = calc::compile("1+*2");
+//   constexpr auto garbage = calc::compile("2a");
+//   constexpr auto arguments = calc::compile("max(1)");
+//   constexpr auto unknown = calc::compile("foo(2)");
+
+void constexpr_test(void){
+  // the same formulas at run time : the literals and the folding must match Calculate() bit for bit.
+  constexpr auto f1 = calc::compile("12+34*(56+78*2)");
+  constexpr auto f2 = calc::compile("0.1+0.2*0.3-1.7/3");
+  constexpr auto f3 = calc::compile("1234567.891011*3.14159265358979/2.718281828459045");
+  constexpr auto f4 = calc::compile("1e300*1e10/7");
+  constexpr auto f5 = calc::compile("123456789012345678901234567890/0.000000000000000000001");
+  const pair<double, const char*> constants[] = {
+    {f1(), "12+34*(56+78*2)"},
+    {f2(), "0.1+0.2*0.3-1.7/3"},
+    {f3(), "1234567.891011*3.14159265358979/2.718281828459045"},
+    {f4(), "1e300*1e10/7"},
+    {f5(), "123456789012345678901234567890/0.000000000000000000001"},
+  };
+  Calculator<double> calculator;
+  for (const auto& constant : constants) {
+    double expected = calculator.Calculate(constant.second);
+    cout << constant.second << " = " << constant.first
+      << (memcmp(&constant.first, &expected, sizeof(double)) == 0? " (same as Calculate)" : " (MISMATCH with Calculate)") << endl;
+  }
+
+  // with variables : against Execute() of the runtime plan.
+  static constexpr auto price = calc::compile("base*(1+rate/100)*qty+fee*(qty-1)/2");
+  CompiledExpression<double> plan = calculator.Compile("base*(1+rate/100)*qty+fee*(qty-1)/2");
+  const int kRepeat = 10000000;
+  size_t mismatch = 0;
+  double sum = 0;
+  auto start = chrono::steady_clock::now();
+  for (int i = 0; i < kRepeat; i++) sum += price((double)(i & 1023), 8.5, (double)(i & 7), 2.0);
+  auto unrolled = chrono::steady_clock::now();
+  for (int i = 0; i < kRepeat; i++) sum += calc::evaluate<price>((double)(i & 1023), 8.5, (double)(i & 7), 2.0);
+  auto middle = chrono::steady_clock::now();
+  for (int i = 0; i < kRepeat; i++) {
+    double values[] = {(double)(i & 1023), 8.5, (double)(i & 7), 2.0};
+    sum += calculator.Execute(plan, values);
+  }
+  auto end = chrono::steady_clock::now();
+  for (int i = 0; i < 1024; i++) {
+    double values[] = {(double)i, 8.5, (double)(i & 7), 2.0};
+    double expected = calculator.Execute(plan, values);
+    if (price(values[0], values[1], values[2], values[3]) != expected) mismatch++;
+    if (calc::evaluate<price>(values[0], values[1], values[2], values[3]) != expected) mismatch++;
+  }
+  cout << price.Size() << " instructions, variables :";
+  for (size_t i = 0; i < price.Variables(); i++) cout << " " << price.Variable(i);
+  cout << endl << "ns per evaluation, compile-time expression=" << chrono::duration<double, nano>(unrolled - start).count() / kRepeat
+    << " calc::evaluate()=" << chrono::duration<double, nano>(middle - unrolled).count() / kRepeat
+    << " Execute()=" << chrono::duration<double, nano>(end - middle).count() / kRepeat
+    << ", mismatch=" << mismatch << " (sum=" << sum << ")" << endl;
+
+  // ToPlan() for the runtime side.
+  CompiledExpression<double> from_constexpr = price.ToPlan();
+  double values[] = {120, 8.5, 3, 2};
+  cout << "ToPlan() : " << calculator.Execute(from_constexpr, values) << ", Execute() : "
+    << calculator.Execute(plan, values) << endl;
+
+  // malformed at run time : the reason and NaN, nothing written to cout.
+  auto malformed = calc::compile("(1+2");
+  cout << "\"(1+2\" at run time : valid=" << malformed.Valid() << ", error=" << malformed.Error()
+    << ", result=" << malformed() << endl;
 }
 
-template <class T>
-int round_to_best_precision(T orig, T &result){
-  int idxDigit = 0;
-  T difference;
-  
-  while(1) {
-    result = round(orig, idxDigit);
-    difference = orig - result;
-    // Use the correct way to tell the equivalence :
-    //   if (std::abs(x - y) * 2 / (x + y)) < threshold)  // say, threshold = 1e-6.
-    //     return equal.
-    if (difference < 0) difference = 0 - difference;
-    if ((difference * 2 / (orig + result)) < 1e-6) break;
-    idxDigit++;
+#endif
+
+#ifdef Also_Run_Benchmark
+
+// How the expressions of a corpus look.
+struct CorpusProfile {
+  const char* name;
+  int min_operands, max_operands;   // length of an expression.
+  int max_nesting;                  // how deep the parentheses can nest.
+  int paren_percent;                // chance for a sub-expression to get its own parentheses.
+  int max_integer_digits, max_fraction_digits;
+  int exponent_percent;             // chance for a literal to have an exponent, ex. "1.5e-3".
+  int variable_percent;             // chance for an operand to be a variable (v0 .. v7) instead of a literal.
+  int weights[4];                   // operator mix : relative weights of + - * /.
+};
+
+// Deterministic expressions for a profile : the same seed gives the same corpus on every machine
+// and every build, so runs can be compared.
+class CorpusGenerator {
+ public:
+  explicit CorpusGenerator(uint64_t seed) : state_(seed) {}
+
+  vector<string> Corpus(const CorpusProfile& profile, size_t count) {
+    vector<string> corpus;
+    for (size_t i = 0; i < count; i++)
+      corpus.push_back(Build(profile, Uniform(profile.min_operands, profile.max_operands), 0));
+    return corpus;
+  }
+
+ private:
+  // SplitMix64, defined bit for bit unlike the distributions of <random>.
+  uint64_t Next(void) {
+    uint64_t z = (state_ += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+  }
+  int Uniform(int low, int high) {
+    return low + (int)(Next() % (uint64_t)(high - low + 1));
+  }
+  bool Chance(int percent) {
+    return Uniform(1, 100) <= percent;
+  }
+
+  string Operand(const CorpusProfile& profile) {
+    if (Chance(profile.variable_percent)) return "v" + to_string(Uniform(0, 7));
+    string literal(1, (char)('1' + Uniform(0, 8)));   // no leading 0, and never a literal 0 to divide by.
+    for (int i = Uniform(1, profile.max_integer_digits); i > 1; i--) literal += (char)('0' + Uniform(0, 9));
+    int fraction = Uniform(0, profile.max_fraction_digits);
+    if (fraction > 0) {
+      literal += '.';
+      for (int i = 0; i < fraction; i++) literal += (char)('0' + Uniform(0, 9));
+    }
+    if (Chance(profile.exponent_percent)) literal += (Chance(50)? "e-" : "e") + to_string(Uniform(1, 9));
+    return literal;
+  }
+
+  char Operator(const CorpusProfile& profile) {
+    int total = profile.weights[0] + profile.weights[1] + profile.weights[2] + profile.weights[3];
+    int pick = Uniform(1, total);
+    for (int i = 0; i < 4; i++) {
+      if (pick <= profile.weights[i]) return "+-*/"[i];
+      pick -= profile.weights[i];
+    }
+    return '+';
+  }
+
+  // an expression of "operands" operands, inside "nesting" parentheses already.
+  string Build(const CorpusProfile& profile, int operands, int nesting) {
+    if (operands == 1) return Operand(profile);
+    int left = Uniform(1, operands - 1);
+    return Part(profile, left, nesting) + Operator(profile) + Part(profile, operands - left, nesting);
+  }
+  string Part(const CorpusProfile& profile, int operands, int nesting) {
+    if (operands > 1 && nesting < profile.max_nesting && Chance(profile.paren_percent))
+      return "(" + Build(profile, operands, nesting + 1) + ")";
+    return Build(profile, operands, nesting);
+  }
+
+  uint64_t state_;
+};
+
+// Number of tokens (numbers, variables, operators, parentheses) in "expression", to get the cost per
+// token whatever the length of the expressions.
+static size_t CountTokens(string_view expression) {
+  size_t tokens = 0;
+  for (size_t pos = 0; pos < expression.size(); tokens++) {
+    char ch = expression[pos++];
+    if (!isalnum((unsigned char)ch) && ch != '_' && ch != '.') continue;
+    while (pos < expression.size()) {
+      char next = expression[pos];
+      bool exponent_sign = (next == '+' || next == '-') && isdigit((unsigned char)ch) && (expression[pos - 1] == 'e');
+      if (!isalnum((unsigned char)next) && next != '_' && next != '.' && !exponent_sign) break;
+      pos++;
+    }
   }
+  return tokens;
+}
+
+// Run "pass" (which returns the number of evaluations it did) until kMinSeconds are spent, and
+// print one line of results.
+template <typename Pass>
+static void RunScenario(const char* type, const char* profile, const char* scenario, double tokens_per_evaluation,
+                        Pass pass) {
+  const double kMinSeconds = 0.2;
+  pass();   // warm up : the stacks grow, the caches fill, the JIT compiles.
+  size_t evaluations = 0;
+  size_t allocations_before = allocations;
+  auto start = chrono::steady_clock::now();
+  double seconds = 0;
+  do {
+    evaluations += pass();
+    seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  } while (seconds < kMinSeconds);
+  size_t allocated = allocations - allocations_before;
 
-  return idxDigit;
+  cout << left << setw(7) << type << setw(13) << profile << setw(13) << scenario << right
+    << setw(10) << fixed << setprecision(3) << evaluations / seconds / 1e6 << " M expr/s"
+    << setw(10) << setprecision(2) << seconds * 1e9 / (evaluations * tokens_per_evaluation) << " ns/token"
+    << setw(8) << setprecision(3) << (double)allocated / evaluations << " alloc/eval" << endl;
+  cout.unsetf(ios::fixed);
+  cout << setprecision(6);
 }
 
-#ifdef Also_Run_Precision_Test
+template <typename T>
+void benchmark(void){
+  const CorpusProfile profiles[] = {
+    // name           operands  nesting paren% int frac exp% var%  + - * /
+    {"short",         2, 4,       1,     30,   3,  2,   0,   0,  {1, 1, 1, 1}},
+    {"long",          30, 60,     3,     20,   4,  2,   0,   0,  {1, 1, 1, 1}},
+    {"deep",          8, 16,      12,    90,   2,  1,   0,   0,  {1, 1, 1, 1}},
+    {"big-literals",  4, 8,       2,     30,   9,  8,  30,   0,  {1, 1, 1, 1}},
+    {"add-sub",       8, 16,      2,     30,   4,  2,   0,   0,  {1, 1, 0, 0}},
+    {"mul-div",       8, 16,      2,     30,   2,  2,   0,   0,  {0, 0, 1, 1}},
+    {"variables",     8, 16,      2,     30,   3,  2,   0,  50,  {1, 1, 1, 1}},
+  };
+  const size_t kCorpusSize = 1000;
+  const size_t kRepeat = 100;       // executions of each plan per pass of the "repeated" scenarios.
+  const size_t kRows = 4096;        // rows per ExecuteBatch().
+  const char* type = sizeof(T) == sizeof(float)? "float" : "double";
 
-void precision_test(void){
-  float x = 3.192837465f;
-  double y = 321.192837465;
-  double z = 123.00;
+  // values of v0 .. v7, as values or as columns.
+  vector<vector<T>> data(8, vector<T>(kRows));
+  for (size_t v = 0; v < data.size(); v++)
+    for (size_t row = 0; row < kRows; row++) data[v][row] = (T)((row * 7919 + v * 104729) % 1009) / 8 + 1;
 
-  cout << "originally            x(float)='3.192837465', y(double)='321.192837465', z(double)='123.00'" << endl;
-  cout << fixed << setprecision(9);
-  cout << "after precision loss, x(float)='" << x << "', y(double)='" << y << "', z(double)='" << z << "'" << endl;
-  cout << fixed;
-  float x_result;
-  int idx = round_to_best_precision<float>(x, x_result);
-  cout << setprecision(idx);
-  cout << "After rounding to " << idx << "th decimal digit, result x='" << x_result << "'" << endl;
-  double y_result;
-  idx = round_to_best_precision<double>(y, y_result);
-  cout << setprecision(idx);
-  cout << "After rounding to " << idx << "th decimal digit, result y='" << y_result << "'" << endl;
-  double z_result;
-  idx = round_to_best_precision<double>(z, z_result);
-  cout << setprecision(idx);
-  cout << "After rounding to " << idx << "th decimal digit, result y='" << z_result << "'" << endl;
+  Calculator<T> calculator;
+  cout << left << setw(7) << "type" << setw(13) << "corpus" << setw(13) << "scenario" << right
+    << setw(19) << "expressions/s" << setw(19) << "per token" << setw(19) << "heap allocations" << endl;
+  for (const CorpusProfile& profile : profiles) {
+    vector<string> corpus = CorpusGenerator(20240101).Corpus(profile, kCorpusSize);
+    size_t tokens = 0;
+    for (const string& expression : corpus) tokens += CountTokens(expression);
+    double tokens_per_expression = (double)tokens / corpus.size();
+
+    vector<CompiledExpression<T>> plans;
+    vector<unique_ptr<TieredExpression<T>>> tiered;
+    vector<vector<const T*>> columns(corpus.size());
+    vector<vector<T>> values(corpus.size());
+    for (size_t i = 0; i < corpus.size(); i++) {
+      // not optimized : most profiles have no variable, and would be folded to one constant.
+      plans.push_back(calculator.Compile(corpus[i], false));
+      // compiled to native code by the warm up pass.
+      tiered.emplace_back(new TieredExpression<T>(plans.back(), kRepeat));
+      for (const string& variable : plans.back().variables) {
+        columns[i].push_back(data[variable[1] - '0'].data());
+        values[i].push_back(data[variable[1] - '0'][i % kRows]);
+      }
+    }
+    vector<T> out(kRows);
+    T sum = 0;
+
+    // parse and calculate every expression once, as the batch mode does.
+    RunScenario(type, profile.name, "single-shot", tokens_per_expression, [&]() {
+      for (const string& expression : corpus) sum += calculator.CalculateNoCache(expression);
+      return corpus.size();
+    });
+    // the same plans executed again and again, by the interpreter and by the native code.
+    RunScenario(type, profile.name, "repeated", tokens_per_expression, [&]() {
+      for (size_t i = 0; i < plans.size(); i++)
+        for (size_t r = 0; r < kRepeat; r++) sum += calculator.Execute(plans[i], values[i].data());
+      return plans.size() * kRepeat;
+    });
+    RunScenario(type, profile.name, "repeated-jit", tokens_per_expression, [&]() {
+      for (size_t i = 0; i < tiered.size(); i++)
+        for (size_t r = 0; r < kRepeat; r++) sum += calculator.Execute(*tiered[i], values[i].data());
+      return tiered.size() * kRepeat;
+    });
+    // every plan over columns of rows.
+    RunScenario(type, profile.name, "batch", tokens_per_expression, [&]() {
+      for (size_t i = 0; i < plans.size(); i++) {
+        calculator.ExecuteBatch(plans[i], columns[i], kRows, out.data());
+        sum += out[0];
+      }
+      return plans.size() * kRows;
+    });
+    if (sum == (T)0.123456) cout << "(unlikely sum, printed so the work is not optimized away)" << endl;
+  }
+}
+
+#endif
+
+#ifdef Also_Run_Instrumentation_Test
+
+void instrumentation_test(void){
+  const int kRepeat = 10000;
+  InstrumentationCounters before = Instrumentation::Snapshot();
+
+  // "1+2*(3+4)" : 9 tokens, 3 reductions, 3 operands on the stack at most.
+  Calculator<double> calculator;
+  double sum = 0;
+  for (int i = 0; i < kRepeat; i++) sum += calculator.Calculate("1+2*(3+4)");
+  // the same from another thread, which is gone before the snapshot.
+  thread worker([]() {
+    Calculator<double> other;
+    for (int i = 0; i < kRepeat; i++) other.Calculate("1+2*(3+4)");
+  });
+  worker.join();
+  CompiledExpression<double> plan = calculator.Compile("(a+b)*(a-b)");
+  double values[] = {3, 2};
+  for (int i = 0; i < kRepeat; i++) sum += calculator.Execute(plan, values);
+  char text[kMaxFormattedLength];
+  for (int i = 0; i < kRepeat; i++) FormatBestPrecision(sum / (i + 1), text, sizeof(text));
+
+  InstrumentationCounters after = Instrumentation::Snapshot();
+  uint64_t expressions = after.expressions.Get() - before.expressions.Get();
+  uint64_t tokens = after.tokens.Get() - before.tokens.Get();
+  uint64_t reductions = after.reductions.Get() - before.reductions.Get();
+  // Calculate() 2 * kRepeat times, Compile() once.
+  bool ok = expressions == 2 * kRepeat + 1 && tokens == 9 * 2 * kRepeat + 11 && reductions == 3 * 2 * kRepeat + 3 &&
+            after.max_stack_depth.Get() >= 3 &&
+            after.phases[(int)Phase::kCalculate].Count() - before.phases[(int)Phase::kCalculate].Count() == 2 * kRepeat &&
+            after.phases[(int)Phase::kExecute].Count() - before.phases[(int)Phase::kExecute].Count() == kRepeat &&
+            after.phases[(int)Phase::kFormat].Count() - before.phases[(int)Phase::kFormat].Count() == kRepeat;
+  cout << "expressions=" << expressions << " tokens=" << tokens << " reductions=" << reductions
+    << (ok? " (OK)" : " (FAILED)") << " (sum=" << sum << ")" << endl;
+
+  // the histogram : 1..1000 ns once each.
+  LatencyHistogram histogram;
+  for (uint64_t ns = 1; ns <= 1000; ns++) histogram.Record(ns);
+  cout << "histogram of 1..1000 : p50=" << histogram.Percentile(50) << " p99=" << histogram.Percentile(99)
+    << " max=" << histogram.Max() << " mean=" << histogram.Mean() << " (expecting about 500, 990, 1000, 500)" << endl;
+
+  cout << after.ToText() << after.ToJson() << endl;
+}
+
+#endif
+
+#ifdef Also_Run_Server_Test
+
+void server_test(void){
+  // the frames : 3 requests, a malformed one in the middle, the last cut in the middle as it can
+  // come from a socket.
+  Calculator<double> calculator;
+  string requests, responses;
+  AppendFrame(requests, "1+2*(3+4)");
+  AppendFrame(requests, "1+");
+  AppendFrame(requests, "12.+13.45*(23.56+47.8*2)");
+  size_t cut = requests.size() - 5;
+  size_t used = ServeFrames<double>(string_view(requests).substr(0, cut), calculator, responses);
+  string left = requests.substr(used);
+  used += ServeFrames<double>(left, calculator, responses);
+  string expected;
+  AppendFrame(expected, "15");
+  AppendFrame(expected, "error : missing operand at 2");
+  AppendFrame(expected, "1614.702");
+  string too_long(4, '\xff');
+  bool ok = used == requests.size() && responses == expected &&
+            ServeFrames<double>(too_long, calculator, responses) == string_view::npos;
+  cout << "frames : " << (ok? "OK" : "FAILED") << endl;
+
+#ifdef Have_Epoll_Server
+  string path = "/tmp/calculator_test_" + to_string(getpid()) + ".sock";
+  EvaluationServer<double> server(2, 0);
+  if (!server.Listen(path)) return;
+  thread serving([&server]() { server.Run(); });
+
+  const vector<string> expressions = {"1+2*(3+4*(5+6*7+1))*(8+9)", "12345+67890", "1/0", "(1.5+2.25)*4", "(1+2"};
+  struct Load {
+    int connections;
+    uint64_t requests;
+    int pipeline;
+  };
+  for (const Load& load : {Load{1, 20000, 1}, Load{4, 50000, 16}}) {
+    LatencyHistogram latency;
+    auto start = chrono::steady_clock::now();
+    uint64_t failed = RunLoadClient(path, load.connections, load.requests, load.pipeline, expressions, latency);
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cout << load.connections << " connection(s), pipeline " << load.pipeline << " : " << latency.Count() / seconds
+      << " requests/s, latency us p50=" << latency.Percentile(50) / 1e3 << " p99=" << latency.Percentile(99) / 1e3
+      << ", failed=" << failed << (failed == 0? " (OK)" : " (FAILED)") << endl;
+  }
+  server.Stop();
+  serving.join();
+#endif
+}
+
+#endif
+
+#ifdef Also_Run_Incremental_Test
+
+void incremental_test(void){
+  // a long formula : 2048 terms with literals and the variables x, y, added in pairs so that a changed literal is
+  // at most a few dozen operators below the root (a left-to-right chain of sums would have to recalculate them all).
+  vector<string> terms;
+  for (int i = 0; i < 2048; i++)
+    terms.push_back("(" + to_string(i % 97 + 1) + ".25*x-" + to_string(i % 13) + ")/(y+" + to_string(i % 7 + 1) + ")");
+  while (terms.size() > 1) {
+    vector<string> pairs;
+    for (size_t i = 0; i < terms.size(); i += 2) pairs.push_back("(" + terms[i] + "+-"[i / 2 % 2] + terms[i + 1] + ")");
+    terms.swap(pairs);
+  }
+  const string& text = terms[0];
+  Calculator<double> calculator;
+  CompiledExpression<double> plan = calculator.Compile(text, false);
+  vector<size_t> literals;   // the instructions of the literals, to change them in the plan as well.
+  vector<double> original;
+  for (size_t i = 0; i < plan.code.size(); i++)
+    if (plan.code[i].code == OpCode::kPushConst) {
+      literals.push_back(i);
+      original.push_back(plan.code[i].value);
+    }
+
+  ExpressionGraph<double> graph;
+  int formula = graph.AddFormula(text);
+  graph.SetVariable("x", 1.5);
+  graph.SetVariable("y", 2.5);
+  double values[] = {1.5, 2.5};   // x and y are the plan's variables 0 and 1.
+  double got = graph.Value(formula), expected = calculator.Execute(plan, values);
+  size_t nodes = graph.Nodes();
+  cout << plan.code.size() << " instructions, " << nodes << " nodes, " << graph.Literals(formula) << " literals, "
+    << (memcmp(&got, &expected, sizeof(double)) == 0? "same as Execute()" : "MISMATCH with Execute()") << endl;
+
+  // change one literal at a time, and compare with the whole plan changed the same way.
+  const int kEdits = 2000;
+  uint64_t calculations = graph.Calculations();
+  size_t mismatch = 0;
+  uint32_t seed = 1;
+  double graph_seconds = 0, execute_seconds = 0;
+  for (int i = 0; i < kEdits; i++) {
+    seed = seed * 1664525 + 1013904223;
+    size_t literal = (seed >> 8) % literals.size();
+    double value = (double)((seed >> 4) % 1000) / 8;
+    plan.code[literals[literal]].value = value;
+
+    auto start = chrono::steady_clock::now();
+    graph.SetLiteral(formula, literal, value);
+    got = graph.Value(formula);
+    auto middle = chrono::steady_clock::now();
+    expected = calculator.Execute(plan, values);
+    auto end = chrono::steady_clock::now();
+    graph_seconds += chrono::duration<double>(middle - start).count();
+    execute_seconds += chrono::duration<double>(end - middle).count();
+    if (memcmp(&got, &expected, sizeof(double)) != 0) mismatch++;
+  }
+  cout << "literal edits : " << (double)(graph.Calculations() - calculations) / kEdits << " operators calculated per edit"
+    << " (of " << plan.code.size() / 2 << "), us per edit " << graph_seconds / kEdits * 1e6 << " vs "
+    << execute_seconds / kEdits * 1e6 << " for Execute(), mismatch=" << mismatch << endl;
+  for (size_t i = 0; i < literals.size(); i++) graph.SetLiteral(formula, i, original[i]);
+  cout << "nodes with the literals restored : " << graph.Nodes() << (graph.Nodes() == nodes? " (none leaked)" : " (LEAKED)")
+    << endl;
+
+  // many formulas sharing "(base*(1+tax)-discount)".
+  ExpressionGraph<double> sheet;
+  vector<int> formulas;
+  size_t instructions = 0;
+  for (int i = 1; i <= 1000; i++) {
+    string expression = "(base*(1+tax)-discount)*" + to_string(i) + "+fee";
+    formulas.push_back(sheet.AddFormula(expression));
+    instructions += calculator.Compile(expression, false).code.size();
+  }
+  sheet.SetVariable("base", 100);
+  sheet.SetVariable("tax", 0.08);
+  sheet.SetVariable("discount", 5);
+  sheet.SetVariable("fee", 1.5);
+  for (int id : formulas) sheet.Value(id);
+  cout << sheet.Formulas() << " formulas, " << instructions << " instructions, " << sheet.Nodes() << " nodes" << endl;
+
+  struct Change {
+    const char* variable;
+    double value;
+  };
+  for (const Change& change : {Change{"fee", 2.5}, Change{"tax", 0.1}, Change{"unused", 1}}) {
+    calculations = sheet.Calculations();
+    sheet.SetVariable(change.variable, change.value);
+    double sum = 0;
+    for (int id : formulas) sum += sheet.Value(id);
+    cout << "set " << change.variable << " : " << sheet.Calculations() - calculations << " operators calculated, sum="
+      << sum << endl;
+  }
+  double last_values[] = {100, 0.1, 5, 2.5};
+  got = sheet.Value(formulas.back());
+  expected = calculator.Execute(calculator.Compile("(base*(1+tax)-discount)*1000+fee", false), last_values);
+  cout << "last formula " << got << (got == expected? " (same as Execute())" : " (MISMATCH with Execute())") << endl;
+
+  // an edited text : only the new part is calculated.
+  calculations = sheet.Calculations();
+  sheet.SetFormula(formulas[0], "(base*(1+tax)-discount)*1+fee*2");
+  got = sheet.Value(formulas[0]);
+  cout << "edited formula = " << got << ", " << sheet.Calculations() - calculations << " operators calculated" << endl;
+  ParseStatus edit = sheet.SetFormula(formulas[0], "(1+");
+  char error[kMaxFormattedLength];
+  cout << "malformed edit \"(1+\" (" << string_view(error, FormatError(edit, error, sizeof(error)))
+    << ") kept the formula : " << (!edit.Ok() && sheet.Value(formulas[0]) == got) << endl;
+}
+
+#endif
+
+#ifdef Also_Run_Operators_Test
+
+// The longest run of ULPs between "got" and "expected", for the accuracy of math::Exp()/Log().
+static int64_t UlpDistance(double got, double expected) {
+  if (got == expected || (got != got && expected != expected)) return 0;
+  int64_t a = (int64_t)math::Bits(got), b = (int64_t)math::Bits(expected);
+  if ((a < 0) != (b < 0)) return INT64_MAX;
+  return a > b? a - b : b - a;
+}
+
+void operators_test(void){
+  auto format = [](auto value) {
+    char text[kMaxFormattedLength];
+    return string(text, FormatBestPrecision(value, text, sizeof(text)));
+  };
+  struct Case {
+    const char* expression;
+    const char* expected;
+  };
+  const Case cases[] = {
+    {"-2^2", "-4"},                    // ^ before the negation, as in mathematics.
+    {"2^3^2", "512"},                  // ^ is right associative.
+    {"2^-1", "0.5"},
+    {"7%3", "1"},
+    {"-7%3", "-1"},                    // truncated toward 0, like fmod().
+    {"2*-3", "-6"},
+    {"--3", "3"},
+    {"+4", "4"},
+    {"-(2+3)*2", "-10"},
+    {"sqrt(16)+abs(-3)", "7"},
+    {"min(3, max(1,2))", "2"},
+    {"max(2,3)^2", "9"},
+    {"sqrt (2*8) * min(-1, -2)", "-8"},
+    {"exp(0)", "1"},
+    {"log(exp(1))", "1"},
+    {"log(0)", "-inf"},
+    {"abs(sqrt(-1))", "nan"},
+  };
+  Calculator<double> calculator;
+  Calculator<Decimal> decimal_calculator;
+  int failed = 0;
+  for (const Case& test : cases) {
+    double got = calculator.Calculate(test.expression);
+    // the same value through every path : the interpreter with and without Optimize(), and Decimal.
+    double executed = calculator.Execute(calculator.Compile(test.expression, false));
+    double optimized = calculator.Execute(calculator.Compile(test.expression));
+    string decimal = format(decimal_calculator.Calculate(test.expression));
+    bool ok = format(got) == test.expected && memcmp(&got, &executed, sizeof(got)) == 0
+      && memcmp(&got, &optimized, sizeof(got)) == 0 && decimal == test.expected;
+    if (!ok) failed++;
+    cout << test.expression << " = " << format(got) << ", Decimal=" << decimal
+      << (ok? "" : string(" (FAILED, expecting ") + test.expected + ")") << endl;
+  }
+  // Decimal stays exact where it can.
+  string power = format(decimal_calculator.Calculate("1.1^10"));
+  string remainder = format(decimal_calculator.Calculate("10.5%0.1"));
+  cout << "Decimal 1.1^10=" << power << ", 10.5%0.1=" << remainder << endl;
+  if (power != "2.5937424601" || remainder != "0") failed++;
+  // what the constant folding keeps : x*-1 is still a multiplication, sqrt(16) is folded to 4.
+  cout << "instructions : \"sqrt(16)*-a\"=" << calculator.Compile("sqrt(16)*-a").code.size()
+    << " (expecting 4), \"exp(a)+max(2,3)\"=" << calculator.Compile("exp(a)+max(2,3)").code.size()
+    << " (expecting 4)" << endl;
+  cout << (failed == 0? "all the operators (OK)" : "FAILED") << endl;
+
+  // math::Exp()/Log() against the C library, which is correctly rounded nearly everywhere.
+  const int kValues = 2000000;
+  vector<double> inputs(kValues);
+  for (int i = 0; i < kValues; i++) inputs[i] = -745.0 + 1455.0 * i / kValues;
+  int64_t exp_ulps = 0, log_ulps = 0;
+  for (double x : inputs) {
+    exp_ulps = max(exp_ulps, UlpDistance(math::Exp(x), exp(x)));
+    double positive = fabs(x) * 1e-3 + 1e-300 * (x + 746);   // tiny to big values.
+    log_ulps = max(log_ulps, UlpDistance(math::Log(positive), log(positive)));
+  }
+  double sum = 0;
+  auto start = chrono::steady_clock::now();
+  for (double x : inputs) sum += math::Exp(x * 1e-3) + math::Log(x + 746);
+  auto middle = chrono::steady_clock::now();
+  for (double x : inputs) sum += exp(x * 1e-3) + log(x + 746);
+  auto end = chrono::steady_clock::now();
+  cout << "max ULP error : Exp()=" << exp_ulps << ", Log()=" << log_ulps << " (expecting 1 at most), ns per exp+log : math="
+    << chrono::duration<double, nano>(middle - start).count() / kValues << ", libm="
+    << chrono::duration<double, nano>(end - middle).count() / kValues << " (sum=" << sum << ")" << endl;
+
+  // every SIMD level against Execute(), bit for bit : the operators of the SIMD instructions and
+  // exp()/log(), then fmod() and pow() too, which the kernels calculate one value at a time.
+  const char* level_names[] = {"scalar", "SSE", "AVX", "AVX2"};
+  const char* formulas[] = {"exp(-a/100)*sqrt(abs(b))+log(abs(a)+1)-min(a,b)+max(-b,2)",
+                            "exp(-a/100)*sqrt(abs(b))+log(abs(a)+1)-min(a,b)+max(-b,2)+a%7+b^2"};
+  const size_t kRows = 1000000 + 3;   // not a multiple of any SIMD width, to test the left values too.
+  vector<double> a(kRows), b(kRows), expected(kRows), out(kRows);
+  for (size_t i = 0; i < kRows; i++) {
+    a[i] = (double)((i * 7919) % 20011) / 13 - 700;
+    b[i] = (double)((i * 104729) % 1009) / 7 - 50;
+  }
+  vector<const double*> columns = {a.data(), b.data()};
+  for (const char* formula : formulas) {
+    CompiledExpression<double> plan = calculator.Compile(formula);
+    for (size_t i = 0; i < kRows; i++) {
+      double values[] = {a[i], b[i]};
+      expected[i] = calculator.Execute(plan, values);
+    }
+    cout << formula << endl;
+    for (int level = (int)SimdLevel::kScalar; level <= (int)DetectSimdLevel(); level++) {
+      calculator.SetSimdLevel((SimdLevel)level);
+      auto batch_start = chrono::steady_clock::now();
+      calculator.ExecuteBatch(plan, columns, kRows, out.data());
+      double seconds = chrono::duration<double>(chrono::steady_clock::now() - batch_start).count();
+      cout << "  " << level_names[level] << " : " << kRows / seconds / 1e6 << " M rows/s, "
+        << (memcmp(out.data(), expected.data(), kRows * sizeof(double)) == 0? "same as Execute()" : "MISMATCH with Execute()")
+        << endl;
+    }
+  }
+
+  // the JIT compiles the operators of 1 SSE instruction, and leaves fmod(), pow(), exp() and log() to the interpreter.
+  cout << "JIT : \"sqrt(abs(a))+min(a,b)-max(-b,1)\" native="
+    << (JitFunction<double>::Compile(calculator.Compile("sqrt(abs(a))+min(a,b)-max(-b,1)")) != nullptr)
+    << ", \"exp(a)+b\" native=" << (JitFunction<double>::Compile(calculator.Compile("exp(a)+b")) != nullptr) << endl;
+
+  // parsing stays linear : 10x the terms take about 10x the time.
+  auto parse_time = [&calculator](int terms) {
+    string text = "0";
+    for (int i = 0; i < terms; i++) text += "+max(-" + to_string(i % 97) + ",sqrt(" + to_string(i % 13) + ")^2)";
+    auto parse_start = chrono::steady_clock::now();
+    double result = calculator.CalculateNoCache(text);
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - parse_start).count();
+    cout << terms << " terms : " << seconds * 1e3 << " ms (result " << result << ")" << endl;
+    return seconds;
+  };
+  double small = parse_time(10000);
+  double big = parse_time(100000);
+  cout << "x" << big / small << " for 10x the terms" << endl;
+}
+
+#endif
+
+#ifdef Also_Run_Validation_Test
+
+void validation_test(void){
+  struct Case {
+    const char* expression;
+    ParseError error;
+    uint32_t position;
+  };
+  const Case cases[] = {
+    {"1+2*(3+4)", ParseError::kNone, 0},
+    {" -(-2) + max( 1 , 2 ) * sqrt (4) ", ParseError::kNone, 0},
+    {"1.5e-3*price+-qty", ParseError::kNone, 0},
+    {"", ParseError::kEmpty, 0},
+    {" \t", ParseError::kEmpty, 0},
+    {"1 # 2", ParseError::kUnexpectedCharacter, 2},
+    {".", ParseError::kUnexpectedCharacter, 0},
+    {"1+.", ParseError::kUnexpectedCharacter, 2},
+    {"(.)", ParseError::kUnexpectedCharacter, 1},
+    {"1+", ParseError::kMissingOperand, 2},
+    {"1+*2", ParseError::kMissingOperand, 2},
+    {"*2", ParseError::kMissingOperand, 0},
+    {"()", ParseError::kMissingOperand, 1},
+    {"max(1,)", ParseError::kMissingOperand, 6},
+    {"2 3", ParseError::kMissingOperator, 2},
+    {"2a", ParseError::kMissingOperator, 1},
+    {"(1)(2)", ParseError::kMissingOperator, 3},
+    {"2 sqrt(4)", ParseError::kMissingOperator, 2},
+    {")", ParseError::kUnbalancedClose, 0},
+    {"1+2)", ParseError::kUnbalancedClose, 3},
+    {"(2*3", ParseError::kUnbalancedOpen, 4},
+    {"max(1,(2", ParseError::kUnbalancedOpen, 8},
+    {"foo(2)", ParseError::kUnknownFunction, 0},
+    {"1+bar (2)", ParseError::kUnknownFunction, 2},
+    {"max(1)", ParseError::kWrongArgumentCount, 5},
+    {"sqrt(1,2)", ParseError::kWrongArgumentCount, 8},
+    {"1,2", ParseError::kMisplacedComma, 1},
+    {"(1,2)", ParseError::kMisplacedComma, 2},
+    {"max(1,(2,3))", ParseError::kMisplacedComma, 8},
+  };
+  Calculator<double> calculator;
+  int failed = 0;
+  for (const Case& test : cases) {
+    CalcResult<double> result = calculator.TryCalculate(test.expression);
+    CompiledExpression<double> plan = calculator.Compile(test.expression);
+    bool ok = result.status.error == test.error && result.status.position == test.position &&
+              plan.status.error == test.error && plan.status.position == test.position &&
+              (result.Ok() || (isnan(result.value) && isnan(calculator.Execute(plan))));
+    if (!ok) failed++;
+    char text[kMaxFormattedLength];
+    cout << "\"" << test.expression << "\" : "
+         << (result.Ok()? "ok" : string(text, FormatError(result.status, text, sizeof(text))))
+         << (ok? "" : string(" (FAILED, expecting ") + kParseErrorNames[(int)test.error] + " at " +
+                      to_string(test.position) + ")") << endl;
+  }
+  cout << (failed == 0? "all the errors found (OK)" : "FAILED") << endl;
+
+  // good expressions broken at random places : a char deleted, replaced or inserted. Whatever the
+  // result, TryCalculate() and Compile() must agree on it, and a good one must calculate the same
+  // value both ways.
+  const vector<string> corpus = {
+    "1+2*(3+4*(5+6*7+1))*(8+9)",
+    "(a+b)*(a-b)/(b+3)-a*0.5",
+    "-max(2,3)^2+sqrt(abs(-16))%5",
+    "min(x, log(exp(1.5e-3*y)))",
+  };
+  const char alphabet[] = "0123456789.+-*/%^(),e xyz#";
+  const int kMutations = 200000;
+  uint32_t seed = 2024;
+  auto next = [&seed](uint32_t n) { seed = seed * 1664525 + 1013904223; return (seed >> 8) % n; };
+  size_t good = 0, bad = 0, disagree = 0;
+  size_t errors[(int)ParseError::kCount] = {};
+  vector<double> values(8, 1.25);
+  for (int i = 0; i < kMutations; i++) {
+    string text = corpus[i % corpus.size()];
+    for (int edit = 0, edits = 1 + next(3); edit < edits; edit++) {
+      size_t at = next((uint32_t)text.size() + 1);
+      char ch = alphabet[next(sizeof(alphabet) - 1)];
+      switch (next(3)) {
+        case 0:
+          if (at < text.size()) text.erase(at, 1);
+          break;
+        case 1:
+          if (at < text.size()) text[at] = ch;
+          break;
+        default:
+          text.insert(at, 1, ch);
+          break;
+      }
+    }
+    CalcResult<double> result = calculator.TryCalculate(text);
+    CompiledExpression<double> plan = calculator.Compile(text, false);
+    errors[(int)result.status.error]++;
+    if (result.Ok()) {
+      good++;
+      // no variable bound by Calculate() : NaN, so only compare the constant ones.
+      double executed = calculator.Execute(plan, values.data());
+      if (plan.variables.empty() && memcmp(&executed, &result.value, sizeof(double)) != 0 &&
+          !(isnan(executed) && isnan(result.value))) {
+        disagree++;
+      }
+    } else {
+      bad++;
+      if (result.status.position > text.size()) disagree++;
+    }
+    if (plan.status.error != result.status.error || plan.status.position != result.status.position) disagree++;
+  }
+  cout << kMutations << " broken expressions : " << good << " still good, " << bad << " malformed (";
+  for (int e = 1; e < (int)ParseError::kCount; e++) cout << (e > 1? ", " : "") << kParseErrorNames[e] << "=" << errors[e];
+  cout << "), disagreements=" << disagree << (disagree == 0? " (OK)" : " (FAILED)") << endl;
+
+  // a batch with 1 bad line in 10 goes as fast as a clean one : a bad line stops at its error.
+  const size_t kLines = 1000000;
+  vector<string> clean, dirty;
+  for (size_t i = 0; i < kLines; i++) {
+    clean.push_back(to_string(i % 997) + "+" + to_string(i % 13) + "*(" + to_string(i % 101) + ".5-3)/7");
+    dirty.push_back(i % 10 == 0? to_string(i % 997) + "+" + to_string(i % 13) + "*(" + to_string(i % 101) + ".5-3/7"
+                               : clean.back());
+  }
+  for (const vector<string>* lines : {&clean, &dirty}) {
+    size_t malformed = 0;
+    double sum = 0;
+    auto start = chrono::steady_clock::now();
+    for (const string& line : *lines) {
+      CalcResult<double> result = calculator.TryCalculate(line);
+      if (result.Ok()) {
+        sum += result.value;
+      } else {
+        malformed++;
+      }
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cout << (lines == &clean? "clean batch : " : "batch with 10% bad lines : ") << kLines / seconds / 1e6
+         << " M lines/s, " << malformed << " malformed (sum=" << sum << ")" << endl;
+  }
+}
+
+#endif
+
+#ifdef Also_Run_Mixed_Test
+
+void mixed_test(void){
+  struct Case {
+    const char* expression;
+    Precision precision;
+    const char* result;
+  };
+  const Case cases[] = {
+    {"12345+67890", Precision::kInt64, "80235"},
+    {"123456789*987654321", Precision::kInt64, "121932631112635269"},   // double : ...264.
+    {"6/2", Precision::kInt64, "3"},
+    {"7/2", Precision::kDouble, "3.5"},
+    {"-7%3+2^62", Precision::kInt64, "4611686018427387903"},
+    {"2^63", Precision::kDouble, "9223372036854775808"},
+    {"9007199254740993+0", Precision::kInt64, "9007199254740993"},    // a literal past 2^53.
+    {"9223372036854775807", Precision::kInt64, "9223372036854775807"},
+    {"9223372036854775808", Precision::kDouble, "9223372036854775808"},
+    {"3037000500*3037000500", Precision::kDouble, "9223372037000249344"},   // overflows int64.
+    {"(2^60+1-2^60)/2", Precision::kDouble, "0"},                           // as double all along.
+    {"-max(3,abs(-5))*-(4-6)", Precision::kInt64, "-10"},
+    {"1/0", Precision::kDouble, "inf"},
+    {"1/(0*-1)", Precision::kDouble, "-inf"},                               // 0*-1 is -0 as double.
+    {"2.0*3", Precision::kDouble, "6"},                                     // not integer literals.
+    {"sqrt(16)", Precision::kDouble, "4"},
+    {"0.1+0.2", Precision::kDouble, "0.3"},
+    {"x+1", Precision::kDouble, "nan"},
+  };
+  MixedCalculator calculator;
+  int failed = 0;
+  for (const Case& test : cases) {
+    CalcResult<MixedValue> result = calculator.TryCalculate(test.expression);
+    char text[kMaxFormattedLength];
+    string formatted(text, FormatBestPrecision(result.value, text, sizeof(text)));
+    bool ok = result.Ok() && result.value.precision == test.precision && formatted == test.result;
+    if (!ok) failed++;
+    cout << "\"" << test.expression << "\" = " << formatted << " as " << kPrecisionNames[(int)result.value.precision]
+         << (ok? "" : string(" (FAILED, expecting ") + test.result + " as " + kPrecisionNames[(int)test.precision] + ")")
+         << endl;
+  }
+
+  // compiled : the precision is chosen from the plan, and the values of the variables may still
+  // send it back to double.
+  struct Plan {
+    const char* expression;
+    double max_relative_error;
+    vector<double> values;
+    Precision chosen, used;
+  };
+  const vector<Plan> plans = {
+    {"a*b+c", 0, {3, 4, 5}, Precision::kInt64, Precision::kInt64},
+    {"a*b+c", 0, {3.5, 4, 5}, Precision::kInt64, Precision::kDouble},
+    {"a*b+c", 0, {1e10, 1e10, 5}, Precision::kInt64, Precision::kDouble},   // past 2^53.
+    {"price*qty*1.08", 1e-6, {19.99, 3}, Precision::kFloat, Precision::kFloat},
+    {"price*qty*1.08", 1e-6, {1e30, 1e30}, Precision::kFloat, Precision::kDouble},   // float overflows.
+    {"price*qty*1.08", 0, {19.99, 3}, Precision::kDouble, Precision::kDouble},
+    {"a-b*0.5", 1e-3, {2, 1}, Precision::kDouble, Precision::kDouble},   // may cancel.
+    {"sqrt(abs(a)*2+1)/(abs(b)+0.5)", 1e-6, {7, -2}, Precision::kFloat, Precision::kFloat},
+    // a*b underflows to a subnormal float, and *c brings it back to a normal one, 2% off.
+    {"a*b*c*1.5", 1e-6, {1e-22, 3e-22, 1e14}, Precision::kFloat, Precision::kDouble},
+    {"a*b*c*1.5", 1e-6, {1e-2, 3e-2, 1e4}, Precision::kFloat, Precision::kFloat},
+  };
+  for (const Plan& test : plans) {
+    MixedPlan plan = calculator.Compile(test.expression, test.max_relative_error);
+    MixedValue value = calculator.Execute(plan, test.values.data());
+    Calculator<double> reference;
+    double expected = reference.Execute(reference.Compile(test.expression), test.values.data());
+    double error = fabs(value.real - expected) / fabs(expected);
+    bool ok = plan.precision == test.chosen && value.precision == test.used && error <= test.max_relative_error;
+    if (!ok) failed++;
+    cout << "\"" << test.expression << "\" within " << test.max_relative_error << " : "
+         << kPrecisionNames[(int)plan.precision] << ", " << value.real << " as " << kPrecisionNames[(int)value.precision]
+         << (ok? "" : " (FAILED)") << endl;
+    // ExecuteBatch() falls back the same way, on rows of these values.
+    const size_t kTestRows = 1000;
+    vector<vector<double>> test_data(test.values.size());
+    vector<const double*> test_columns;
+    for (size_t v = 0; v < test.values.size(); v++) {
+      test_data[v].assign(kTestRows, test.values[v]);
+      test_columns.push_back(test_data[v].data());
+    }
+    vector<double> test_out(kTestRows);
+    calculator.ExecuteBatch(plan, test_columns, kTestRows, test_out.data());
+    for (double row : test_out) {
+      if (!(fabs(row - expected) <= test.max_relative_error * fabs(expected))) {
+        failed++;
+        cout << "  ExecuteBatch() : " << row << " (FAILED)" << endl;
+        break;
+      }
+    }
+  }
+  cout << (failed == 0? "all the precisions as expected (OK)" : "FAILED") << endl;
+
+  // with a cache : the same results and errors, spaces inside or not.
+  ResultCache<MixedValue> cache(1 << 20);
+  MixedCalculator cached;
+  cached.SetResultCache(&cache);
+  size_t differences = 0;
+  for (int round = 0; round < 2; round++) {
+    for (const char* expression : {"23", "2 3", "1 +", "12345 + 67890", "12345+67890", "7 / 2"}) {
+      CalcResult<MixedValue> with = cached.TryCalculate(expression), without = calculator.TryCalculate(expression);
+      if (with.status.error != without.status.error || with.status.position != without.status.position ||
+          (with.Ok() && (with.value.precision != without.value.precision || with.value.real != without.value.real)))
+        differences++;
+    }
+  }
+  cout << "with a cache : " << differences << " differences" << (differences == 0? " (OK)" : " (FAILED)") << endl;
+
+  // the float error of a batch against its bound, and its speed against double.
+  const size_t kRows = 1 << 20;
+  const double kTolerance = 1e-5;
+  const char* formula = "sqrt(abs(a))/(abs(b)+1)*sqrt(abs(c)+2)/(abs(d)+3)*sqrt(abs(e)+4)/(abs(a)+5)*1.08*b";
+  vector<vector<double>> data(5, vector<double>(kRows));
+  uint32_t seed = 7;
+  auto next = [&seed]() { seed = seed * 1664525 + 1013904223; return (seed >> 8) / double(1 << 24); };
+  for (vector<double>& column : data)
+    for (double& value : column) value = (next() - 0.25) * 1000;
+  data[4][kRows / 2] = 1e300;   // out of the range of float, its block runs as double.
+  vector<const double*> columns;
+  for (const vector<double>& column : data) columns.push_back(column.data());
+  MixedPlan plan = calculator.Compile(formula, kTolerance);
+  MixedPlan exact = calculator.Compile(formula);
+  vector<double> mixed_out(kRows), double_out(kRows);
+  double mixed_seconds = 1e9, double_seconds = 1e9;
+  for (int round = 0; round < 5; round++) {
+    auto start = chrono::steady_clock::now();
+    calculator.ExecuteBatch(plan, columns, kRows, mixed_out.data());
+    auto middle = chrono::steady_clock::now();
+    calculator.ExecuteBatch(exact, columns, kRows, double_out.data());
+    auto end = chrono::steady_clock::now();
+    mixed_seconds = min(mixed_seconds, chrono::duration<double>(middle - start).count());
+    double_seconds = min(double_seconds, chrono::duration<double>(end - middle).count());
+  }
+  double worst = 0;
+  for (size_t i = 0; i < kRows; i++)
+    if (double_out[i] != 0) worst = max(worst, fabs(mixed_out[i] - double_out[i]) / fabs(double_out[i]));
+  cout << formula << " as " << kPrecisionNames[(int)plan.precision] << " : worst relative error " << worst
+       << (worst <= kTolerance? " (OK)" : " (FAILED)") << ", " << kRows / mixed_seconds / 1e6 << " M rows/s against "
+       << kRows / double_seconds / 1e6 << " M rows/s as double" << endl;
+
+  // calculating and formatting, against Calculator<double>, on integer expressions and on mixed
+  // ones : the same text for every line, and faster. The integers save the rounding loop of
+  // FormatBestPrecision(), the mixed corpus only on its integer half, the other half is what double
+  // does, so it must at least not lose more than the timing noise.
+  const size_t kLines = 1000000;
+  vector<string> integers, mixed;
+  for (size_t i = 0; i < kLines; i++) {
+    integers.push_back(to_string(i % 99991) + "*" + to_string(i % 997 + 1) + "+" + to_string(i % 13) + "-(" +
+                       to_string(i % 101) + "+7)*" + to_string(i % 31));
+    mixed.push_back(i % 2 == 0? integers.back() : to_string(i % 997) + "+" + to_string(i % 13) + "*(" +
+                                                  to_string(i % 101) + ".5-3)/7");
+  }
+  for (const vector<string>* lines : {&integers, &mixed}) {
+    Calculator<double> plain;
+    char text[kMaxFormattedLength], mixed_text[kMaxFormattedLength];
+    size_t different = 0;
+    for (const string& line : *lines) {
+      string_view expected(text, FormatBestPrecision(plain.Calculate(line), text, sizeof(text)));
+      string_view got(mixed_text, FormatBestPrecision(calculator.Calculate(line), mixed_text, sizeof(mixed_text)));
+      if (got != expected) different++;
+    }
+    size_t length = 0;   // use the results, so the compiler can't skip the loops.
+    double plain_seconds = 1e9, mixed_seconds = 1e9;
+    for (int round = 0; round < 5; round++) {
+      auto start = chrono::steady_clock::now();
+      for (const string& line : *lines) length += FormatBestPrecision(plain.Calculate(line), text, sizeof(text));
+      auto middle = chrono::steady_clock::now();
+      for (const string& line : *lines) length += FormatBestPrecision(calculator.Calculate(line), text, sizeof(text));
+      auto end = chrono::steady_clock::now();
+      plain_seconds = min(plain_seconds, chrono::duration<double>(middle - start).count());
+      mixed_seconds = min(mixed_seconds, chrono::duration<double>(end - middle).count());
+    }
+    double speedup = plain_seconds / mixed_seconds;
+    double minimum = lines == &integers? 1.05 : 0.95;
+    cout << (lines == &integers? "integer expressions : " : "mixed expressions : ") << kLines / mixed_seconds / 1e6
+         << " M lines/s against " << kLines / plain_seconds / 1e6 << " M lines/s as double, x" << speedup << ", "
+         << different << " different results (length " << length << ")"
+         << (different == 0 && speedup >= minimum? " (OK)" : " (FAILED)") << endl;
+  }
 }
 
-#endif
\ No newline at end of file
+#endif